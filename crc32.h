@@ -0,0 +1,21 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+/// Initial value for <see cref="UpdateCrc32" />.
+/// </summary>
+#define CRC32_INITIAL_VALUE 0xFFFFFFFFu
+
+/// <summary>
+/// Update a standard CRC-32 (as used by zlib) with more data. Start with
+/// CRC32_INITIAL_VALUE and invert the final value.
+/// </summary>
+/// <param name="crc">CRC of the preceding data.</param>
+/// <param name="data">Data to add.</param>
+/// <param name="length">Length of data in bytes.</param>
+/// <returns>The updated CRC.</returns>
+uint32_t UpdateCrc32(uint32_t crc, const void *data, size_t length);
@@ -0,0 +1,108 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <string.h>
+
+#include "latency_histogram.h"
+
+#define SUB_BUCKET_COUNT (1u << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+#define MAX_VALUE ((1u << LATENCY_HISTOGRAM_MAX_VALUE_BITS) - 1)
+
+static unsigned int GetMostSignificantBit(uint32_t value)
+{
+    unsigned int bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+}
+
+// Bucket b < SUB_BUCKET_COUNT holds the value b. Above that, the power of two 2^m is split
+// into SUB_BUCKET_COUNT buckets starting at (m - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT.
+static unsigned int GetBucketIndex(uint32_t value)
+{
+    if (value > MAX_VALUE) {
+        value = MAX_VALUE;
+    }
+    if (value < SUB_BUCKET_COUNT) {
+        return value;
+    }
+
+    unsigned int msb = GetMostSignificantBit(value);
+    unsigned int shift = msb - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+    return ((shift + 1) << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) +
+           ((value >> shift) & (SUB_BUCKET_COUNT - 1));
+}
+
+static uint32_t GetBucketUpperBound(unsigned int index)
+{
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+
+    unsigned int shift = (index >> LATENCY_HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    uint32_t lowerBound = (SUB_BUCKET_COUNT | (index & (SUB_BUCKET_COUNT - 1))) << shift;
+    return lowerBound + ((1u << shift) - 1);
+}
+
+void InitLatencyHistogram(LatencyHistogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void RecordLatencyHistogramValue(LatencyHistogram *histogram, uint32_t value)
+{
+    histogram->counts[GetBucketIndex(value)]++;
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->count++;
+    histogram->total += value;
+}
+
+uint32_t GetLatencyHistogramPercentile(const LatencyHistogram *histogram, double percentile)
+{
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    if (percentile < 0) {
+        percentile = 0;
+    } else if (percentile > 100) {
+        percentile = 100;
+    }
+
+    // Rank of the percentile value, counting from 1.
+    uint32_t rank = (uint32_t)(percentile / 100.0 * histogram->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint32_t seen = 0;
+    for (unsigned int i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            if (i == LATENCY_HISTOGRAM_BUCKET_COUNT - 1) {
+                // The last bucket also holds values above its range.
+                return histogram->max;
+            }
+            uint32_t upperBound = GetBucketUpperBound(i);
+            return upperBound < histogram->max ? upperBound : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void GetLatencyHistogramStats(const LatencyHistogram *histogram, LatencyHistogramStats *stats)
+{
+    stats->count = histogram->count;
+    stats->min = histogram->min;
+    stats->max = histogram->max;
+    stats->mean = histogram->count == 0 ? 0 : (uint32_t)(histogram->total / histogram->count);
+    stats->p50 = GetLatencyHistogramPercentile(histogram, 50);
+    stats->p90 = GetLatencyHistogramPercentile(histogram, 90);
+    stats->p99 = GetLatencyHistogramPercentile(histogram, 99);
+}
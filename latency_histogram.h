@@ -0,0 +1,78 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+#include <stdint.h>
+
+// Values below 2^LATENCY_HISTOGRAM_SUB_BUCKET_BITS are counted exactly. Above that, each power
+// of two is split into 2^LATENCY_HISTOGRAM_SUB_BUCKET_BITS equal buckets, so a value is known
+// to within 1/8 (12.5%) of itself. Values of 2^LATENCY_HISTOGRAM_MAX_VALUE_BITS and above are
+// counted in the last bucket.
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 3
+#define LATENCY_HISTOGRAM_MAX_VALUE_BITS 22
+#define LATENCY_HISTOGRAM_BUCKET_COUNT                                                         \
+    ((LATENCY_HISTOGRAM_MAX_VALUE_BITS - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1)               \
+     << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+
+/// <summary>
+/// Fixed-memory log-linear histogram of latencies, such as milliseconds from enqueue to
+/// confirmation. Recording a value never allocates and takes constant time. Treat the
+/// members as private; the type is only declared here so that it can be statically allocated.
+/// </summary>
+typedef struct {
+    uint32_t counts[LATENCY_HISTOGRAM_BUCKET_COUNT];
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} LatencyHistogram;
+
+/// <summary>
+/// Summary statistics of a histogram. Percentiles are the upper bound of the bucket the
+/// percentile falls in, so they over- rather than under-estimate.
+/// </summary>
+typedef struct {
+    /// <summary>Number of recorded values.</summary>
+    uint32_t count;
+    /// <summary>Smallest recorded value, or 0 if there are none.</summary>
+    uint32_t min;
+    /// <summary>Largest recorded value, or 0 if there are none.</summary>
+    uint32_t max;
+    /// <summary>Mean of the recorded values, or 0 if there are none.</summary>
+    uint32_t mean;
+    /// <summary>50th percentile.</summary>
+    uint32_t p50;
+    /// <summary>90th percentile.</summary>
+    uint32_t p90;
+    /// <summary>99th percentile.</summary>
+    uint32_t p99;
+} LatencyHistogramStats;
+
+/// <summary>
+/// Initialize a histogram, or discard all values recorded in it.
+/// </summary>
+/// <param name="histogram">Histogram to initialize.</param>
+void InitLatencyHistogram(LatencyHistogram *histogram);
+
+/// <summary>
+/// Record a value.
+/// </summary>
+/// <param name="histogram">Initialized histogram.</param>
+/// <param name="value">Value to record.</param>
+void RecordLatencyHistogramValue(LatencyHistogram *histogram, uint32_t value);
+
+/// <summary>
+/// Get the value below which the given percentage of recorded values fall.
+/// </summary>
+/// <param name="histogram">Initialized histogram.</param>
+/// <param name="percentile">Percentile, from 0 to 100.</param>
+/// <returns>Upper bound of the bucket holding the percentile, clamped to the largest recorded
+/// value, or 0 if no values have been recorded.</returns>
+uint32_t GetLatencyHistogramPercentile(const LatencyHistogram *histogram, double percentile);
+
+/// <summary>
+/// Get summary statistics.
+/// </summary>
+/// <param name="histogram">Initialized histogram.</param>
+/// <param name="stats">Receives the statistics.</param>
+void GetLatencyHistogramStats(const LatencyHistogram *histogram, LatencyHistogramStats *stats);
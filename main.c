@@ -37,13 +37,19 @@
 #include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/eventfd.h>
+
 // applibs_versions.h defines the API struct versions to use for applibs APIs.
 #include "applibs_versions.h"
 #include <applibs/eventloop.h>
@@ -67,7 +73,12 @@
 //#include <hw/sample_appliance.h> //CHANGED THIS
 
 #include "eventloop_timer_utilities.h"
+#include "latency_histogram.h"
 #include "parson.h" // Used to parse Device Twin messages.
+#include "provisioning_cache.h"
+#include "telemetry_batch.h"
+#include "telemetry_ring_buffer.h"
+#include "telemetry_store.h"
 
 // Azure IoT SDK
 #include <iothub_client_core_common.h>
@@ -75,8 +86,10 @@
 #include <iothub_client_options.h>
 #include <iothubtransportmqtt.h>
 #include <iothub.h>
-#include <azure_sphere_provisioning.h>
 #include <iothub_security_factory.h>
+#include <prov_device_ll_client.h>
+#include <prov_security_factory.h>
+#include <prov_transport_mqtt_client.h>
 #include <shared_util_options.h>
 
 
@@ -126,7 +139,27 @@ typedef enum {
     ExitCode_IoTEdgeRootCa_MemoryAllocation_Failed = 20,
     ExitCode_IoTEdgeRootCa_FileRead_Failed = 21,
 
-    ExitCode_PayloadSize_TooLarge = 22,
+    ExitCode_Init_TelemetryBatch = 23,
+    ExitCode_Init_TelemetryBatchTimer = 24,
+    ExitCode_TelemetryBatchTimer_Consume = 25,
+
+    ExitCode_Init_MetricsTimer = 26,
+    ExitCode_MetricsTimer_Consume = 27,
+
+    ExitCode_Init_TelemetryStoreFlushTimer = 28,
+    ExitCode_TelemetryStoreFlushTimer_Consume = 29,
+
+    ExitCode_Init_ConnectionSetupEvent = 30,
+    ExitCode_ConnectionSetupEvent_Read = 31,
+
+    ExitCode_Init_ReconnectTimer = 32,
+    ExitCode_ReconnectTimer_Consume = 33,
+
+    ExitCode_Init_DoWorkTimer = 34,
+    ExitCode_DoWorkTimer_Consume = 35,
+
+    ExitCode_Init_TwinJsonArena = 36,
+    ExitCode_Init_TwinJsonPaths = 37,
 } ExitCode;
 
 static volatile sig_atomic_t exitCode = ExitCode_Success;
@@ -142,16 +175,18 @@ typedef enum {
 } ConnectionType;
 
 /// <summary>
-/// Authentication state of the client with respect to the Azure IoT Hub.
+/// State of the connection to the Azure IoT Hub.
 /// </summary>
 typedef enum {
-    /// <summary>Client is not authenticated by the Azure IoT Hub.</summary>
-    IoTHubClientAuthenticationState_NotAuthenticated = 0,
+    /// <summary>There is no client, or the Azure IoT Hub has rejected it.</summary>
+    ConnectionState_Disconnected = 0,
+    /// <summary>The connection setup thread is provisioning and creating the client.</summary>
+    ConnectionState_Connecting = 1,
     /// <summary>Client has initiated authentication to the Azure IoT Hub.</summary>
-    IoTHubClientAuthenticationState_AuthenticationInitiated = 1,
+    ConnectionState_Authenticating = 2,
     /// <summary>Client is authenticated by the Azure IoT Hub.</summary>
-    IoTHubClientAuthenticationState_Authenticated = 2
-} IoTHubClientAuthenticationState;
+    ConnectionState_Authenticated = 3
+} ConnectionState;
 
 // Azure IoT definitions.
 static char *scopeId = NULL;  // ScopeId for DPS.
@@ -159,15 +194,56 @@ static char *hostName = NULL; // Azure IoT Hub or IoT Edge Hostname.
 static ConnectionType connectionType = ConnectionType_NotDefined; // Type of connection to use.
 static char *iotEdgeRootCAPath = NULL; // Path (including filename) of the IotEdge cert.
 static char *ioTEdgeRootCACertContent = NULL;
-static IoTHubClientAuthenticationState iotHubClientAuthenticationState =
-    IoTHubClientAuthenticationState_NotAuthenticated; // Authentication state with respect to the
-                                                      // IoT Hub.
+static ConnectionState connectionState = ConnectionState_Disconnected;
 
 static IOTHUB_DEVICE_CLIENT_LL_HANDLE iothubClientHandle = NULL;
 static const int deviceIdForDaaCertUsage = 1; // A constant used to direct the IoT SDK to use
                                               // the DAA cert under the hood.
 static const char networkInterface[] = "wlan0";
 
+// DPS provisioning. The IoT Hub assigned by DPS is cached in mutable storage, and later
+// connections go straight to that hub. DPS runs again when the hub rejects the device's
+// credentials, or after MaxCachedHubConnectAttempts attempts to connect to it have failed.
+static const char dpsGlobalEndpoint[] = "global.azure-devices-provisioning.net";
+static const int DpsRegistrationTimeoutMilliseconds = 10000;
+static const int DpsDoWorkPeriodMilliseconds = 100;
+static const int MaxCachedHubConnectAttempts = 3;
+#define MAX_HUB_HOSTNAME_SIZE 256
+static char provisionedHubHostName[MAX_HUB_HOSTNAME_SIZE]; // empty if not provisioned
+static bool isUsingProvisionedHub = false;
+static int cachedHubConnectAttempts = 0;
+
+/// <summary>
+/// Progress of a DPS registration, passed to RegisterDeviceCallback().
+/// </summary>
+typedef struct {
+    bool isComplete;
+    PROV_DEVICE_RESULT result;
+    char *hubHostName;
+    size_t hubHostNameSize;
+} DpsRegistration;
+
+// Provisioning and creating the client block for seconds, so they run on a connection setup
+// thread while the event loop keeps running. The thread reads and writes connectionSetup only;
+// the event loop reads it back once connectionSetupEventFd is signalled and the thread is
+// joined.
+typedef struct {
+    // In: register with DPS before creating the client.
+    bool isProvisioningRequired;
+    // In: hub to connect to. Out: hub assigned by DPS.
+    char hubHostName[MAX_HUB_HOSTNAME_SIZE];
+    // Out: DPS assigned hubHostName.
+    bool isProvisioned;
+    // Out: the new client, or NULL if it could not be created.
+    IOTHUB_DEVICE_CLIENT_LL_HANDLE clientHandle;
+} ConnectionSetup;
+
+static ConnectionSetup connectionSetup;
+static pthread_t connectionSetupThread;
+static int connectionSetupEventFd = -1;
+static EventRegistration *connectionSetupEventReg = NULL;
+static atomic_bool isConnectionSetupCancelled = false;
+
 // Function declarations
 static void SendEventCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context);
 static void DeviceTwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char *payload,
@@ -178,18 +254,53 @@ static int DeviceMethodCallback(const char *methodName, const unsigned char *pay
                                 size_t payloadSize, unsigned char **response, size_t *responseSize,
                                 void *userContextCallback);
 static const char *GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason);
-static const char *GetAzureSphereProvisioningResultString(
-    AZURE_SPHERE_PROV_RETURN_VALUE provisioningResult);
-static void SendTelemetry(const char *jsonMessage);
-static void SetUpAzureIoTHubClient(void);
+static void SendTelemetry(const char *jsonMessage, size_t length);
+static bool SendTelemetryMessage(const char *jsonMessage, size_t length, uint32_t storeSequence);
+static void BufferTelemetry(const char *jsonMessage, size_t length);
+static void DrainTelemetryBacklog(void);
+static void RewindStoredTelemetry(void);
+static void AcknowledgeStoredTelemetry(void);
+static bool IsStoredTelemetryPending(void);
+static void UpdateTelemetryBacklogSettings(const JSON_Object *desiredProperties);
+static void MetricsTimerEventHandler(EventLoopTimer *timer);
+static void OpenMutableStorage(void);
+static void TelemetryStoreFlushTimerEventHandler(EventLoopTimer *timer);
+static void ReportTelemetryMetrics(void);
+static void QueueTelemetrySample(const char *jsonSample, size_t length);
+static void QueueTemperatureSample(float temperature);
+static void SendTelemetryBatch(const char *json, size_t length, size_t sampleCount);
+static void TelemetryBatchTimerEventHandler(EventLoopTimer *timer);
+static void UpdateTelemetryBatchSettings(const JSON_Object *desiredProperties);
+static uint64_t GetTimestampMilliseconds(void);
+static void StartAzureIoTHubClientSetUp(void);
+static void *ConnectionSetupThread(void *arg);
+static void ConnectionSetupCompleteEventHandler(EventLoop *el, int fd, EventLoop_IoEvents events,
+                                                void *context);
+static void ScheduleAzureIoTHubReconnect(void);
+static void ReconnectTimerEventHandler(EventLoopTimer *timer);
+static void RequestAzureIoTDoWork(void);
+static void ScheduleAzureIoTDoWork(uint32_t delayMilliseconds);
+static void DoWorkTimerEventHandler(EventLoopTimer *timer);
+static void UpdateDoWorkSettings(const JSON_Object *desiredProperties);
+static struct SendContext *AcquireSendContext(size_t length);
+static uint32_t ReleaseSendContext(struct SendContext *sendContext);
+static void ReleaseAllSendContexts(void);
+static bool IsSendWindowFull(size_t length);
+static unsigned int GetSendWindowOccupancyPercent(void);
+static void UpdateSendWindowSettings(const JSON_Object *desiredProperties);
+static uint64_t GetMonotonicMilliseconds(void);
+static void StopAzureIoTHubClientSetUp(void);
 static void SendSimulatedTelemetry(void);
 static void ButtonPollTimerEventHandler(EventLoopTimer *timer);
 static bool IsButtonPressed(int fd, GPIO_Value_Type *oldState);
 static void AzureTimerEventHandler(EventLoopTimer *timer);
 static ExitCode ValidateUserConfiguration(void);
 static void ParseCommandLineArguments(int argc, char *argv[]);
-static bool SetUpAzureIoTHubClientWithDaa(void);
-static bool SetUpAzureIoTHubClientWithDps(void);
+static IOTHUB_DEVICE_CLIENT_LL_HANDLE CreateAzureIoTHubClientWithDaa(const char *hubHostName);
+static bool ProvisionWithDps(char *hubHostName, size_t hubHostNameSize);
+static void RegisterDeviceCallback(PROV_DEVICE_RESULT registerResult, const char *iotHubUri,
+                                   const char *deviceId, void *userContext);
+static void InvalidateProvisioningCache(void);
 static bool IsConnectionReadyToSendTelemetry(void);
 static ExitCode ReadIoTEdgeCaCertContent(void);
 
@@ -213,23 +324,159 @@ static int deviceTwinStatusLedGpioFd = -1;
 static EventLoop *eventLoop = NULL;
 static EventLoopTimer *buttonPollTimer = NULL;
 static EventLoopTimer *azureTimer = NULL;
-
-// Azure IoT poll periods
+static EventLoopTimer *reconnectTimer = NULL;
+static EventLoopTimer *doWorkTimer = NULL;
+static EventLoopTimer *telemetryBatchTimer = NULL;
+static EventLoopTimer *metricsTimer = NULL;
+static EventLoopTimer *telemetryStoreFlushTimer = NULL;
+
+// Azure IoT poll periods. The poll timer runs at a steady rate whether or not the client is
+// connected; connection attempts are scheduled separately by reconnectTimer.
 static const int AzureIoTDefaultPollPeriodSeconds = 1;        // poll azure iot every second
 static const int AzureIoTPollPeriodsPerTelemetry = 5;         // only send telemetry 1/5 of polls
-static const int AzureIoTMinReconnectPeriodSeconds = 60;      // back off when reconnecting
+static const int AzureIoTMinReconnectPeriodSeconds = 5;       // back off when reconnecting
 static const int AzureIoTMaxReconnectPeriodSeconds = 10 * 60; // back off limit
+static const int AzureIoTMetricsReportPeriodSeconds = 5 * 60; // report telemetry metrics
+static const int TelemetryStoreFlushPeriodSeconds = 30;       // persist buffered telemetry
 
-static int azureIoTPollPeriodSeconds = -1;
 static int telemetryCount = 0;
+static uint32_t reconnectDelayMilliseconds = 0; // previous backoff delay; 0 after connecting
+static unsigned int reconnectJitterSeed = 0;
+
+// IoTHubDeviceClient_LL_DoWork() is pumped by doWorkTimer. It runs straight after a message,
+// reported property or method response is enqueued, every AzureIoTBusyDoWorkPeriodMilliseconds
+// while any of them are waiting for the hub, and otherwise backs off by doubling up to
+// doWorkMaxPeriodMilliseconds. The maximum period bounds how long incoming messages wait to be
+// processed; it is updated at runtime from the DoWorkMaxPeriodMilliseconds desired property.
+static const uint32_t AzureIoTBusyDoWorkPeriodMilliseconds = 100;
+static const uint32_t AzureIoTMaxDoWorkPeriodLimitMilliseconds = 60 * 1000;
+static uint32_t doWorkMaxPeriodMilliseconds = 1000;
+static uint32_t doWorkIdlePeriodMilliseconds = 100;
+static uint64_t doWorkDeadlineMilliseconds = 0;  // when doWorkTimer fires; 0 if disarmed
+static uint64_t doWorkRequestedMilliseconds = 0; // oldest enqueue not yet pumped; 0 if none
+static unsigned int inFlightTelemetryCount = 0;
+static unsigned int inFlightTwinReportCount = 0;
+
+// Every telemetry message and reported property handed to the Azure IoT Hub client carries a
+// SendContext from this pool as its callback context; the confirmation callback returns it to
+// the pool. Enqueue-to-confirmation latencies are collected in histograms, which are reset
+// each time they are reported.
+#define SEND_CONTEXT_POOL_SIZE 32
+// Contexts which the largest telemetry send window leaves for reported properties, so that
+// telemetry does not run out of contexts. A device twin update reports up to five settings.
+#define TWIN_REPORT_SEND_CONTEXT_RESERVE 8
+typedef struct SendContext {
+    bool isInUse;
+    uint32_t sequence;      // increments for every message, for correlating log lines
+    uint32_t storeSequence; // sequence number in the telemetry store, or 0
+    size_t length;
+    uint64_t enqueueTimeMilliseconds;
+} SendContext;
+static SendContext sendContextPool[SEND_CONTEXT_POOL_SIZE];
+static uint32_t nextSendSequence = 1;
+static size_t inFlightTelemetryBytes = 0;
+static unsigned int inFlightTelemetryHighWaterMark = 0;
+static uint32_t telemetryConfirmationCounts[IOTHUB_CLIENT_CONFIRMATION_ERROR + 1];
+static uint32_t twinReportErrorCount = 0;
+static LatencyHistogram telemetryLatencyHistogram;
+static LatencyHistogram twinReportLatencyHistogram;
+
+// Send window: telemetry is only handed to the Azure IoT Hub client while fewer than
+// telemetryMaxInFlight messages and telemetryMaxInFlightBytes bytes are waiting for
+// confirmation, so that a slow link cannot fill the SDK's heap. Telemetry which does not fit is
+// buffered locally. These are updated at runtime from the TelemetryMaxInFlight and
+// TelemetryMaxInFlightBytes desired properties; the count is limited by the send context pool.
+static const size_t TelemetryMaxInFlightBytesLimit = 64 * 1024;
+static unsigned int telemetryMaxInFlight = 8;
+static size_t telemetryMaxInFlightBytes = 8 * 1024;
+static uint32_t sendWindowFullCount = 0;
+
+// Enqueue-to-wire latency: time from an enqueue to the DoWork call which sends it.
+static uint32_t doWorkCount = 0;
+static uint32_t pumpLatencyCount = 0;
+static uint64_t pumpLatencyTotalMilliseconds = 0;
+static uint32_t pumpLatencyMaxMilliseconds = 0;
+
+// Telemetry batching. A batch size of 1 sends every sample as its own message.
+// These are updated at runtime from the TelemetryBatchSize, TelemetryBatchPeriodSeconds and
+// TelemetryBatchMaxBytes desired properties, within these limits; the batch size in bytes is
+// limited by TELEMETRY_BUFFER_SIZE and TELEMETRY_BATCH_BUFFER_SIZE.
+static const int TelemetryBatchSizeLimit = 256;
+static const int TelemetryBatchPeriodLimitSeconds = 24 * 60 * 60;
+static TelemetryBatch *telemetryBatch = NULL;
+static int telemetryBatchSize = 1;
+static int telemetryBatchPeriodSeconds = 60;
+static int telemetryBatchMaxBytes = -1;
+
+// Store-and-forward: telemetry which cannot be sent is held here and drained at
+// telemetryBacklogDrainRate messages per second once the client is authenticated again.
+// These are updated at runtime from the TelemetryBacklogOverflowPolicy and
+// TelemetryBacklogDrainRate desired properties; the drain rate is limited to
+// TelemetryBacklogDrainRateLimit.
+#define TELEMETRY_RING_BUFFER_SIZE (16 * 1024)
+static uint8_t telemetryRingBufferStorage[TELEMETRY_RING_BUFFER_SIZE];
+static TelemetryRingBuffer telemetryRingBuffer;
+static const int TelemetryBacklogDrainRateLimit = 100;
+static int telemetryBacklogDrainRate = 2;
+
+// Buffered telemetry is persisted in the application's mutable storage so that it survives a
+// reboot during an outage. The RAM ring buffer is used when mutable storage is unavailable or
+// full. Appends are written to storage in batches, at least every
+// TelemetryStoreFlushPeriodSeconds.
+// Mutable storage layout: the DPS provisioning cache, followed by the telemetry store.
+#define MUTABLE_STORAGE_SIZE (64 * 1024) // must match MutableStorage in app_manifest.json
+#define PROVISIONING_CACHE_OFFSET 0
+#define TELEMETRY_STORE_OFFSET (PROVISIONING_CACHE_OFFSET + PROVISIONING_CACHE_SIZE)
+#define TELEMETRY_STORE_SIZE (MUTABLE_STORAGE_SIZE - TELEMETRY_STORE_OFFSET)
+static int mutableStorageFd = -1;
+static TelemetryStore *telemetryStore = NULL;
+static bool hasStoredTelemetryReadAhead = false; // read from the store but not sent yet
+
+// The store acknowledges records cumulatively, but stored messages in flight can be confirmed in
+// any order, so a record is only acknowledged once it and every record before it have been
+// delivered. Each rewind starts a new pass over the store from the oldest unacknowledged record;
+// confirmations of messages above a failed one are not acknowledged until the pass has sent them
+// again.
+static uint32_t storedTelemetrySentSequence = 0; // newest record sent in this pass, or 0
+static uint32_t storedTelemetryAcknowledgedSequence = 0; // newest record acknowledged
+
+// Device twin documents are parsed into this arena and released in one go after each update.
+// The arena settles on a single block big enough for the largest document, so steady-state
+// twin updates don't allocate.
+#define TWIN_JSON_ARENA_SIZE 2048
+static JSON_Arena *twinJsonArena = NULL;
+
+// Properties read on every device twin update, as paths compiled once at startup.
+static JSON_Path *twinDesiredPath = NULL;
+static JSON_Path *twinStatusLedPath = NULL;
+
+// Desired properties the device uses. A full twin document has them under "desired", while a patch
+// of desired properties has them at the top, so twin updates are parsed with a path to each in
+// both places; everything else, such as "reported" and "$metadata", is skipped without being built.
+// A property read by an Update*Settings function must be listed here.
+static const char *const twinDesiredPropertyNames[] = {"StatusLED",
+                                                       "DoWorkMaxPeriodMilliseconds",
+                                                       "TelemetryMaxInFlight",
+                                                       "TelemetryMaxInFlightBytes",
+                                                       "TelemetryBacklogOverflowPolicy",
+                                                       "TelemetryBacklogDrainRate",
+                                                       "TelemetryBatchSize",
+                                                       "TelemetryBatchPeriodSeconds",
+                                                       "TelemetryBatchMaxBytes"};
+#define TWIN_DESIRED_PROPERTY_COUNT \
+    (sizeof(twinDesiredPropertyNames) / sizeof(twinDesiredPropertyNames[0]))
+#define TWIN_PROJECTION_PATH_COUNT (2 * TWIN_DESIRED_PROPERTY_COUNT)
+static JSON_Path *twinProjectionPaths[TWIN_PROJECTION_PATH_COUNT] = {NULL};
 
 // State variables
 static GPIO_Value_Type sendMessageButtonState = GPIO_Value_High;
 static bool statusLedOn = false;
 
 // Constants
-#define MAX_DEVICE_TWIN_PAYLOAD_SIZE 512
 #define TELEMETRY_BUFFER_SIZE 100
+#define TELEMETRY_BATCH_BUFFER_SIZE 4096
+#define TWIN_REPORT_BUFFER_SIZE 256
+#define TELEMETRY_METRICS_BUFFER_SIZE 1280
 
 // Usage text for command line arguments in application manifest.
 static const char *cmdLineArgsUsageText =
@@ -305,7 +552,8 @@ static void ButtonPollTimerEventHandler(EventLoopTimer *timer)
     }
 
     if (IsButtonPressed(sendMessageButtonGpioFd, &sendMessageButtonState)) {
-        SendTelemetry("{\"ButtonPress\" : \"True\"}");
+        static const char buttonPressMessage[] = "{\"ButtonPress\" : \"True\"}";
+        SendTelemetry(buttonPressMessage, sizeof(buttonPressMessage) - 1);
     }
 }
 
@@ -319,34 +567,133 @@ static void AzureTimerEventHandler(EventLoopTimer *timer)
         return;
     }
 
-    // Check whether the device is connected to the internet.
-    Networking_InterfaceConnectionStatus status;
-    if (Networking_GetInterfaceConnectionStatus(networkInterface, &status) == 0) {
-        if ((status & Networking_InterfaceConnectionStatus_ConnectedToInternet) &&
-            (iotHubClientAuthenticationState == IoTHubClientAuthenticationState_NotAuthenticated)) {
-            SetUpAzureIoTHubClient();
-        }
-    } else {
-        if (errno != EAGAIN) {
-            Log_Debug("ERROR: Networking_GetInterfaceConnectionStatus: %d (%s)\n", errno,
-                      strerror(errno));
-            exitCode = ExitCode_InterfaceConnectionStatus_Failed;
-            return;
-        }
+    if (connectionState == ConnectionState_Authenticated) {
+        DrainTelemetryBacklog();
+    }
+
+    // Keep sampling while disconnected; SendTelemetry() buffers the samples until the client
+    // is authenticated again.
+    telemetryCount++;
+    if (telemetryCount == AzureIoTPollPeriodsPerTelemetry) {
+        telemetryCount = 0;
+        //SendSimulatedTelemetry();
+        SendRealTemeletry();
+    }
+}
+
+/// <summary>
+///     Requests that IoTHubDeviceClient_LL_DoWork() runs as soon as the event loop is idle, so
+///     that work which was just enqueued goes out without waiting for the next poll. DoWork()
+///     is not called directly because this may be called from within an SDK callback.
+/// </summary>
+static void RequestAzureIoTDoWork(void)
+{
+    if (doWorkRequestedMilliseconds == 0) {
+        doWorkRequestedMilliseconds = GetMonotonicMilliseconds();
+    }
+    doWorkIdlePeriodMilliseconds = AzureIoTBusyDoWorkPeriodMilliseconds;
+    ScheduleAzureIoTDoWork(0);
+}
+
+/// <summary>
+///     Arms doWorkTimer to fire after the given delay, unless it is already due sooner.
+/// </summary>
+/// <param name="delayMilliseconds">Delay; 0 runs DoWork on the next event loop iteration</param>
+static void ScheduleAzureIoTDoWork(uint32_t delayMilliseconds)
+{
+    uint64_t deadline = GetMonotonicMilliseconds() + delayMilliseconds;
+    if (doWorkDeadlineMilliseconds != 0 && doWorkDeadlineMilliseconds <= deadline) {
+        return;
+    }
+
+    // A zero delay would disarm the timer, so use the shortest delay instead.
+    struct timespec delay = {.tv_sec = delayMilliseconds / 1000,
+                             .tv_nsec = (long)(delayMilliseconds % 1000) * 1000 * 1000};
+    if (delayMilliseconds == 0) {
+        delay.tv_nsec = 1;
+    }
+    if (SetEventLoopTimerOneShot(doWorkTimer, &delay) == 0) {
+        doWorkDeadlineMilliseconds = deadline;
+    }
+}
+
+/// <summary>
+///     DoWork timer event: pumps the Azure IoT Hub client and schedules the next pump based on
+///     the work still outstanding.
+/// </summary>
+static void DoWorkTimerEventHandler(EventLoopTimer *timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_DoWorkTimer_Consume;
+        return;
     }
+    doWorkDeadlineMilliseconds = 0;
 
-    if (iotHubClientAuthenticationState == IoTHubClientAuthenticationState_Authenticated) {
-        telemetryCount++;
-        if (telemetryCount == AzureIoTPollPeriodsPerTelemetry) {
-            telemetryCount = 0;
-            //SendSimulatedTelemetry();
-            SendRealTemeletry();
+    if (iothubClientHandle == NULL) {
+        // Nothing to pump until a client is created.
+        doWorkRequestedMilliseconds = 0;
+        return;
+    }
+
+    if (doWorkRequestedMilliseconds != 0) {
+        uint64_t latency = GetMonotonicMilliseconds() - doWorkRequestedMilliseconds;
+        doWorkRequestedMilliseconds = 0;
+        pumpLatencyCount++;
+        pumpLatencyTotalMilliseconds += latency;
+        if (latency > pumpLatencyMaxMilliseconds) {
+            pumpLatencyMaxMilliseconds = (uint32_t)latency;
         }
     }
 
-    if (iothubClientHandle != NULL) {
-        IoTHubDeviceClient_LL_DoWork(iothubClientHandle);
+    doWorkCount++;
+    IoTHubDeviceClient_LL_DoWork(iothubClientHandle);
+
+    // Callbacks run inside DoWork() may have enqueued more work and rescheduled the timer.
+    if (inFlightTelemetryCount > 0 || inFlightTwinReportCount > 0 ||
+        connectionState == ConnectionState_Authenticating) {
+        doWorkIdlePeriodMilliseconds = AzureIoTBusyDoWorkPeriodMilliseconds;
+        ScheduleAzureIoTDoWork(AzureIoTBusyDoWorkPeriodMilliseconds);
+        return;
+    }
+
+    ScheduleAzureIoTDoWork(doWorkIdlePeriodMilliseconds);
+    doWorkIdlePeriodMilliseconds *= 2;
+    if (doWorkIdlePeriodMilliseconds > doWorkMaxPeriodMilliseconds) {
+        doWorkIdlePeriodMilliseconds = doWorkMaxPeriodMilliseconds;
+    }
+}
+
+/// <summary>
+///     Applies the DoWorkMaxPeriodMilliseconds desired property, if present, and reports the
+///     setting in effect.
+/// </summary>
+static void UpdateDoWorkSettings(const JSON_Object *desiredProperties)
+{
+    static char reportedPropertiesString[TWIN_REPORT_BUFFER_SIZE];
+
+    if (!json_object_has_value_of_type(desiredProperties, "DoWorkMaxPeriodMilliseconds",
+                                       JSONNumber)) {
+        return;
+    }
+
+    double period = json_object_get_number(desiredProperties, "DoWorkMaxPeriodMilliseconds");
+    if (period < AzureIoTBusyDoWorkPeriodMilliseconds) {
+        period = AzureIoTBusyDoWorkPeriodMilliseconds;
+    } else if (period > AzureIoTMaxDoWorkPeriodLimitMilliseconds) {
+        period = AzureIoTMaxDoWorkPeriodLimitMilliseconds;
+    }
+    doWorkMaxPeriodMilliseconds = (uint32_t)period;
+    if (doWorkIdlePeriodMilliseconds > doWorkMaxPeriodMilliseconds) {
+        doWorkIdlePeriodMilliseconds = doWorkMaxPeriodMilliseconds;
     }
+
+    int len = snprintf(reportedPropertiesString, TWIN_REPORT_BUFFER_SIZE,
+                       "{\"DoWorkMaxPeriodMilliseconds\":%u}", doWorkMaxPeriodMilliseconds);
+    if (len < 0 || len >= TWIN_REPORT_BUFFER_SIZE) {
+        Log_Debug("ERROR: Cannot write reported properties to buffer.\n");
+        return;
+    }
+    TwinReportState(reportedPropertiesString);
 }
 
 /// <summary>
@@ -503,14 +850,110 @@ static ExitCode InitPeripheralsAndHandlers(void)
     //     return ExitCode_Init_ButtonPollTimer;
     // }
 
-    azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
-    struct timespec azureTelemetryPeriod = {.tv_sec = azureIoTPollPeriodSeconds, .tv_nsec = 0};
+    // Signalled by the connection setup thread when it has finished.
+    connectionSetupEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (connectionSetupEventFd == -1) {
+        Log_Debug("ERROR: Could not create connection setup event: %s (%d).\n", strerror(errno),
+                  errno);
+        return ExitCode_Init_ConnectionSetupEvent;
+    }
+    connectionSetupEventReg = EventLoop_RegisterIo(eventLoop, connectionSetupEventFd,
+                                                   EventLoop_Input,
+                                                   &ConnectionSetupCompleteEventHandler, NULL);
+    if (connectionSetupEventReg == NULL) {
+        Log_Debug("ERROR: Could not register connection setup event: %s (%d).\n",
+                  strerror(errno), errno);
+        return ExitCode_Init_ConnectionSetupEvent;
+    }
+
+    struct timespec azureTelemetryPeriod = {.tv_sec = AzureIoTDefaultPollPeriodSeconds,
+                                            .tv_nsec = 0};
     azureTimer =
         CreateEventLoopPeriodicTimer(eventLoop, &AzureTimerEventHandler, &azureTelemetryPeriod);
     if (azureTimer == NULL) {
         return ExitCode_Init_AzureTimer;
     }
 
+    // Devices which boot together may share a wall clock time, but not the nanoseconds of their
+    // uptime, so mix both into the seed for the reconnect jitter.
+    struct timespec realTime, monotonicTime;
+    clock_gettime(CLOCK_REALTIME, &realTime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonicTime);
+    reconnectJitterSeed = (unsigned int)(realTime.tv_sec ^ realTime.tv_nsec ^
+                                         monotonicTime.tv_nsec ^ (monotonicTime.tv_sec << 16));
+
+    // The first connection attempt is made after one poll period, as before.
+    reconnectTimer = CreateEventLoopDisarmedTimer(eventLoop, &ReconnectTimerEventHandler);
+    if (reconnectTimer == NULL) {
+        return ExitCode_Init_ReconnectTimer;
+    }
+    struct timespec firstConnectDelay = {.tv_sec = AzureIoTDefaultPollPeriodSeconds, .tv_nsec = 0};
+    SetEventLoopTimerOneShot(reconnectTimer, &firstConnectDelay);
+
+    // Armed once there is a client to pump.
+    doWorkTimer = CreateEventLoopDisarmedTimer(eventLoop, &DoWorkTimerEventHandler);
+    if (doWorkTimer == NULL) {
+        return ExitCode_Init_DoWorkTimer;
+    }
+
+    twinJsonArena = json_arena_create(TWIN_JSON_ARENA_SIZE);
+    if (twinJsonArena == NULL) {
+        Log_Debug("ERROR: Could not create device twin JSON arena.\n");
+        return ExitCode_Init_TwinJsonArena;
+    }
+
+    twinDesiredPath = json_path_compile("desired");
+    twinStatusLedPath = json_path_compile("StatusLED");
+    if (twinDesiredPath == NULL || twinStatusLedPath == NULL) {
+        Log_Debug("ERROR: Could not compile device twin JSON paths.\n");
+        return ExitCode_Init_TwinJsonPaths;
+    }
+    for (size_t i = 0; i < TWIN_DESIRED_PROPERTY_COUNT; i++) {
+        char desiredPropertyPath[64];
+        snprintf(desiredPropertyPath, sizeof(desiredPropertyPath), "desired.%s",
+                 twinDesiredPropertyNames[i]);
+        twinProjectionPaths[2 * i] = json_path_compile(desiredPropertyPath);
+        twinProjectionPaths[2 * i + 1] = json_path_compile(twinDesiredPropertyNames[i]);
+        if (twinProjectionPaths[2 * i] == NULL || twinProjectionPaths[2 * i + 1] == NULL) {
+            Log_Debug("ERROR: Could not compile device twin JSON paths.\n");
+            return ExitCode_Init_TwinJsonPaths;
+        }
+    }
+
+    telemetryBatch = CreateTelemetryBatch(TELEMETRY_BATCH_BUFFER_SIZE, &SendTelemetryBatch);
+    if (telemetryBatch == NULL) {
+        Log_Debug("ERROR: Could not create telemetry batch: %s (%d).\n", strerror(errno), errno);
+        return ExitCode_Init_TelemetryBatch;
+    }
+    telemetryBatchMaxBytes = TELEMETRY_BATCH_BUFFER_SIZE;
+
+    InitTelemetryRingBuffer(&telemetryRingBuffer, telemetryRingBufferStorage,
+                            sizeof(telemetryRingBufferStorage),
+                            TelemetryRingBufferOverflow_DropOldest);
+
+    // Armed when the first sample of a batch is queued.
+    telemetryBatchTimer = CreateEventLoopDisarmedTimer(eventLoop, &TelemetryBatchTimerEventHandler);
+    if (telemetryBatchTimer == NULL) {
+        return ExitCode_Init_TelemetryBatchTimer;
+    }
+
+    OpenMutableStorage();
+
+    struct timespec storeFlushPeriod = {.tv_sec = TelemetryStoreFlushPeriodSeconds, .tv_nsec = 0};
+    telemetryStoreFlushTimer = CreateEventLoopPeriodicTimer(
+        eventLoop, &TelemetryStoreFlushTimerEventHandler, &storeFlushPeriod);
+    if (telemetryStoreFlushTimer == NULL) {
+        return ExitCode_Init_TelemetryStoreFlushTimer;
+    }
+
+    struct timespec metricsReportPeriod = {.tv_sec = AzureIoTMetricsReportPeriodSeconds,
+                                           .tv_nsec = 0};
+    metricsTimer =
+        CreateEventLoopPeriodicTimer(eventLoop, &MetricsTimerEventHandler, &metricsReportPeriod);
+    if (metricsTimer == NULL) {
+        return ExitCode_Init_MetricsTimer;
+    }
+
     return ExitCode_Success;
 }
 
@@ -536,8 +979,18 @@ static void ClosePeripheralsAndHandlers(void)
 {
     DisposeEventLoopTimer(buttonPollTimer);
     DisposeEventLoopTimer(azureTimer);
+    DisposeEventLoopTimer(reconnectTimer);
+    DisposeEventLoopTimer(doWorkTimer);
+    DisposeEventLoopTimer(telemetryBatchTimer);
+    DisposeEventLoopTimer(metricsTimer);
+    DisposeEventLoopTimer(telemetryStoreFlushTimer);
+    StopAzureIoTHubClientSetUp();
     EventLoop_Close(eventLoop);
 
+    DisposeTelemetryBatch(telemetryBatch);
+    CloseTelemetryStore(telemetryStore);
+    telemetryStore = NULL;
+
     Log_Debug("Closing file descriptors\n");
 
     // Leave the LEDs off
@@ -547,9 +1000,21 @@ static void ClosePeripheralsAndHandlers(void)
 
     CloseFdAndPrintError(sendMessageButtonGpioFd, "SendMessageButton");
     CloseFdAndPrintError(deviceTwinStatusLedGpioFd, "StatusLed");
+    CloseFdAndPrintError(mutableStorageFd, "MutableStorage");
 
     free(ioTEdgeRootCACertContent);
     ioTEdgeRootCACertContent = NULL;
+
+    json_arena_free(twinJsonArena);
+    twinJsonArena = NULL;
+    json_path_free(twinDesiredPath);
+    twinDesiredPath = NULL;
+    json_path_free(twinStatusLedPath);
+    twinStatusLedPath = NULL;
+    for (size_t i = 0; i < TWIN_PROJECTION_PATH_COUNT; i++) {
+        json_path_free(twinProjectionPaths[i]);
+        twinProjectionPaths[i] = NULL;
+    }
 }
 
 /// <summary>
@@ -564,100 +1029,280 @@ static void ConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result,
     Log_Debug("Azure IoT connection status: %s\n", GetReasonString(reason));
 
     if (result != IOTHUB_CLIENT_CONNECTION_AUTHENTICATED) {
-        iotHubClientAuthenticationState = IoTHubClientAuthenticationState_NotAuthenticated;
+        if (connectionState != ConnectionState_Disconnected) {
+            connectionState = ConnectionState_Disconnected;
+            ScheduleAzureIoTHubReconnect();
+        }
+
+        // The device may have been moved to another hub or deregistered; ask DPS again.
+        if (isUsingProvisionedHub && (reason == IOTHUB_CLIENT_CONNECTION_BAD_CREDENTIAL ||
+                                      reason == IOTHUB_CLIENT_CONNECTION_DEVICE_DISABLED)) {
+            InvalidateProvisioningCache();
+        }
         return;
     }
 
-    iotHubClientAuthenticationState = IoTHubClientAuthenticationState_Authenticated;
+    connectionState = ConnectionState_Authenticated;
+    cachedHubConnectAttempts = 0;
+    reconnectDelayMilliseconds = 0;
 
     // Send static device twin properties when connection is established.
     TwinReportState("{\"manufacturer\":\"Microsoft\",\"model\":\"Azure Sphere Sample Device\"}");
 }
 
 /// <summary>
-///     Sets up the Azure IoT Hub connection (creates the iothubClientHandle)
-///     When the SAS Token for a device expires the connection needs to be recreated
-///     which is why this is not simply a one time call.
+///     Starts setting up the Azure IoT Hub connection (creating the iothubClientHandle) on the
+///     connection setup thread. ConnectionSetupCompleteEventHandler() is called on the event
+///     loop once it has finished. When the SAS Token for a device expires the connection needs
+///     to be recreated which is why this is not simply a one time call.
 /// </summary>
-static void SetUpAzureIoTHubClient(void)
+static void StartAzureIoTHubClientSetUp(void)
 {
-    bool isClientSetupSuccessful = false;
-
     if (iothubClientHandle != NULL) {
         IoTHubDeviceClient_LL_Destroy(iothubClientHandle);
+        iothubClientHandle = NULL;
+        ReleaseAllSendContexts();
     }
 
-    if ((connectionType == ConnectionType_Direct) || (connectionType == ConnectionType_IoTEdge)) {
-        isClientSetupSuccessful = SetUpAzureIoTHubClientWithDaa();
-    } else if (connectionType == ConnectionType_DPS) {
-        isClientSetupSuccessful = SetUpAzureIoTHubClientWithDps();
-    }
+    // The connection setup thread only uses connectionSetup, so copy its inputs there.
+    connectionSetup.isProvisioningRequired = false;
+    connectionSetup.clientHandle = NULL;
+    const char *hubHostName = hostName;
+
+    if (connectionType == ConnectionType_DPS) {
+        if (provisionedHubHostName[0] != '\0' &&
+            cachedHubConnectAttempts >= MaxCachedHubConnectAttempts) {
+            Log_Debug("WARNING: Could not connect to %s after %d attempts.\n",
+                      provisionedHubHostName, cachedHubConnectAttempts);
+            InvalidateProvisioningCache();
+        }
 
-    if (!isClientSetupSuccessful) {
-        // If we fail to connect, reduce the polling frequency, starting at
-        // AzureIoTMinReconnectPeriodSeconds and with a backoff up to
-        // AzureIoTMaxReconnectPeriodSeconds
-        if (azureIoTPollPeriodSeconds == AzureIoTDefaultPollPeriodSeconds) {
-            azureIoTPollPeriodSeconds = AzureIoTMinReconnectPeriodSeconds;
+        if (provisionedHubHostName[0] == '\0') {
+            connectionSetup.isProvisioningRequired = true;
         } else {
-            azureIoTPollPeriodSeconds *= 2;
-            if (azureIoTPollPeriodSeconds > AzureIoTMaxReconnectPeriodSeconds) {
-                azureIoTPollPeriodSeconds = AzureIoTMaxReconnectPeriodSeconds;
-            }
+            Log_Debug("INFO: Connecting to provisioned IoT Hub %s without DPS.\n",
+                      provisionedHubHostName);
+        }
+        hubHostName = provisionedHubHostName;
+        isUsingProvisionedHub = true;
+        cachedHubConnectAttempts++;
+    }
+
+    int len = snprintf(connectionSetup.hubHostName, sizeof(connectionSetup.hubHostName), "%s",
+                       hubHostName);
+    if (len < 0 || (size_t)len >= sizeof(connectionSetup.hubHostName)) {
+        Log_Debug("ERROR: IoT Hub hostname is too long.\n");
+        ScheduleAzureIoTHubReconnect();
+        return;
+    }
+
+    connectionState = ConnectionState_Connecting;
+    int result = pthread_create(&connectionSetupThread, NULL, &ConnectionSetupThread, NULL);
+    if (result != 0) {
+        Log_Debug("ERROR: Could not start the connection setup thread: %s (%d).\n",
+                  strerror(result), result);
+        connectionState = ConnectionState_Disconnected;
+        ScheduleAzureIoTHubReconnect();
+    }
+}
+
+/// <summary>
+///     Connection setup thread: provisions the device with DPS if required, then creates the
+///     Azure IoT Hub client. These calls block, so they are kept off the event loop. Signals
+///     connectionSetupEventFd when finished.
+/// </summary>
+static void *ConnectionSetupThread(void *arg)
+{
+    bool isHubKnown = true;
+    if (connectionSetup.isProvisioningRequired) {
+        isHubKnown = ProvisionWithDps(connectionSetup.hubHostName,
+                                      sizeof(connectionSetup.hubHostName));
+        connectionSetup.isProvisioned = isHubKnown;
+    }
+
+    if (isHubKnown && !atomic_load(&isConnectionSetupCancelled)) {
+        connectionSetup.clientHandle = CreateAzureIoTHubClientWithDaa(connectionSetup.hubHostName);
+    }
+
+    uint64_t completed = 1;
+    if (write(connectionSetupEventFd, &completed, sizeof(completed)) == -1) {
+        Log_Debug("ERROR: Could not signal connection setup completion: %s (%d).\n",
+                  strerror(errno), errno);
+    }
+    return NULL;
+}
+
+/// <summary>
+///     Connection setup event: the connection setup thread has finished. Takes ownership of
+///     the client it created, or schedules another attempt if it failed.
+/// </summary>
+static void ConnectionSetupCompleteEventHandler(EventLoop *el, int fd, EventLoop_IoEvents events,
+                                                void *context)
+{
+    uint64_t completed;
+    if (read(fd, &completed, sizeof(completed)) == -1) {
+        if (errno != EAGAIN) {
+            Log_Debug("ERROR: Could not read connection setup event: %s (%d).\n",
+                      strerror(errno), errno);
+            exitCode = ExitCode_ConnectionSetupEvent_Read;
         }
+        return;
+    }
 
-        struct timespec azureTelemetryPeriod = {azureIoTPollPeriodSeconds, 0};
-        SetEventLoopTimerPeriod(azureTimer, &azureTelemetryPeriod);
+    pthread_join(connectionSetupThread, NULL);
+
+    if (connectionSetup.isProvisioningRequired) {
+        if (connectionSetup.isProvisioned) {
+            memcpy(provisionedHubHostName, connectionSetup.hubHostName,
+                   sizeof(provisionedHubHostName));
+            if (mutableStorageFd >= 0 &&
+                WriteProvisioningCache(mutableStorageFd, PROVISIONING_CACHE_OFFSET, scopeId,
+                                       provisionedHubHostName) != 0) {
+                Log_Debug("WARNING: Cannot cache the provisioned IoT Hub: %s (%d).\n",
+                          strerror(errno), errno);
+            }
+        } else {
+            isUsingProvisionedHub = false;
+            cachedHubConnectAttempts = 0;
+        }
+    }
 
-        Log_Debug("ERROR: Failed to create IoTHub Handle - will retry in %i seconds.\n",
-                  azureIoTPollPeriodSeconds);
+    if (connectionSetup.clientHandle == NULL) {
+        connectionState = ConnectionState_Disconnected;
+        ScheduleAzureIoTHubReconnect();
         return;
     }
 
-    // Successfully connected, so make sure the polling frequency is back to the default
-    azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
-    struct timespec azureTelemetryPeriod = {.tv_sec = azureIoTPollPeriodSeconds, .tv_nsec = 0};
-    SetEventLoopTimerPeriod(azureTimer, &azureTelemetryPeriod);
+    iothubClientHandle = connectionSetup.clientHandle;
+    connectionSetup.clientHandle = NULL;
 
-    // Set client authentication state to initiated. This is done to indicate that
-    // SetUpAzureIoTHubClient() has been called (and so should not be called again) while the
-    // client is waiting for a response via the ConnectionStatusCallback().
-    iotHubClientAuthenticationState = IoTHubClientAuthenticationState_AuthenticationInitiated;
+    // The client now waits for a response via the ConnectionStatusCallback().
+    connectionState = ConnectionState_Authenticating;
 
     IoTHubDeviceClient_LL_SetDeviceTwinCallback(iothubClientHandle, DeviceTwinCallback, NULL);
     IoTHubDeviceClient_LL_SetDeviceMethodCallback(iothubClientHandle, DeviceMethodCallback, NULL);
     IoTHubDeviceClient_LL_SetConnectionStatusCallback(iothubClientHandle, ConnectionStatusCallback,
                                                       NULL);
+    RequestAzureIoTDoWork();
+}
+
+/// <summary>
+///     Schedules the next connection attempt after a failed or lost connection. The delay
+///     grows exponentially with decorrelated jitter: it is drawn uniformly from
+///     [AzureIoTMinReconnectPeriodSeconds, 3 * previous delay] and capped at
+///     AzureIoTMaxReconnectPeriodSeconds. The jitter stops devices which lost their connection
+///     at the same time, such as during a hub outage, from reconnecting in lockstep.
+/// </summary>
+static void ScheduleAzureIoTHubReconnect(void)
+{
+    const uint32_t minDelay = (uint32_t)AzureIoTMinReconnectPeriodSeconds * 1000;
+    const uint32_t maxDelay = (uint32_t)AzureIoTMaxReconnectPeriodSeconds * 1000;
+
+    uint32_t previousDelay = reconnectDelayMilliseconds < minDelay ? minDelay
+                                                                   : reconnectDelayMilliseconds;
+    uint32_t upperDelay = previousDelay > maxDelay / 3 ? maxDelay : previousDelay * 3;
+    reconnectDelayMilliseconds =
+        minDelay + (uint32_t)rand_r(&reconnectJitterSeed) % (upperDelay - minDelay + 1);
+
+    struct timespec delay = {.tv_sec = reconnectDelayMilliseconds / 1000,
+                             .tv_nsec = (reconnectDelayMilliseconds % 1000) * 1000 * 1000};
+    SetEventLoopTimerOneShot(reconnectTimer, &delay);
+
+    Log_Debug("INFO: Azure IoT Hub connection will be retried in %u ms.\n",
+              reconnectDelayMilliseconds);
+}
+
+/// <summary>
+///     Reconnect timer event: starts setting up the Azure IoT Hub client once the device is
+///     connected to the internet.
+/// </summary>
+static void ReconnectTimerEventHandler(EventLoopTimer *timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_ReconnectTimer_Consume;
+        return;
+    }
+
+    if (connectionState != ConnectionState_Disconnected) {
+        return;
+    }
+
+    // Check whether the device is connected to the internet; if not, check again after the
+    // poll period without advancing the backoff.
+    Networking_InterfaceConnectionStatus status;
+    if (Networking_GetInterfaceConnectionStatus(networkInterface, &status) != 0) {
+        if (errno != EAGAIN) {
+            Log_Debug("ERROR: Networking_GetInterfaceConnectionStatus: %d (%s)\n", errno,
+                      strerror(errno));
+            exitCode = ExitCode_InterfaceConnectionStatus_Failed;
+            return;
+        }
+        status = 0;
+    }
+
+    if ((status & Networking_InterfaceConnectionStatus_ConnectedToInternet) == 0) {
+        struct timespec pollPeriod = {.tv_sec = AzureIoTDefaultPollPeriodSeconds, .tv_nsec = 0};
+        SetEventLoopTimerOneShot(reconnectTimer, &pollPeriod);
+        return;
+    }
+
+    StartAzureIoTHubClientSetUp();
+}
+
+/// <summary>
+///     Stops the connection setup thread, if it is running, and releases its resources.
+/// </summary>
+static void StopAzureIoTHubClientSetUp(void)
+{
+    if (connectionState == ConnectionState_Connecting) {
+        atomic_store(&isConnectionSetupCancelled, true);
+        pthread_join(connectionSetupThread, NULL);
+        if (connectionSetup.clientHandle != NULL) {
+            IoTHubDeviceClient_LL_Destroy(connectionSetup.clientHandle);
+            connectionSetup.clientHandle = NULL;
+        }
+        connectionState = ConnectionState_Disconnected;
+    }
+
+    if (connectionSetupEventReg != NULL) {
+        EventLoop_UnregisterIo(eventLoop, connectionSetupEventReg);
+        connectionSetupEventReg = NULL;
+    }
+    CloseFdAndPrintError(connectionSetupEventFd, "ConnectionSetupEvent");
+    connectionSetupEventFd = -1;
 }
 
 /// <summary>
-///     Sets up the Azure IoT Hub connection (creates the iothubClientHandle)
-///     with DAA
+///     Creates an Azure IoT Hub client which authenticates with DAA.
+///     Runs on the connection setup thread.
 /// </summary>
-static bool SetUpAzureIoTHubClientWithDaa(void)
+/// <param name="hubHostName">Hostname of the Azure IoT Hub or IoT Edge device</param>
+/// <returns>The client handle, or NULL on failure</returns>
+static IOTHUB_DEVICE_CLIENT_LL_HANDLE CreateAzureIoTHubClientWithDaa(const char *hubHostName)
 {
+    IOTHUB_DEVICE_CLIENT_LL_HANDLE clientHandle = NULL;
     bool retVal = true;
 
     // Set up auth type
     int retError = iothub_security_init(IOTHUB_SECURITY_TYPE_X509);
     if (retError != 0) {
         Log_Debug("ERROR: iothub_security_init failed with error %d.\n", retError);
-        return false;
+        return NULL;
     }
 
     // Create Azure Iot Hub client handle
-    iothubClientHandle =
-        IoTHubDeviceClient_LL_CreateWithAzureSphereFromDeviceAuth(hostName, MQTT_Protocol);
+    clientHandle =
+        IoTHubDeviceClient_LL_CreateWithAzureSphereFromDeviceAuth(hubHostName, MQTT_Protocol);
 
-    if (iothubClientHandle == NULL) {
+    if (clientHandle == NULL) {
         Log_Debug("IoTHubDeviceClient_LL_CreateFromDeviceAuth returned NULL.\n");
         retVal = false;
         goto cleanup;
     }
 
     // Enable DAA cert usage when x509 is invoked
-    if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, "SetDeviceId",
-                                        &deviceIdForDaaCertUsage) != IOTHUB_CLIENT_OK) {
+    if (IoTHubDeviceClient_LL_SetOption(clientHandle, "SetDeviceId", &deviceIdForDaaCertUsage) !=
+        IOTHUB_CLIENT_OK) {
         Log_Debug("ERROR: Failure setting Azure IoT Hub client option \"SetDeviceId\".\n");
         retVal = false;
         goto cleanup;
@@ -666,7 +1311,7 @@ static bool SetUpAzureIoTHubClientWithDaa(void)
     if (connectionType == ConnectionType_IoTEdge) {
         // Provide the Azure IoT device client with the IoT Edge root
         // X509 CA certificate that was used to setup the Edge runtime.
-        if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, OPTION_TRUSTED_CERT,
+        if (IoTHubDeviceClient_LL_SetOption(clientHandle, OPTION_TRUSTED_CERT,
                                             ioTEdgeRootCACertContent) != IOTHUB_CLIENT_OK) {
             Log_Debug("ERROR: Failure setting Azure IoT Hub client option \"TrustedCerts\".\n");
             retVal = false;
@@ -675,7 +1320,7 @@ static bool SetUpAzureIoTHubClientWithDaa(void)
 
         // Set the auto URL Encoder (recommended for MQTT).
         bool urlEncodeOn = true;
-        if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, OPTION_AUTO_URL_ENCODE_DECODE,
+        if (IoTHubDeviceClient_LL_SetOption(clientHandle, OPTION_AUTO_URL_ENCODE_DECODE,
                                             &urlEncodeOn) != IOTHUB_CLIENT_OK) {
             Log_Debug(
                 "ERROR: Failure setting Azure IoT Hub client option "
@@ -688,26 +1333,120 @@ static bool SetUpAzureIoTHubClientWithDaa(void)
 cleanup:
     iothub_security_deinit();
 
-    return retVal;
+    if (!retVal && clientHandle != NULL) {
+        IoTHubDeviceClient_LL_Destroy(clientHandle);
+        clientHandle = NULL;
+    }
+    return clientHandle;
 }
 
 /// <summary>
-///     Sets up the Azure IoT Hub connection (creates the iothubClientHandle)
-///     with DPS
+///     Registers the device with DPS and waits for up to DpsRegistrationTimeoutMilliseconds
+///     for the hub assignment. Runs on the connection setup thread.
 /// </summary>
-static bool SetUpAzureIoTHubClientWithDps(void)
+/// <param name="hubHostName">Receives the hostname of the assigned IoT Hub</param>
+/// <param name="hubHostNameSize">Size of hubHostName in bytes</param>
+/// <returns>true if the device was assigned to a hub, false otherwise</returns>
+static bool ProvisionWithDps(char *hubHostName, size_t hubHostNameSize)
 {
-    AZURE_SPHERE_PROV_RETURN_VALUE provResult =
-        IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(scopeId, 10000,
-                                                                          &iothubClientHandle);
-    Log_Debug("IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning returned '%s'.\n",
-              GetAzureSphereProvisioningResultString(provResult));
-
-    if (provResult.result != AZURE_SPHERE_PROV_RESULT_OK) {
+    bool isProvisioned = false;
+    PROV_DEVICE_LL_HANDLE provHandle = NULL;
+    DpsRegistration registration = {.isComplete = false,
+                                    .result = PROV_DEVICE_RESULT_ERROR,
+                                    .hubHostName = hubHostName,
+                                    .hubHostNameSize = hubHostNameSize};
+    hubHostName[0] = '\0';
+
+    int retError = prov_dev_security_init(SECURE_DEVICE_TYPE_X509);
+    if (retError != 0) {
+        Log_Debug("ERROR: prov_dev_security_init failed with error %d.\n", retError);
         return false;
     }
 
-    return true;
+    provHandle = Prov_Device_LL_Create(dpsGlobalEndpoint, scopeId, Prov_Device_MQTT_Protocol);
+    if (provHandle == NULL) {
+        Log_Debug("ERROR: Prov_Device_LL_Create returned NULL.\n");
+        goto cleanup;
+    }
+
+    // Enable DAA cert usage when x509 is invoked
+    if (Prov_Device_LL_SetOption(provHandle, "SetDeviceId", &deviceIdForDaaCertUsage) !=
+        PROV_DEVICE_RESULT_OK) {
+        Log_Debug("ERROR: Failure setting DPS client option \"SetDeviceId\".\n");
+        goto cleanup;
+    }
+
+    if (Prov_Device_LL_Register_Device(provHandle, RegisterDeviceCallback, &registration, NULL,
+                                       NULL) != PROV_DEVICE_RESULT_OK) {
+        Log_Debug("ERROR: Prov_Device_LL_Register_Device failed.\n");
+        goto cleanup;
+    }
+
+    const struct timespec doWorkPeriod = {.tv_sec = 0,
+                                          .tv_nsec = DpsDoWorkPeriodMilliseconds * 1000 * 1000};
+    for (int elapsedMilliseconds = 0;
+         !registration.isComplete && !atomic_load(&isConnectionSetupCancelled) &&
+         elapsedMilliseconds < DpsRegistrationTimeoutMilliseconds;
+         elapsedMilliseconds += DpsDoWorkPeriodMilliseconds) {
+        Prov_Device_LL_DoWork(provHandle);
+        nanosleep(&doWorkPeriod, NULL);
+    }
+
+    if (!registration.isComplete) {
+        Log_Debug("ERROR: DPS registration timed out.\n");
+        goto cleanup;
+    }
+
+    if (registration.result != PROV_DEVICE_RESULT_OK || hubHostName[0] == '\0') {
+        Log_Debug("ERROR: DPS registration failed with result %d.\n", registration.result);
+        goto cleanup;
+    }
+
+    Log_Debug("INFO: DPS assigned IoT Hub %s.\n", hubHostName);
+    isProvisioned = true;
+
+cleanup:
+    if (provHandle != NULL) {
+        Prov_Device_LL_Destroy(provHandle);
+    }
+    prov_dev_security_deinit();
+
+    return isProvisioned;
+}
+
+/// <summary>
+///     Callback invoked when DPS registration completes.
+/// </summary>
+static void RegisterDeviceCallback(PROV_DEVICE_RESULT registerResult, const char *iotHubUri,
+                                   const char *deviceId, void *userContext)
+{
+    DpsRegistration *registration = userContext;
+
+    registration->isComplete = true;
+    registration->result = registerResult;
+
+    if (registerResult == PROV_DEVICE_RESULT_OK && iotHubUri != NULL &&
+        strlen(iotHubUri) < registration->hubHostNameSize) {
+        strcpy(registration->hubHostName, iotHubUri);
+    }
+}
+
+/// <summary>
+///     Forgets the IoT Hub assigned by DPS, so that the next connection attempt provisions the
+///     device again.
+/// </summary>
+static void InvalidateProvisioningCache(void)
+{
+    Log_Debug("INFO: Discarding provisioned IoT Hub %s.\n", provisionedHubHostName);
+    provisionedHubHostName[0] = '\0';
+    isUsingProvisionedHub = false;
+    cachedHubConnectAttempts = 0;
+
+    if (mutableStorageFd >= 0 &&
+        ClearProvisioningCache(mutableStorageFd, PROVISIONING_CACHE_OFFSET) != 0) {
+        Log_Debug("WARNING: Cannot clear the provisioning cache: %s (%d).\n", strerror(errno),
+                  errno);
+    }
 }
 
 /// <summary>
@@ -737,6 +1476,9 @@ static int DeviceMethodCallback(const char *methodName, const unsigned char *pay
     *responseSize = strlen(responseString);
     *response = malloc(*responseSize);
     memcpy(*response, responseString, *responseSize);
+
+    // The response is sent by the next DoWork().
+    RequestAzureIoTDoWork();
     return result;
 }
 
@@ -746,43 +1488,36 @@ static int DeviceMethodCallback(const char *methodName, const unsigned char *pay
 static void DeviceTwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char *payload,
                                size_t payloadSize, void *userContextCallback)
 {
-    // Statically allocate this for more predictable memory use patterns
-    static char nullTerminatedJsonString[MAX_DEVICE_TWIN_PAYLOAD_SIZE + 1];
-
-    if (payloadSize > MAX_DEVICE_TWIN_PAYLOAD_SIZE) {
-        Log_Debug("ERROR: Device twin payload size (%u bytes) exceeds maximum (%u bytes).\n",
-                  payloadSize, MAX_DEVICE_TWIN_PAYLOAD_SIZE);
-
-        exitCode = ExitCode_PayloadSize_TooLarge;
-        return;
-    }
-
-    // Copy the payload to local buffer for null-termination.
-    memcpy(nullTerminatedJsonString, payload, payloadSize);
-
-    // Add the null terminator at the end.
-    nullTerminatedJsonString[payloadSize] = 0;
-
+    // The payload isn't null-terminated, so parse it by length. Only the desired properties the
+    // device uses are built.
     JSON_Value *rootProperties = NULL;
-    rootProperties = json_parse_string(nullTerminatedJsonString);
+    rootProperties = json_parse_buffer_projected_in_arena(
+        (const char *)payload, payloadSize, twinProjectionPaths, TWIN_PROJECTION_PATH_COUNT,
+        twinJsonArena);
     if (rootProperties == NULL) {
         Log_Debug("WARNING: Cannot parse the string as JSON content.\n");
         goto cleanup;
     }
 
-    JSON_Object *rootObject = json_value_get_object(rootProperties);
-    JSON_Object *desiredProperties = json_object_dotget_object(rootObject, "desired");
-    if (desiredProperties == NULL) {
-        desiredProperties = rootObject;
+    // The root need not be an object, so the desired properties are resolved as a value.
+    JSON_Value *desiredValue = json_path_get_value(twinDesiredPath, rootProperties);
+    if (json_value_get_type(desiredValue) != JSONObject) {
+        desiredValue = rootProperties;
     }
+    JSON_Object *desiredProperties = json_value_get_object(desiredValue);
 
     // The desired properties should have a "StatusLED" object
-    int statusLedValue = json_object_dotget_boolean(desiredProperties, "StatusLED");
+    int statusLedValue = json_path_get_boolean(twinStatusLedPath, desiredValue);
     if (statusLedValue != -1) {
         statusLedOn = statusLedValue == 1;
         GPIO_SetValue(deviceTwinStatusLedGpioFd, statusLedOn ? GPIO_Value_Low : GPIO_Value_High);
     }
 
+    UpdateTelemetryBatchSettings(desiredProperties);
+    UpdateTelemetryBacklogSettings(desiredProperties);
+    UpdateDoWorkSettings(desiredProperties);
+    UpdateSendWindowSettings(desiredProperties);
+
     // Report current status LED state
     if (statusLedOn) {
         TwinReportState("{\"StatusLED\":true}");
@@ -791,8 +1526,8 @@ static void DeviceTwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsig
     }
 
 cleanup:
-    // Release the allocated memory.
-    json_value_free(rootProperties);
+    // Release the parsed document.
+    json_arena_reset(twinJsonArena);
 }
 
 /// <summary>
@@ -830,30 +1565,6 @@ static const char *GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason
     return reasonString;
 }
 
-/// <summary>
-///     Converts AZURE_SPHERE_PROV_RETURN_VALUE to a string.
-/// </summary>
-static const char *GetAzureSphereProvisioningResultString(
-    AZURE_SPHERE_PROV_RETURN_VALUE provisioningResult)
-{
-    switch (provisioningResult.result) {
-    case AZURE_SPHERE_PROV_RESULT_OK:
-        return "AZURE_SPHERE_PROV_RESULT_OK";
-    case AZURE_SPHERE_PROV_RESULT_INVALID_PARAM:
-        return "AZURE_SPHERE_PROV_RESULT_INVALID_PARAM";
-    case AZURE_SPHERE_PROV_RESULT_NETWORK_NOT_READY:
-        return "AZURE_SPHERE_PROV_RESULT_NETWORK_NOT_READY";
-    case AZURE_SPHERE_PROV_RESULT_DEVICEAUTH_NOT_READY:
-        return "AZURE_SPHERE_PROV_RESULT_DEVICEAUTH_NOT_READY";
-    case AZURE_SPHERE_PROV_RESULT_PROV_DEVICE_ERROR:
-        return "AZURE_SPHERE_PROV_RESULT_PROV_DEVICE_ERROR";
-    case AZURE_SPHERE_PROV_RESULT_GENERIC_ERROR:
-        return "AZURE_SPHERE_PROV_RESULT_GENERIC_ERROR";
-    default:
-        return "UNKNOWN_RETURN_VALUE";
-    }
-}
-
 /// <summary>
 ///     Check the network status.
 /// </summary>
@@ -884,13 +1595,24 @@ static bool IsConnectionReadyToSendTelemetry(void)
 }
 
 /// <summary>
-///     Sends telemetry to Azure IoT Hub
+///     Sends telemetry to Azure IoT Hub. If the client is not authenticated, the device is not
+///     connected, or older telemetry is still waiting to be sent, the message is buffered
+///     instead and sent later by DrainTelemetryBacklog().
 /// </summary>
-static void SendTelemetry(const char *jsonMessage)
+/// <param name="jsonMessage">Message, which must be NUL-terminated</param>
+/// <param name="length">Message length in bytes, excluding the NUL terminator</param>
+static void SendTelemetry(const char *jsonMessage, size_t length)
 {
-    if (iotHubClientAuthenticationState != IoTHubClientAuthenticationState_Authenticated) {
-        // AzureIoT client is not authenticated. Log a warning and return.
-        Log_Debug("WARNING: Azure IoT Hub is not authenticated. Not sending telemetry.\n");
+    if (connectionState != ConnectionState_Authenticated) {
+        // AzureIoT client is not authenticated. Log a warning and keep the message.
+        Log_Debug("WARNING: Azure IoT Hub is not authenticated. Buffering telemetry.\n");
+        BufferTelemetry(jsonMessage, length);
+        return;
+    }
+
+    // Preserve ordering: new telemetry queues up behind the backlog.
+    if (!IsTelemetryRingBufferEmpty(&telemetryRingBuffer) || IsStoredTelemetryPending()) {
+        BufferTelemetry(jsonMessage, length);
         return;
     }
 
@@ -898,50 +1620,738 @@ static void SendTelemetry(const char *jsonMessage)
 
     // Check whether the device is connected to the internet.
     if (IsConnectionReadyToSendTelemetry() == false) {
+        BufferTelemetry(jsonMessage, length);
         return;
     }
 
-    IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(jsonMessage);
+    if (!SendTelemetryMessage(jsonMessage, length, 0)) {
+        BufferTelemetry(jsonMessage, length);
+    }
+}
+
+/// <summary>
+///     Hands a telemetry message to the Azure IoT Hub client.
+/// </summary>
+/// <param name="jsonMessage">Message, which must be NUL-terminated</param>
+/// <param name="length">Message length in bytes, excluding the NUL terminator</param>
+/// <param name="storeSequence">Sequence number of the message in the telemetry store, which
+///     is acknowledged once the hub confirms delivery, or 0 if it is not from the store</param>
+/// <returns>true if the client accepted the message for delivery, false otherwise</returns>
+static bool SendTelemetryMessage(const char *jsonMessage, size_t length, uint32_t storeSequence)
+{
+    if (IsSendWindowFull(length)) {
+        Log_Debug("INFO: Send window is full (%u messages, %zu bytes in flight).\n",
+                  inFlightTelemetryCount, inFlightTelemetryBytes);
+        sendWindowFullCount++;
+        return false;
+    }
+
+    SendContext *sendContext = AcquireSendContext(length);
+    if (sendContext == NULL) {
+        Log_Debug("WARNING: %u telemetry messages are already in flight.\n",
+                  inFlightTelemetryCount);
+        return false;
+    }
+    sendContext->storeSequence = storeSequence;
+
+    // The client copies the message, so the caller's buffer can be reused straight away.
+    IOTHUB_MESSAGE_HANDLE messageHandle =
+        IoTHubMessage_CreateFromByteArray((const unsigned char *)jsonMessage, length);
 
     if (messageHandle == 0) {
         Log_Debug("ERROR: unable to create a new IoTHubMessage.\n");
-        return;
+        ReleaseSendContext(sendContext);
+        return false;
     }
 
+    bool isAccepted = true;
     if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendEventCallback,
-                                             /*&callback_param*/ NULL) != IOTHUB_CLIENT_OK) {
+                                             sendContext) != IOTHUB_CLIENT_OK) {
         Log_Debug("ERROR: failure requesting IoTHubClient to send telemetry event.\n");
+        ReleaseSendContext(sendContext);
+        isAccepted = false;
     } else {
-        Log_Debug("INFO: IoTHubClient accepted the telemetry event for delivery.\n");
+        Log_Debug("INFO: IoTHubClient accepted telemetry event %u for delivery.\n",
+                  sendContext->sequence);
+        inFlightTelemetryCount++;
+        inFlightTelemetryBytes += length;
+        if (inFlightTelemetryCount > inFlightTelemetryHighWaterMark) {
+            inFlightTelemetryHighWaterMark = inFlightTelemetryCount;
+        }
+        RequestAzureIoTDoWork();
     }
 
     IoTHubMessage_Destroy(messageHandle);
+    return isAccepted;
 }
 
 /// <summary>
-///     Callback invoked when the Azure IoT Hub send event request is processed.
+///     Checks whether a telemetry message of the given length would exceed the send window.
+///     A message larger than the byte limit is still sent when nothing else is in flight.
 /// </summary>
-static void SendEventCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
+static bool IsSendWindowFull(size_t length)
 {
-    Log_Debug("INFO: Azure IoT Hub send telemetry event callback: status code %d.\n", result);
+    if (inFlightTelemetryCount >= telemetryMaxInFlight) {
+        return true;
+    }
+    return inFlightTelemetryCount > 0 &&
+           inFlightTelemetryBytes + length > telemetryMaxInFlightBytes;
+}
+
+/// <summary>
+///     Returns how full the send window is, by count or bytes, whichever is fuller.
+/// </summary>
+static unsigned int GetSendWindowOccupancyPercent(void)
+{
+    unsigned int countPercent = inFlightTelemetryCount * 100 / telemetryMaxInFlight;
+    size_t bytesPercent = inFlightTelemetryBytes * 100 / telemetryMaxInFlightBytes;
+    return bytesPercent > countPercent ? (unsigned int)bytesPercent : countPercent;
+}
+
+/// <summary>
+///     Applies the TelemetryMaxInFlight and TelemetryMaxInFlightBytes desired properties, if
+///     present, and reports the settings in effect.
+/// </summary>
+static void UpdateSendWindowSettings(const JSON_Object *desiredProperties)
+{
+    static char reportedPropertiesString[TWIN_REPORT_BUFFER_SIZE];
+    bool settingsChanged = false;
+
+    if (json_object_has_value_of_type(desiredProperties, "TelemetryMaxInFlight", JSONNumber)) {
+        double count = json_object_get_number(desiredProperties, "TelemetryMaxInFlight");
+        if (count < 1) {
+            count = 1;
+        } else if (count > SEND_CONTEXT_POOL_SIZE - TWIN_REPORT_SEND_CONTEXT_RESERVE) {
+            count = SEND_CONTEXT_POOL_SIZE - TWIN_REPORT_SEND_CONTEXT_RESERVE;
+        }
+        telemetryMaxInFlight = (unsigned int)count;
+        settingsChanged = true;
+    }
+
+    if (json_object_has_value_of_type(desiredProperties, "TelemetryMaxInFlightBytes",
+                                      JSONNumber)) {
+        double bytes = json_object_get_number(desiredProperties, "TelemetryMaxInFlightBytes");
+        if (bytes < TELEMETRY_BUFFER_SIZE) {
+            bytes = TELEMETRY_BUFFER_SIZE;
+        } else if (bytes > TelemetryMaxInFlightBytesLimit) {
+            bytes = TelemetryMaxInFlightBytesLimit;
+        }
+        telemetryMaxInFlightBytes = (size_t)bytes;
+        settingsChanged = true;
+    }
+
+    if (!settingsChanged) {
+        return;
+    }
+
+    int len = snprintf(reportedPropertiesString, TWIN_REPORT_BUFFER_SIZE,
+                       "{\"TelemetryMaxInFlight\":%u,\"TelemetryMaxInFlightBytes\":%zu}",
+                       telemetryMaxInFlight, telemetryMaxInFlightBytes);
+    if (len < 0 || len >= TWIN_REPORT_BUFFER_SIZE) {
+        Log_Debug("ERROR: Cannot write reported properties to buffer.\n");
+        return;
+    }
+    TwinReportState(reportedPropertiesString);
+}
+
+/// <summary>
+///     Takes a context for a message which is about to be handed to the Azure IoT Hub client.
+/// </summary>
+/// <param name="length">Message length in bytes</param>
+/// <returns>The context, or NULL if the pool is exhausted</returns>
+static SendContext *AcquireSendContext(size_t length)
+{
+    for (size_t i = 0; i < SEND_CONTEXT_POOL_SIZE; i++) {
+        SendContext *sendContext = &sendContextPool[i];
+        if (!sendContext->isInUse) {
+            sendContext->isInUse = true;
+            sendContext->sequence = nextSendSequence++;
+            sendContext->storeSequence = 0;
+            sendContext->length = length;
+            sendContext->enqueueTimeMilliseconds = GetMonotonicMilliseconds();
+            return sendContext;
+        }
+    }
+    return NULL;
+}
+
+/// <summary>
+///     Returns a context to the pool.
+/// </summary>
+/// <returns>Milliseconds since the context was acquired</returns>
+static uint32_t ReleaseSendContext(SendContext *sendContext)
+{
+    sendContext->isInUse = false;
+    uint64_t elapsed = GetMonotonicMilliseconds() - sendContext->enqueueTimeMilliseconds;
+    return elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+}
+
+/// <summary>
+///     Returns every context to the pool, after the client which held them was destroyed.
+/// </summary>
+static void ReleaseAllSendContexts(void)
+{
+    for (size_t i = 0; i < SEND_CONTEXT_POOL_SIZE; i++) {
+        sendContextPool[i].isInUse = false;
+    }
+    inFlightTelemetryCount = 0;
+    inFlightTelemetryBytes = 0;
+    inFlightTwinReportCount = 0;
+
+    // Stored messages which were in flight are no longer confirmed, so send them again.
+    if (telemetryStore != NULL) {
+        RewindStoredTelemetry();
+    }
+}
+
+/// <summary>
+///     Keeps a telemetry message in the persistent telemetry store, or in the store-and-forward
+///     ring buffer if the store is unavailable or full.
+/// </summary>
+static void BufferTelemetry(const char *jsonMessage, size_t length)
+{
+    // The ring buffer is drained after the store, so once a message has gone to the ring
+    // buffer, later messages must follow it there until it is empty.
+    // Store the NUL terminator so that buffered messages can be sent in place.
+    if (telemetryStore != NULL && IsTelemetryRingBufferEmpty(&telemetryRingBuffer)) {
+        if (AppendTelemetryStoreRecord(telemetryStore, jsonMessage, length + 1, NULL) == 0) {
+            return;
+        }
+        Log_Debug("WARNING: Cannot persist telemetry: %s (%d). Buffering it in RAM.\n",
+                  strerror(errno), errno);
+    }
+
+    if (PushTelemetryRingBuffer(&telemetryRingBuffer, jsonMessage, length + 1) != 0) {
+        Log_Debug("ERROR: Cannot buffer telemetry: %s (%d).\n", strerror(errno), errno);
+    }
+}
+
+/// <summary>
+///     Reads the next message from the telemetry store and sends it.
+/// </summary>
+/// <returns>true if a message was handed to the Azure IoT Hub client, false otherwise</returns>
+static bool SendStoredTelemetry(void)
+{
+    static char jsonMessage[TELEMETRY_BATCH_BUFFER_SIZE + 1];
+    static size_t length;
+    static uint32_t sequence;
+
+    // A message which could not be sent is kept until it can be, rather than rewinding the
+    // store, which would send the messages in flight again.
+    if (hasStoredTelemetryReadAhead) {
+        goto send;
+    }
+
+    for (;;) {
+        int result = ReadNextTelemetryStoreRecord(telemetryStore, jsonMessage,
+                                                  sizeof(jsonMessage), &length, &sequence);
+        if (result == 1) {
+            break;
+        }
+        if (result == 0) {
+            return false;
+        }
+        if (errno != EMSGSIZE) {
+            Log_Debug("ERROR: Cannot read stored telemetry: %s (%d).\n", strerror(errno), errno);
+            return false;
+        }
+        // Can never be sent, so discard it as if it had been delivered.
+        storedTelemetrySentSequence = sequence;
+        AcknowledgeStoredTelemetry();
+    }
+
+    if (length == 0 || jsonMessage[length - 1] != '\0') {
+        storedTelemetrySentSequence = sequence;
+        AcknowledgeStoredTelemetry();
+        return false;
+    }
+
+send:
+    if (IsSendWindowFull(length - 1)) {
+        hasStoredTelemetryReadAhead = true;
+        return false;
+    }
+    hasStoredTelemetryReadAhead = false;
+
+    Log_Debug("Sending stored Azure IoT Hub telemetry: %s.\n", jsonMessage);
+    if (!SendTelemetryMessage(jsonMessage, length - 1, sequence)) {
+        hasStoredTelemetryReadAhead = true;
+        return false;
+    }
+    storedTelemetrySentSequence = sequence;
+    return true;
+}
+
+/// <summary>
+///     Checks whether there is stored telemetry waiting to be sent.
+/// </summary>
+static bool IsStoredTelemetryPending(void)
+{
+    return telemetryStore != NULL &&
+           (hasStoredTelemetryReadAhead || IsTelemetryStoreReplayPending(telemetryStore));
+}
+
+/// <summary>
+///     Sends stored telemetry again from the oldest unacknowledged message.
+/// </summary>
+static void RewindStoredTelemetry(void)
+{
+    hasStoredTelemetryReadAhead = false;
+    storedTelemetrySentSequence = 0;
+    RewindTelemetryStore(telemetryStore);
+}
+
+/// <summary>
+///     Acknowledges the stored messages sent in this pass up to the oldest one still in flight.
+/// </summary>
+static void AcknowledgeStoredTelemetry(void)
+{
+    uint32_t sequence = storedTelemetrySentSequence;
+    for (size_t i = 0; i < SEND_CONTEXT_POOL_SIZE; i++) {
+        const SendContext *sendContext = &sendContextPool[i];
+        if (sendContext->isInUse &&
+            sendContext->storeSequence > storedTelemetryAcknowledgedSequence &&
+            sendContext->storeSequence <= sequence) {
+            sequence = sendContext->storeSequence - 1;
+        }
+    }
+    if (sequence <= storedTelemetryAcknowledgedSequence) {
+        return;
+    }
+
+    if (AcknowledgeTelemetryStoreRecords(telemetryStore, sequence) != 0) {
+        Log_Debug("ERROR: Cannot acknowledge stored telemetry: %s (%d).\n", strerror(errno), errno);
+        return;
+    }
+    storedTelemetryAcknowledgedSequence = sequence;
+}
+
+/// <summary>
+///     Sends up to telemetryBacklogDrainRate buffered messages, oldest first: those in the
+///     telemetry store, then those in the ring buffer. Called once per second while the client
+///     is authenticated, which limits the rate at which a backlog reaches the hub.
+/// </summary>
+static void DrainTelemetryBacklog(void)
+{
+    bool isStorePending = IsStoredTelemetryPending();
+    if ((!isStorePending && IsTelemetryRingBufferEmpty(&telemetryRingBuffer)) ||
+        !IsConnectionReadyToSendTelemetry()) {
+        return;
+    }
+
+    for (int i = 0; i < telemetryBacklogDrainRate; i++) {
+        if (IsStoredTelemetryPending()) {
+            if (!SendStoredTelemetry()) {
+                break;
+            }
+            continue;
+        }
+
+        size_t length;
+        const char *jsonMessage = PeekTelemetryRingBuffer(&telemetryRingBuffer, &length);
+        if (jsonMessage == NULL) {
+            break;
+        }
+
+        Log_Debug("Sending buffered Azure IoT Hub telemetry: %s.\n", jsonMessage);
+        if (!SendTelemetryMessage(jsonMessage, length - 1, 0)) {
+            break;
+        }
+        PopTelemetryRingBuffer(&telemetryRingBuffer);
+    }
+
+    isStorePending = IsStoredTelemetryPending();
+    if (!isStorePending && IsTelemetryRingBufferEmpty(&telemetryRingBuffer)) {
+        Log_Debug("INFO: Telemetry backlog drained.\n");
+        ReportTelemetryMetrics();
+    }
+}
+
+/// <summary>
+///     Applies the TelemetryBacklogOverflowPolicy ("DropOldest" or "Downsample") and
+///     TelemetryBacklogDrainRate desired properties, if present, and reports the settings in
+///     effect.
+/// </summary>
+static void UpdateTelemetryBacklogSettings(const JSON_Object *desiredProperties)
+{
+    static char reportedPropertiesString[TWIN_REPORT_BUFFER_SIZE];
+    static TelemetryRingBufferOverflowPolicy overflowPolicy =
+        TelemetryRingBufferOverflow_DropOldest;
+    bool settingsChanged = false;
+
+    const char *policyName =
+        json_object_get_string(desiredProperties, "TelemetryBacklogOverflowPolicy");
+    if (policyName != NULL) {
+        if (strcmp(policyName, "Downsample") == 0) {
+            overflowPolicy = TelemetryRingBufferOverflow_Downsample;
+        } else {
+            overflowPolicy = TelemetryRingBufferOverflow_DropOldest;
+        }
+        SetTelemetryRingBufferOverflowPolicy(&telemetryRingBuffer, overflowPolicy);
+        settingsChanged = true;
+    }
+
+    if (json_object_has_value_of_type(desiredProperties, "TelemetryBacklogDrainRate",
+                                      JSONNumber)) {
+        double rate = json_object_get_number(desiredProperties, "TelemetryBacklogDrainRate");
+        if (rate < 1) {
+            rate = 1;
+        } else if (rate > TelemetryBacklogDrainRateLimit) {
+            rate = TelemetryBacklogDrainRateLimit;
+        }
+        telemetryBacklogDrainRate = (int)rate;
+        settingsChanged = true;
+    }
+
+    if (!settingsChanged) {
+        return;
+    }
+
+    int len = snprintf(
+        reportedPropertiesString, TWIN_REPORT_BUFFER_SIZE,
+        "{\"TelemetryBacklogOverflowPolicy\":\"%s\",\"TelemetryBacklogDrainRate\":%d}",
+        overflowPolicy == TelemetryRingBufferOverflow_Downsample ? "Downsample" : "DropOldest",
+        telemetryBacklogDrainRate);
+    if (len < 0 || len >= TWIN_REPORT_BUFFER_SIZE) {
+        Log_Debug("ERROR: Cannot write reported properties to buffer.\n");
+        return;
+    }
+    TwinReportState(reportedPropertiesString);
+}
+
+/// <summary>
+///     Metrics timer event:  Report telemetry metrics while connected
+/// </summary>
+static void MetricsTimerEventHandler(EventLoopTimer *timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_MetricsTimer_Consume;
+        return;
+    }
+
+    if (connectionState == ConnectionState_Authenticated) {
+        ReportTelemetryMetrics();
+    }
+}
+
+/// <summary>
+///     Reports telemetry pipeline metrics as the TelemetryMetrics reported property.
+/// </summary>
+static void ReportTelemetryMetrics(void)
+{
+    static char reportedPropertiesString[TELEMETRY_METRICS_BUFFER_SIZE];
+    TelemetryRingBufferStats backlogStats;
+    GetTelemetryRingBufferStats(&telemetryRingBuffer, &backlogStats);
+
+    TelemetryStoreStats storeStats = {0};
+    if (telemetryStore != NULL) {
+        GetTelemetryStoreStats(telemetryStore, &storeStats);
+    }
+
+    LatencyHistogramStats sendLatency, twinReportLatency;
+    GetLatencyHistogramStats(&telemetryLatencyHistogram, &sendLatency);
+    GetLatencyHistogramStats(&twinReportLatencyHistogram, &twinReportLatency);
+
+    int len = snprintf(reportedPropertiesString, TELEMETRY_METRICS_BUFFER_SIZE,
+                       "{\"TelemetryMetrics\":{\"BacklogCount\":%zu,\"BacklogBytes\":%zu,"
+                       "\"BacklogHighWaterMarkCount\":%zu,\"BacklogHighWaterMarkBytes\":%zu,"
+                       "\"BacklogCapacityBytes\":%zu,\"BacklogDropped\":%u,"
+                       "\"StoreAvailable\":%s,\"StoreCount\":%zu,\"StoreBytes\":%zu,"
+                       "\"StoreSegmentBytes\":%zu,\"StoreCompactions\":%u,\"StoreWrites\":%u,"
+                       "\"StoreBytesWritten\":%llu,\"StorePayloadBytes\":%llu,"
+                       "\"DoWorkCount\":%u,\"PumpLatencyAvgMs\":%llu,\"PumpLatencyMaxMs\":%u,"
+                       "\"SendInFlight\":%u,\"SendInFlightBytes\":%zu,"
+                       "\"SendWindowOccupancyPercent\":%u,\"SendWindowFull\":%u,"
+                       "\"SendInFlightHighWaterMark\":%u,\"SendOk\":%u,\"SendDestroyed\":%u,"
+                       "\"SendTimeout\":%u,\"SendError\":%u,\"SendLatencyMs\":{\"count\":%u,"
+                       "\"mean\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u},"
+                       "\"TwinReportError\":%u,\"TwinReportLatencyMs\":{\"count\":%u,"
+                       "\"mean\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u}}}",
+                       backlogStats.count, backlogStats.usedBytes, backlogStats.highWaterMarkCount,
+                       backlogStats.highWaterMarkBytes, backlogStats.capacityBytes,
+                       (unsigned int)backlogStats.droppedCount,
+                       telemetryStore != NULL ? "true" : "false", storeStats.pendingCount,
+                       storeStats.usedBytes, storeStats.segmentBytes,
+                       (unsigned int)storeStats.compactionCount,
+                       (unsigned int)storeStats.flushCount,
+                       (unsigned long long)storeStats.bytesWritten,
+                       (unsigned long long)storeStats.payloadBytesAppended, doWorkCount,
+                       pumpLatencyCount == 0
+                           ? 0ULL
+                           : (unsigned long long)(pumpLatencyTotalMilliseconds / pumpLatencyCount),
+                       pumpLatencyMaxMilliseconds, inFlightTelemetryCount, inFlightTelemetryBytes,
+                       GetSendWindowOccupancyPercent(), sendWindowFullCount,
+                       inFlightTelemetryHighWaterMark,
+                       telemetryConfirmationCounts[IOTHUB_CLIENT_CONFIRMATION_OK],
+                       telemetryConfirmationCounts[IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY],
+                       telemetryConfirmationCounts[IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT],
+                       telemetryConfirmationCounts[IOTHUB_CLIENT_CONFIRMATION_ERROR],
+                       sendLatency.count, sendLatency.mean, sendLatency.p50, sendLatency.p90,
+                       sendLatency.p99, sendLatency.max, twinReportErrorCount,
+                       twinReportLatency.count, twinReportLatency.mean, twinReportLatency.p50,
+                       twinReportLatency.p90, twinReportLatency.p99, twinReportLatency.max);
+    if (len < 0 || len >= TELEMETRY_METRICS_BUFFER_SIZE) {
+        Log_Debug("ERROR: Cannot write telemetry metrics to buffer.\n");
+        return;
+    }
+    TwinReportState(reportedPropertiesString);
+
+    // Latencies are reported per interval.
+    InitLatencyHistogram(&telemetryLatencyHistogram);
+    InitLatencyHistogram(&twinReportLatencyHistogram);
+}
+
+/// <summary>
+///     Callback invoked when the Azure IoT Hub send event request is processed.
+/// </summary>
+static void SendEventCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void *context)
+{
+    SendContext *sendContext = context;
+    uint32_t storeSequence = sendContext->storeSequence;
+    if (inFlightTelemetryCount > 0) {
+        inFlightTelemetryCount--;
+        inFlightTelemetryBytes -= sendContext->length;
+    }
+    uint32_t sequence = sendContext->sequence;
+    uint32_t latency = ReleaseSendContext(sendContext);
+    Log_Debug("INFO: Azure IoT Hub send telemetry event %u callback: status code %d after %u ms.\n",
+              sequence, result, latency);
+
+    if ((unsigned int)result <= IOTHUB_CLIENT_CONFIRMATION_ERROR) {
+        telemetryConfirmationCounts[result]++;
+    }
+    if (result == IOTHUB_CLIENT_CONFIRMATION_OK) {
+        RecordLatencyHistogramValue(&telemetryLatencyHistogram, latency);
+    }
+
+    // Messages replayed from the telemetry store are acknowledged once they are delivered.
+    if (storeSequence == 0 || telemetryStore == NULL) {
+        return;
+    }
+
+    if (result == IOTHUB_CLIENT_CONFIRMATION_OK) {
+        AcknowledgeStoredTelemetry();
+    } else if (storeSequence > storedTelemetryAcknowledgedSequence) {
+        // Send it again, along with anything after it. A failed duplicate of a message which has
+        // since been delivered needs nothing.
+        RewindStoredTelemetry();
+    }
+}
+
+/// <summary>
+///     Opens the application's mutable storage, loads the IoT Hub assigned by DPS, if any, and
+///     opens the telemetry store. If mutable storage is unavailable, the device is provisioned
+///     on every connection and buffered telemetry is kept in RAM only.
+/// </summary>
+static void OpenMutableStorage(void)
+{
+    mutableStorageFd = Storage_OpenMutableFile();
+    if (mutableStorageFd < 0) {
+        Log_Debug("WARNING: Cannot open mutable storage: %s (%d). Telemetry will not persist.\n",
+                  strerror(errno), errno);
+        return;
+    }
+
+    if (connectionType == ConnectionType_DPS &&
+        ReadProvisioningCache(mutableStorageFd, PROVISIONING_CACHE_OFFSET, scopeId,
+                              provisionedHubHostName, sizeof(provisionedHubHostName)) == 0) {
+        Log_Debug("INFO: Using IoT Hub %s from a previous DPS provisioning.\n",
+                  provisionedHubHostName);
+    }
+
+    telemetryStore = OpenTelemetryStore(mutableStorageFd, TELEMETRY_STORE_OFFSET,
+                                        TELEMETRY_STORE_SIZE);
+    if (telemetryStore == NULL) {
+        Log_Debug("WARNING: Cannot open telemetry store: %s (%d). Telemetry will not persist.\n",
+                  strerror(errno), errno);
+        return;
+    }
+
+    TelemetryStoreStats storeStats;
+    GetTelemetryStoreStats(telemetryStore, &storeStats);
+    Log_Debug("INFO: Telemetry store holds %zu unsent messages.\n", storeStats.pendingCount);
+}
+
+/// <summary>
+///     Telemetry store flush timer event:  Write buffered telemetry to mutable storage
+/// </summary>
+static void TelemetryStoreFlushTimerEventHandler(EventLoopTimer *timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_TelemetryStoreFlushTimer_Consume;
+        return;
+    }
+
+    if (telemetryStore != NULL && FlushTelemetryStore(telemetryStore) != 0) {
+        Log_Debug("ERROR: Cannot write telemetry store: %s (%d).\n", strerror(errno), errno);
+    }
+}
+
+/// <summary>
+///     Queues a telemetry sample. When batching is enabled the sample is added to the current
+///     batch, which is sent when it reaches TelemetryBatchSize samples, TelemetryBatchMaxBytes
+///     bytes or is TelemetryBatchPeriodSeconds old. Otherwise the sample is sent immediately.
+/// </summary>
+static void QueueTelemetrySample(const char *jsonSample, size_t length)
+{
+    if (telemetryBatchSize <= 1) {
+        SendTelemetry(jsonSample, length);
+        return;
+    }
+
+    if (AddTelemetryBatchSample(telemetryBatch, jsonSample, GetTimestampMilliseconds()) != 0) {
+        Log_Debug("WARNING: Cannot add sample to telemetry batch: %s (%d). Sending it alone.\n",
+                  strerror(errno), errno);
+        SendTelemetry(jsonSample, length);
+        return;
+    }
+
+    // Start the batch period when a new batch is opened; stop it when the sample completed one.
+    size_t pendingSamples = GetTelemetryBatchSampleCount(telemetryBatch);
+    if (pendingSamples == 1) {
+        struct timespec batchPeriod = {.tv_sec = telemetryBatchPeriodSeconds, .tv_nsec = 0};
+        SetEventLoopTimerOneShot(telemetryBatchTimer, &batchPeriod);
+    } else if (pendingSamples == 0) {
+        DisarmEventLoopTimer(telemetryBatchTimer);
+    }
+}
+
+/// <summary>
+///     Flush handler for the telemetry batch: sends the batch as a single message.
+/// </summary>
+static void SendTelemetryBatch(const char *json, size_t length, size_t sampleCount)
+{
+    Log_Debug("INFO: Sending telemetry batch of %zu samples (%zu bytes).\n", sampleCount, length);
+    SendTelemetry(json, length);
+}
+
+/// <summary>
+///     Telemetry batch timer event: send the pending batch when it reaches its maximum age.
+/// </summary>
+static void TelemetryBatchTimerEventHandler(EventLoopTimer *timer)
+{
+    if (ConsumeEventLoopTimerEvent(timer) != 0) {
+        exitCode = ExitCode_TelemetryBatchTimer_Consume;
+        return;
+    }
+
+    FlushTelemetryBatch(telemetryBatch);
+}
+
+/// <summary>
+///     Applies the TelemetryBatchSize, TelemetryBatchPeriodSeconds and TelemetryBatchMaxBytes
+///     desired properties, if present, and reports the settings in effect.
+/// </summary>
+static void UpdateTelemetryBatchSettings(const JSON_Object *desiredProperties)
+{
+    static char reportedPropertiesString[TWIN_REPORT_BUFFER_SIZE];
+    bool settingsChanged = false;
+
+    // Values are clamped before conversion, as converting an out-of-range double is undefined.
+    if (json_object_has_value_of_type(desiredProperties, "TelemetryBatchSize", JSONNumber)) {
+        double size = json_object_get_number(desiredProperties, "TelemetryBatchSize");
+        if (size < 1) {
+            size = 1;
+        } else if (size > TelemetryBatchSizeLimit) {
+            size = TelemetryBatchSizeLimit;
+        }
+        telemetryBatchSize = (int)size;
+        settingsChanged = true;
+    }
+
+    if (json_object_has_value_of_type(desiredProperties, "TelemetryBatchPeriodSeconds",
+                                      JSONNumber)) {
+        double period = json_object_get_number(desiredProperties, "TelemetryBatchPeriodSeconds");
+        if (period < 1) {
+            period = 1;
+        } else if (period > TelemetryBatchPeriodLimitSeconds) {
+            period = TelemetryBatchPeriodLimitSeconds;
+        }
+        telemetryBatchPeriodSeconds = (int)period;
+        settingsChanged = true;
+    }
+
+    if (json_object_has_value_of_type(desiredProperties, "TelemetryBatchMaxBytes", JSONNumber)) {
+        double maxBytes = json_object_get_number(desiredProperties, "TelemetryBatchMaxBytes");
+        if (maxBytes < TELEMETRY_BUFFER_SIZE) {
+            maxBytes = TELEMETRY_BUFFER_SIZE;
+        } else if (maxBytes > TELEMETRY_BATCH_BUFFER_SIZE) {
+            maxBytes = TELEMETRY_BATCH_BUFFER_SIZE;
+        }
+        telemetryBatchMaxBytes = (int)maxBytes;
+        settingsChanged = true;
+    }
+
+    if (!settingsChanged) {
+        return;
+    }
+
+    // A batch size of 1 disables batching; this flushes any samples still pending.
+    SetTelemetryBatchLimits(telemetryBatch, (size_t)telemetryBatchSize,
+                            (size_t)telemetryBatchMaxBytes);
+    if (GetTelemetryBatchSampleCount(telemetryBatch) == 0) {
+        DisarmEventLoopTimer(telemetryBatchTimer);
+    }
+
+    Log_Debug("INFO: Telemetry batch size %d, period %d s, max %d bytes.\n", telemetryBatchSize,
+              telemetryBatchPeriodSeconds, telemetryBatchMaxBytes);
+
+    int len = snprintf(reportedPropertiesString, TWIN_REPORT_BUFFER_SIZE,
+                       "{\"TelemetryBatchSize\":%d,\"TelemetryBatchPeriodSeconds\":%d,"
+                       "\"TelemetryBatchMaxBytes\":%d}",
+                       telemetryBatchSize, telemetryBatchPeriodSeconds, telemetryBatchMaxBytes);
+    if (len < 0 || len >= TWIN_REPORT_BUFFER_SIZE) {
+        Log_Debug("ERROR: Cannot write reported properties to buffer.\n");
+        return;
+    }
+    TwinReportState(reportedPropertiesString);
+}
+
+/// <summary>
+///     Returns the current wall-clock time in milliseconds since the Unix epoch.
+/// </summary>
+static uint64_t GetTimestampMilliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
+}
+
+/// <summary>
+///     Monotonic clock in milliseconds, for measuring intervals.
+/// </summary>
+static uint64_t GetMonotonicMilliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
 }
 
 /// <summary>
 ///     Enqueues a report containing Device Twin reported properties. The report is not sent
-///     immediately, but it is sent on the next invocation of IoTHubDeviceClient_LL_DoWork().
+///     immediately, but it is sent on the next invocation of IoTHubDeviceClient_LL_DoWork(),
+///     which is requested straight away.
 /// </summary>
 static void TwinReportState(const char *jsonState)
 {
     if (iothubClientHandle == NULL) {
         Log_Debug("ERROR: Azure IoT Hub client not initialized.\n");
     } else {
+        // Reported properties are sent even if the pool is exhausted, just without timing.
+        size_t length = strlen(jsonState);
+        SendContext *sendContext = AcquireSendContext(length);
         if (IoTHubDeviceClient_LL_SendReportedState(
-                iothubClientHandle, (const unsigned char *)jsonState, strlen(jsonState),
-                ReportedStateCallback, NULL) != IOTHUB_CLIENT_OK) {
+                iothubClientHandle, (const unsigned char *)jsonState, length,
+                ReportedStateCallback, sendContext) != IOTHUB_CLIENT_OK) {
             Log_Debug("ERROR: Azure IoT Hub client error when reporting state '%s'.\n", jsonState);
+            if (sendContext != NULL) {
+                ReleaseSendContext(sendContext);
+            }
         } else {
             Log_Debug("INFO: Azure IoT Hub client accepted request to report state '%s'.\n",
                       jsonState);
+            inFlightTwinReportCount++;
+            RequestAzureIoTDoWork();
         }
     }
 }
@@ -953,6 +2363,22 @@ static void TwinReportState(const char *jsonState)
 static void ReportedStateCallback(int result, void *context)
 {
     Log_Debug("INFO: Azure IoT Hub Device Twin reported state callback: status code %d.\n", result);
+    if (inFlightTwinReportCount > 0) {
+        inFlightTwinReportCount--;
+    }
+
+    // result is an HTTP status code.
+    if (result < 200 || result >= 300) {
+        twinReportErrorCount++;
+    }
+
+    SendContext *sendContext = context;
+    if (sendContext != NULL) {
+        uint32_t latency = ReleaseSendContext(sendContext);
+        if (result >= 200 && result < 300) {
+            RecordLatencyHistogramValue(&twinReportLatencyHistogram, latency);
+        }
+    }
 }
 
 /// <summary>
@@ -960,20 +2386,30 @@ static void ReportedStateCallback(int result, void *context)
 /// </summary>
 void SendSimulatedTelemetry(void)
 {
-    static char telemetryBuffer[TELEMETRY_BUFFER_SIZE];
-
     // Generate a simulated temperature.
     static float temperature = 50.0f;                    // starting temperature
     float delta = ((float)(rand() % 41)) / 20.0f - 1.0f; // between -1.0 and +1.0
     temperature += delta;
 
+    QueueTemperatureSample(temperature);
+}
+
+/// <summary>
+///     Serializes a temperature sample into the shared telemetry sample buffer and queues it.
+///     Every stage after this copies the sample or hands it on with its length, so a single
+///     preallocated buffer serves all samples.
+/// </summary>
+static void QueueTemperatureSample(float temperature)
+{
+    static char telemetryBuffer[TELEMETRY_BUFFER_SIZE];
+
     int len =
         snprintf(telemetryBuffer, TELEMETRY_BUFFER_SIZE, "{\"Temperature\":%3.2f}", temperature);
     if (len < 0 || len >= TELEMETRY_BUFFER_SIZE) {
         Log_Debug("ERROR: Cannot write telemetry to buffer.\n");
         return;
     }
-    SendTelemetry(telemetryBuffer);
+    QueueTelemetrySample(telemetryBuffer, (size_t)len);
 }
 
 
@@ -982,8 +2418,6 @@ void SendSimulatedTelemetry(void)
 //onboard sensor and using it to send real temeletry instead of simulated as above
 static void SendRealTemeletry(void)
 {
-    static char telemetryBuffer[TELEMETRY_BUFFER_SIZE];
-
     //MODIFYING THIS:
     // // Generate a simulated temperature.
     // static float temperature = 50.0f;                    // starting temperature
@@ -993,13 +2427,7 @@ static void SendRealTemeletry(void)
     //TO THIS:
     float temperature = lp_get_temperature();
 
-    int len =
-        snprintf(telemetryBuffer, TELEMETRY_BUFFER_SIZE, "{\"Temperature\":%3.2f}", temperature);
-    if (len < 0 || len >= TELEMETRY_BUFFER_SIZE) {
-        Log_Debug("ERROR: Cannot write telemetry to buffer.\n");
-        return;
-    }
-    SendTelemetry(telemetryBuffer);
+    QueueTemperatureSample(temperature);
 
 }
 
@@ -41,25 +41,118 @@
 #include <ctype.h>
 #include <math.h>
 #include <errno.h>
+#include <float.h>
+#include <locale.h>
+
+/* Vector scanning kernels, chosen at compile time. Define PARSON_DISABLE_SIMD to use the portable
+   kernels only. */
+#if !defined(PARSON_DISABLE_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PARSON_SCAN_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PARSON_SCAN_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PARSON_SCAN_NEON
+#endif
+#endif
 
 /* Apparently sscanf is not implemented in some "standard" libraries, so don't use it, if you
  * don't have to. */
 #define sscanf THINK_TWICE_ABOUT_USING_SSCANF
 
 #define STARTING_CAPACITY 16
+/* Objects with at least this many names get a hash index */
+#define OBJECT_INDEX_THRESHOLD 8
+#define OBJECT_INDEX_MIN_SLOTS 32 /* a power of 2, at least 2 * OBJECT_INDEX_THRESHOLD */
 #define MAX_NESTING 2048
 
-#define FLOAT_FORMAT "%1.17g" /* do not increase precision without incresing NUM_BUF_SIZE */
-/* double printed with "%1.17g" shouldn't be longer than 25 bytes so let's use 64 */
+/* double printed with at most 17 significant digits shouldn't be longer than 25 bytes, and the
+   longest fixed notation written by format_number is 39 bytes, so let's use 64 */
 #define NUM_BUF_SIZE 64
+#define MAX_NUMBER_PRECISION 17 /* significant digits that identify any double */
+/* Smallest magnitude that format_number writes in fixed notation */
+#define MIN_FIXED_NOTATION 1e-5
+
+/* Numbers with at most this many significant digits have an exact mantissa in a double, since
+   10^15 < 2^53 */
+#define MAX_EXACT_DIGITS 15
+#define MAX_EXACT_POW10 22 /* largest power of ten that is exact in a double */
+#define MAX_EXPONENT_DIGITS_VALUE 100000 /* exponents are clamped here while reading them */
+/* Rounding the exact mantissa and power of ten once is only correct without excess precision */
+#if (defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD != 0) || \
+    (defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ != 0)
+#define PARSON_NO_FAST_NUMBERS
+#endif
 
 #define SIZEOF_TOKEN(a) (sizeof(a) - 1)
 #define SKIP_CHAR(str) ((*str)++)
-#define SKIP_WHITESPACES(str)                 \
-    while (isspace((unsigned char)(**str))) { \
-        SKIP_CHAR(str);                       \
-    }
+/* Character at the parse position, or '\0' at the end of the input */
+#define CURRENT_CHAR(parser, str) (*(str) < (parser)->end ? **(str) : '\0')
+#define SKIP_WHITESPACES(parser, str) (*(str) = scan_whitespace(*(str), (parser)->end))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+/* Memory right after a value, in the same allocation, holding its string, object or array */
+#define VALUE_TAIL(value) ((char *)(value) + sizeof(JSON_Value))
+#define IS_SHARED_VALUE(value)                                                              \
+    ((value) == &json_null_value || (value) == &json_true_value || (value) == &json_false_value)
+
+#define ARENA_DEFAULT_SIZE 1024
+#define ARENA_ALIGNMENT 8 /* enough for double and pointers */
+#define ARENA_ALIGN(size) (((size) + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1))
+#define ARENA_BLOCK_HEADER_SIZE ARENA_ALIGN(sizeof(JSON_Arena_Block))
+#define ARENA_BLOCK_DATA(block) ((char *)(block) + ARENA_BLOCK_HEADER_SIZE)
+/* Objects and arrays in an arena can't give memory back when trimmed, so start them smaller */
+#define ARENA_STARTING_CAPACITY 4
+
+/* Freed nodes up to CACHE_MAX_BLOCK_SIZE are kept in lists of blocks of the same size class */
+#define CACHE_GRANULARITY 8 /* at least sizeof(JSON_Cache_Block) */
+#define CACHE_MAX_BLOCK_SIZE 1024 /* fits the first index of an object */
+#define CACHE_CLASS(size) (((size) + (CACHE_GRANULARITY - 1)) / CACHE_GRANULARITY)
+#define CACHE_CLASS_COUNT (CACHE_CLASS(CACHE_MAX_BLOCK_SIZE) + 1)
+
+/* Longest escaped string, in bytes between the quotes, that a SAX parse can decode. The buffer is
+   on the stack. */
+#ifndef PARSON_SAX_STRING_SIZE
+#define PARSON_SAX_STRING_SIZE 512
+#endif
+
+#define WRITER_CHUNK_SIZE 512 /* output staged for a write function, at least NUM_BUF_SIZE */
+#define BUFFER_DEFAULT_CAPACITY 256
+
+#define PATH_NOT_AN_INDEX ((size_t)-1)
+
+#define TAPE_HEADER_SIZE ARENA_ALIGN(sizeof(JSON_Tape)) /* the numbers follow it */
+#define TAPE_TAG(entry) ((int)((entry).tag & 0xFF))
+#define TAPE_COUNT_SHIFT 8 /* count of members or items above the tag of an object or array */
+#define TAPE_MAX_COUNT 0xFFFFFF /* saturated count, which is then found by walking */
+#define TAPE_MAX_PAYLOAD ((unsigned int)-1)
+#define TAPE_STRING_HEADER_SIZE sizeof(unsigned int) /* length before each string */
+/* Space for a string beyond its bytes: the length before and the NUL after */
+#define TAPE_STRING_OVERHEAD (TAPE_STRING_HEADER_SIZE + 1)
+
+/* Kind of a tape entry, and what its payload holds */
+enum json_tape_tag {
+    TAPE_ROOT = 'r',       /* first entry; the number of entries */
+    TAPE_OBJECT = '{',     /* index of the entry after the matching TAPE_OBJECT_END */
+    TAPE_OBJECT_END = '}', /* index of the matching TAPE_OBJECT */
+    TAPE_ARRAY = '[',      /* index of the entry after the matching TAPE_ARRAY_END */
+    TAPE_ARRAY_END = ']',  /* index of the matching TAPE_ARRAY */
+    TAPE_NAME = ':',       /* offset of the name in strings; the member's value follows */
+    TAPE_STRING = '"',     /* offset of the string in strings */
+    TAPE_NUMBER = 'd',     /* index in numbers */
+    TAPE_TRUE = 't',
+    TAPE_FALSE = 'f',
+    TAPE_NULL = 'n'
+};
+
+/* What a projection parse does with the value of a name */
+enum json_projection {
+    PROJECTION_SKIP,   /* no path goes through it */
+    PROJECTION_KEEP,   /* a path ends at it, so it is built whole */
+    PROJECTION_DESCEND /* paths go on inside it */
+};
 
 #undef malloc
 #undef free
@@ -67,30 +160,62 @@
 static JSON_Malloc_Function parson_malloc = malloc;
 static JSON_Free_Function parson_free = free;
 
+/* A freed node in the cache; the rest of its block is unused */
+typedef struct json_cache_block_t {
+    struct json_cache_block_t *next;
+} JSON_Cache_Block;
+
+static JSON_Cache_Block *node_cache[CACHE_CLASS_COUNT]; /* indexed by size class */
+static size_t node_cache_size = 0;  /* bytes in node_cache */
+static size_t node_cache_limit = 0; /* 0 disables the cache */
+
+#ifndef PARSON_NO_FAST_NUMBERS
+static const double exact_pow10[MAX_EXACT_POW10 + 1] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+#endif
+
 #define IS_CONT(b) (((unsigned char)(b)&0xC0) == 0x80) /* is utf-8 continuation byte */
 
 /* Type definitions */
 typedef union json_value_value {
+    int boolean; /* first, so that the shared true value can be initialized with it */
     char *string;
     double number;
     JSON_Object *object;
     JSON_Array *array;
-    int boolean;
     int null;
 } JSON_Value_Value;
 
+/* A string, object or array is allocated together with its value, in its VALUE_TAIL (except for
+   strings parsed in situ), so that a value needs no allocation of its own besides the node */
 struct json_value_t {
     JSON_Value *parent;
-    JSON_Value_Type type;
+    signed char type;        /* JSON_Value_Type, kept small so precision fits in its padding */
+    unsigned char precision; /* significant digits for numbers in this value, 0 for shortest */
     JSON_Value_Value value;
 };
 
+/* Open addressing hash index slot, with linear probing */
+typedef struct json_object_slot_t {
+    unsigned long hash;
+    size_t name_len;
+    size_t index; /* index of the name + 1, 0 for an empty slot */
+} JSON_Object_Slot;
+
+/* A name and its value, side by side so that a lookup touches one array */
+typedef struct json_object_entry_t {
+    char *name;
+    JSON_Value *value;
+} JSON_Object_Entry;
+
 struct json_object_t {
     JSON_Value *wrapping_value;
-    char **names;
-    JSON_Value **values;
+    JSON_Object_Entry *entries;
     size_t count;
     size_t capacity;
+    JSON_Object_Slot *slots; /* NULL until count reaches OBJECT_INDEX_THRESHOLD */
+    size_t slot_count;       /* a power of 2, at least twice count */
 };
 
 struct json_array_t {
@@ -100,6 +225,150 @@ struct json_array_t {
     size_t capacity;
 };
 
+typedef struct json_arena_block_t JSON_Arena_Block;
+
+struct json_arena_block_t {
+    JSON_Arena_Block *next; /* previous block in the chain */
+    size_t size;            /* bytes of data following the header */
+    size_t used;
+};
+
+struct json_arena_t {
+    JSON_Arena_Block *blocks; /* newest block first */
+    char *last_allocation;    /* can be resized in place */
+};
+
+/* A name of a compiled path, which also selects an array item if it is an index */
+typedef struct json_path_segment_t {
+    const char *name; /* NUL-terminated, in the path's own memory */
+    size_t name_len;
+    unsigned long hash; /* of name, as the object index computes it */
+    size_t index;       /* array index, or PATH_NOT_AN_INDEX */
+    size_t hint;        /* index at which name was last found in an object */
+} JSON_Path_Segment;
+
+struct json_path_t {
+    JSON_Path_Segment *segments;
+    size_t segment_count;
+    size_t matched; /* segments matched by the object being parsed, in a projection parse */
+};
+
+/* State shared by the parse functions */
+typedef struct json_parser_t {
+    const char *end;   /* end of the input, which needn't be NUL-terminated */
+    JSON_Arena *arena; /* NULL when allocating with parson_malloc */
+    int is_in_situ;    /* decode strings in the input, which is then writable; needs an arena */
+    JSON_Path *const *paths; /* values to build in a projection parse, or NULL to build all */
+    size_t path_count;
+} JSON_Parser;
+
+/* State shared by the SAX parse functions */
+typedef struct json_sax_parser_t {
+    JSON_Parser parser; /* only end is used */
+    const JSON_SAX_Handler *handler;
+    void *context;
+    char *string_buffer; /* for decoding strings with escapes */
+    size_t string_buffer_size;
+} JSON_SAX_Parser;
+
+/* What a push parse expects next */
+enum json_push_state {
+    PUSH_VALUE,       /* a value, at the top or after ':', or after ',' in an array */
+    PUSH_FIRST_VALUE, /* a value or ']' right after '[' */
+    PUSH_NAME,        /* a name after ',' in an object */
+    PUSH_FIRST_NAME,  /* a name or '}' right after '{' */
+    PUSH_COLON,       /* ':' after a name */
+    PUSH_NEXT,        /* ',' or the end of the innermost object or array */
+    PUSH_DONE         /* the first value is complete, and the rest of the input is ignored */
+};
+
+/* Token cut off by the end of a chunk */
+enum json_push_token {
+    PUSH_TOKEN_NONE,
+    PUSH_TOKEN_STRING,  /* bytes after the opening quote so far are in the token buffer */
+    PUSH_TOKEN_NUMBER,  /* bytes so far are in the token buffer */
+    PUSH_TOKEN_LITERAL  /* literal_matched bytes of literal have been matched */
+};
+
+struct json_push_parser_t {
+    const JSON_SAX_Handler *handler;
+    void *context;
+    int state;          /* json_push_state */
+    int token_kind;     /* json_push_token */
+    JSON_Buffer *token; /* token cut off by the end of a chunk, or a string being decoded */
+    int is_name;        /* the string token is a name */
+    int is_escaped;     /* the string token so far ends in a backslash */
+    const char *literal;
+    size_t literal_len;
+    size_t literal_matched;
+    char *containers; /* '{' or '[' for each open object or array, innermost last */
+    size_t depth;
+    size_t containers_capacity;
+    int is_started; /* past the first byte, where a BOM may be */
+    int is_failed;
+    /* Building a value, when there is no handler of the caller */
+    JSON_Parser parser; /* only the arena, which is NULL, is used */
+    JSON_Value *root;
+    JSON_Value *current; /* innermost open object or array */
+    char *name;          /* name of the next value added to an object */
+};
+
+/* A tagged 64-bit word of a tape. The low byte of tag is a json_tape_tag. */
+typedef struct json_tape_entry_t {
+    unsigned int tag;
+    unsigned int payload;
+} JSON_Tape_Entry;
+
+/* One allocation: this header, then numbers, entries and strings */
+struct json_tape_t {
+    JSON_Tape_Entry *entries; /* in document order, TAPE_ROOT first */
+    size_t entry_count;
+    double *numbers;
+    size_t number_count;
+    char *strings; /* each is its length as an unsigned int, its bytes and a NUL */
+    size_t strings_size;
+};
+
+/* State of the tape parse functions */
+typedef struct json_tape_parser_t {
+    JSON_Parser parser; /* only end is used */
+    JSON_Tape *tape;
+    size_t entry_capacity; /* room measured for the tape */
+    size_t number_capacity;
+    size_t strings_capacity;
+} JSON_Tape_Parser;
+
+/* Where serialized output goes */
+enum json_writer_kind {
+    WRITER_FIXED,    /* a caller's buffer of fixed size */
+    WRITER_BUFFER,   /* a growable JSON_Buffer, written in place */
+    WRITER_FUNCTION, /* a write function, fed from a staging chunk */
+    WRITER_COUNT     /* nowhere; only the length is counted */
+};
+
+typedef struct json_writer_t {
+    char *pos;    /* next byte of output */
+    char *end;    /* end of the space available at pos */
+    int kind;     /* json_writer_kind */
+    char *chunk;  /* staging space of WRITER_FUNCTION and WRITER_COUNT */
+    size_t count; /* bytes flushed from the chunk */
+    JSON_Buffer *buffer;
+    JSON_Write_Function write_fun;
+    void *context;
+} JSON_Writer;
+
+struct json_buffer_t {
+    char *data;      /* always NUL-terminated */
+    size_t length;   /* not counting the NUL */
+    size_t capacity; /* bytes at data */
+};
+
+/* Values of null, true and false are immutable, so every one of them is one of these. They never
+   get a parent, and freeing them does nothing. */
+static JSON_Value json_null_value = {NULL, JSONNull, 0, {0}};
+static JSON_Value json_true_value = {NULL, JSONBoolean, 0, {1}};
+static JSON_Value json_false_value = {NULL, JSONBoolean, 0, {0}};
+
 /* Various */
 static void remove_comments(char *string, const char *start_token, const char *end_token);
 static char *parson_strndup(const char *string, size_t n);
@@ -109,16 +378,36 @@ static int parse_utf16_hex(const char *string, unsigned int *result);
 static int num_bytes_in_utf8_sequence(unsigned char c);
 static int verify_utf8_sequence(const unsigned char *string, int *len);
 static int is_valid_utf8(const char *string, size_t string_len);
-static int is_decimal(const char *string, size_t length);
+static int is_number_char(char c);
+
+/* Node cache */
+static void *node_malloc(size_t n);
+static void node_free(void *ptr, size_t n);
+static char *node_strndup(const char *string, size_t n);
+static void node_free_string(char *string);
+static void node_cache_trim(size_t max_bytes);
+
+/* Scanning */
+static const char *scan_whitespace(const char *string, const char *end);
+static const char *scan_string(const char *string, const char *end);
+static const char *scan_ascii(const char *string, const char *end);
+static unsigned long hash_string(const char *string, size_t n);
 
 /* JSON Object */
-static JSON_Object *json_object_init(JSON_Value *wrapping_value);
+static void json_object_init(JSON_Object *object, JSON_Value *wrapping_value);
 static JSON_Status json_object_add(JSON_Object *object, const char *name, JSON_Value *value);
 static JSON_Status json_object_addn(JSON_Object *object, const char *name, size_t name_len,
                                     JSON_Value *value);
 static JSON_Status json_object_resize(JSON_Object *object, size_t new_capacity);
 static JSON_Value *json_object_getn_value(const JSON_Object *object, const char *name,
                                           size_t name_len);
+static size_t json_object_find(const JSON_Object *object, const char *name, size_t name_len);
+static size_t json_object_find_hashed(const JSON_Object *object, const char *name, size_t name_len,
+                                      unsigned long hash);
+static size_t json_object_find_slot(const JSON_Object *object, size_t index);
+static void json_object_index_insert(JSON_Object *object, size_t index);
+static void json_object_index_remove(JSON_Object *object, size_t index);
+static void json_object_update_index(JSON_Object *object, JSON_Arena *arena);
 static JSON_Status json_object_remove_internal(JSON_Object *object, const char *name,
                                                int free_value);
 static JSON_Status json_object_dotremove_internal(JSON_Object *object, const char *name,
@@ -126,33 +415,138 @@ static JSON_Status json_object_dotremove_internal(JSON_Object *object, const cha
 static void json_object_free(JSON_Object *object);
 
 /* JSON Array */
-static JSON_Array *json_array_init(JSON_Value *wrapping_value);
+static void json_array_init(JSON_Array *array, JSON_Value *wrapping_value);
 static JSON_Status json_array_add(JSON_Array *array, JSON_Value *value);
 static JSON_Status json_array_resize(JSON_Array *array, size_t new_capacity);
 static void json_array_free(JSON_Array *array);
 
 /* JSON Value */
-static JSON_Value *json_value_init_string_no_copy(char *string);
+static JSON_Value *json_value_init_stringn(const char *string, size_t len);
+static void json_value_set_parent(JSON_Value *value, JSON_Value *parent);
+
+/* Arena */
+static JSON_Arena_Block *json_arena_add_block(JSON_Arena *arena, size_t size);
+static void *json_arena_malloc(JSON_Arena *arena, size_t n);
+static void *json_arena_resize(JSON_Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+/* Parser allocation */
+static void *parser_malloc(const JSON_Parser *parser, size_t n);
+static void parser_free(const JSON_Parser *parser, void *ptr, size_t n);
+static void parser_free_string(const JSON_Parser *parser, char *string);
+static void parser_free_value(const JSON_Parser *parser, JSON_Value *value);
+static JSON_Value *parser_init_value(const JSON_Parser *parser, JSON_Value_Type type);
+static JSON_Value *parser_init_string(const JSON_Parser *parser, const char *input, size_t len);
+static JSON_Status parser_object_add(const JSON_Parser *parser, JSON_Object *object, char *name,
+                                     JSON_Value *value);
+static JSON_Status parser_array_add(const JSON_Parser *parser, JSON_Array *array,
+                                    JSON_Value *value);
 
 /* Parser */
-static JSON_Status skip_quotes(const char **string);
-static int parse_utf16(const char **unprocessed, char **processed);
-static char *process_string(const char *input, size_t len);
-static char *get_quoted_string(const char **string);
-static JSON_Value *parse_object_value(const char **string, size_t nesting);
-static JSON_Value *parse_array_value(const char **string, size_t nesting);
-static JSON_Value *parse_string_value(const char **string);
-static JSON_Value *parse_boolean_value(const char **string);
-static JSON_Value *parse_number_value(const char **string);
-static JSON_Value *parse_null_value(const char **string);
-static JSON_Value *parse_value(const char **string, size_t nesting);
+static JSON_Status skip_quotes(const JSON_Parser *parser, const char **string);
+static int parse_utf16(const char **unprocessed, const char *unprocessed_end, char **processed);
+static char *process_string(const JSON_Parser *parser, const char *input, size_t len);
+static char *get_quoted_string(const JSON_Parser *parser, const char **string);
+static JSON_Value *parse_object_value(const JSON_Parser *parser, const char **string,
+                                      size_t nesting);
+static JSON_Value *parse_array_value(const JSON_Parser *parser, const char **string,
+                                     size_t nesting);
+static JSON_Value *parse_string_value(const JSON_Parser *parser, const char **string);
+static JSON_Value *parse_boolean_value(const JSON_Parser *parser, const char **string);
+static JSON_Value *parse_number_value(const JSON_Parser *parser, const char **string);
+static const char *parse_number(const char *string, const char *end, double *result);
+static int parse_number_slow(const char *string, size_t length, double *result);
+static JSON_Value *parse_null_value(const JSON_Parser *parser, const char **string);
+static JSON_Value *parse_value(const JSON_Parser *parser, const char **string, size_t nesting);
+static JSON_Value *parse_buffer(JSON_Parser *parser, const char *data, size_t len);
+static JSON_Value *parse_buffer_in_arena(JSON_Parser *parser, const char *data, size_t len);
+
+/* Projection parser */
+static JSON_Value *parse_projected_object(const JSON_Parser *parser, const char **string,
+                                          size_t level);
+static int project_name(const JSON_Parser *parser, size_t level, const char *name,
+                        size_t name_len);
+static void unproject_name(const JSON_Parser *parser, size_t level);
+static JSON_Status skip_value(const JSON_Parser *parser, const char **string);
+static char *decode_string(const char *input, const char *input_end, char *output);
+static int skip_literal(const JSON_Parser *parser, const char **string, const char *literal,
+                        size_t literal_len);
+
+/* SAX parser */
+static JSON_Status sax_parse_value(const JSON_SAX_Parser *sax, const char **string,
+                                   size_t nesting);
+static JSON_Status sax_parse_object(const JSON_SAX_Parser *sax, const char **string,
+                                    size_t nesting);
+static JSON_Status sax_parse_array(const JSON_SAX_Parser *sax, const char **string,
+                                   size_t nesting);
+static JSON_Status sax_parse_string(const JSON_SAX_Parser *sax, const char **string, int is_name);
+
+/* Push parser */
+static JSON_Push_Parser *push_parser_create(const JSON_SAX_Handler *handler, void *context);
+static JSON_Status push_parse_chunk(JSON_Push_Parser *push, const char *p, const char *end);
+static const char *push_start_value(JSON_Push_Parser *push, const char *p, const char *end);
+static const char *push_open(JSON_Push_Parser *push, const char *p);
+static const char *push_close(JSON_Push_Parser *push, const char *p);
+static void push_value_done(JSON_Push_Parser *push);
+static const char *push_continue_token(JSON_Push_Parser *push, const char *p, const char *end);
+static const char *push_scan_string(JSON_Push_Parser *push, const char *p, const char *end);
+static JSON_Status push_string_done(JSON_Push_Parser *push, const char *start, const char *end);
+static JSON_Status push_number_done(JSON_Push_Parser *push, const char *start, const char *end);
+static JSON_Status push_literal_done(JSON_Push_Parser *push);
+static JSON_Status push_dom_add(JSON_Push_Parser *push, JSON_Value *value);
+static JSON_Status push_dom_start_object(void *context);
+static JSON_Status push_dom_end_object(void *context);
+static JSON_Status push_dom_start_array(void *context);
+static JSON_Status push_dom_end_array(void *context);
+static JSON_Status push_dom_name(void *context, const char *name, size_t name_len);
+static JSON_Status push_dom_string(void *context, const char *string, size_t len);
+static JSON_Status push_dom_number(void *context, double number);
+static JSON_Status push_dom_boolean(void *context, int boolean);
+static JSON_Status push_dom_null(void *context);
+
+/* Tape */
+static JSON_Status tape_measure(const JSON_Parser *parser, const char *string,
+                                size_t *entry_count, size_t *number_count, size_t *strings_size);
+static JSON_Status tape_append(JSON_Tape_Parser *tape_parser, int tag, size_t payload);
+static JSON_Status tape_close(JSON_Tape_Parser *tape_parser, size_t start, size_t count,
+                              int end_tag);
+static JSON_Status tape_parse_value(JSON_Tape_Parser *tape_parser, const char **string,
+                                    size_t nesting);
+static JSON_Status tape_parse_object(JSON_Tape_Parser *tape_parser, const char **string,
+                                     size_t nesting);
+static JSON_Status tape_parse_array(JSON_Tape_Parser *tape_parser, const char **string,
+                                    size_t nesting);
+static JSON_Status tape_parse_string(JSON_Tape_Parser *tape_parser, const char **string, int tag);
+static const JSON_Tape_Entry *tape_get_entry(const JSON_Tape *tape, size_t value);
+static size_t tape_skip(const JSON_Tape *tape, size_t value);
+static const char *tape_get_string(const JSON_Tape *tape, size_t offset, size_t *len);
+static JSON_Value *tape_to_value(const JSON_Tape *tape, size_t value);
+
+/* Compiled paths */
+static size_t path_parse_index(const char *name, size_t name_len);
 
 /* Serialization */
-static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int level, int is_pretty,
-                                      char *num_buf);
-static int json_serialize_string(const char *string, char *buf);
-static int append_indent(char *buf, int level);
-static int append_string(char *buf, const char *string);
+static JSON_Status json_serialize_to_writer_r(const JSON_Value *value, JSON_Writer *writer,
+                                              int level, int is_pretty, int precision);
+static int format_number(double number, int precision, char *buf);
+static int format_fixed(double digits, int fraction_digits, int is_negative, char *buf);
+static int format_with_sprintf(double number, int precision, int is_shortest, char *buf);
+static JSON_Status json_serialize_string(const char *string, JSON_Writer *writer);
+static size_t serialization_size(const JSON_Value *value, int is_pretty);
+static JSON_Status serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes,
+                                       int is_pretty);
+static char *serialize_to_string(const JSON_Value *value, int is_pretty);
+static JSON_Status serialize_to_writer(const JSON_Value *value, JSON_Write_Function write_fun,
+                                       void *context, int is_pretty);
+
+/* Writer */
+static void writer_init(JSON_Writer *writer, int kind, char *start, char *end);
+static JSON_Status writer_make_room(JSON_Writer *writer, size_t n);
+static JSON_Status writer_flush(JSON_Writer *writer);
+static JSON_Status writer_finish(JSON_Writer *writer);
+static JSON_Status writer_append(JSON_Writer *writer, const char *data, size_t len);
+static JSON_Status writer_append_indent(JSON_Writer *writer, int level);
+static JSON_Status writer_append_number(JSON_Writer *writer, double number, int precision);
+static JSON_Status json_buffer_reserve(JSON_Buffer *buffer, size_t n);
 
 /* Various */
 static char *parson_strndup(const char *string, size_t n)
@@ -171,6 +565,77 @@ static char *parson_strdup(const char *string)
     return parson_strndup(string, strlen(string));
 }
 
+/* Node cache */
+/* Allocates values, names, and small entry, item and slot arrays. A block that fits a size class
+   is rounded up to it, so that any block freed with node_free can be reused for its class. */
+static void *node_malloc(size_t n)
+{
+    size_t class_index = CACHE_CLASS(n);
+    JSON_Cache_Block *block = NULL;
+    if (n > CACHE_MAX_BLOCK_SIZE) {
+        return parson_malloc(n);
+    }
+    block = node_cache[class_index];
+    if (block == NULL) {
+        return parson_malloc(class_index * CACHE_GRANULARITY);
+    }
+    node_cache[class_index] = block->next;
+    node_cache_size -= class_index * CACHE_GRANULARITY;
+    return block;
+}
+
+/* n is the size ptr was allocated with by node_malloc, or less */
+static void node_free(void *ptr, size_t n)
+{
+    size_t class_index = CACHE_CLASS(n);
+    JSON_Cache_Block *block = (JSON_Cache_Block *)ptr;
+    if (ptr == NULL) {
+        return;
+    }
+    if (n > CACHE_MAX_BLOCK_SIZE ||
+        node_cache_size + class_index * CACHE_GRANULARITY > node_cache_limit) {
+        parson_free(ptr);
+        return;
+    }
+    block->next = node_cache[class_index];
+    node_cache[class_index] = block;
+    node_cache_size += class_index * CACHE_GRANULARITY;
+}
+
+static char *node_strndup(const char *string, size_t n)
+{
+    char *output_string = (char *)node_malloc(n + 1);
+    if (!output_string) {
+        return NULL;
+    }
+    output_string[n] = '\0';
+    strncpy(output_string, string, n);
+    return output_string;
+}
+
+static void node_free_string(char *string)
+{
+    if (string != NULL) {
+        node_free(string, strlen(string) + 1);
+    }
+}
+
+/* Frees cached blocks, the largest first, until the cache holds at most max_bytes */
+static void node_cache_trim(size_t max_bytes)
+{
+    size_t i = CACHE_CLASS_COUNT;
+    JSON_Cache_Block *block = NULL;
+    while (i > 0 && node_cache_size > max_bytes) {
+        i--;
+        while (node_cache[i] != NULL && node_cache_size > max_bytes) {
+            block = node_cache[i];
+            node_cache[i] = block->next;
+            node_cache_size -= i * CACHE_GRANULARITY;
+            parson_free(block);
+        }
+    }
+}
+
 static int hex_char_to_int(char c)
 {
     if (c >= '0' && c <= '9') {
@@ -262,6 +727,10 @@ static int is_valid_utf8(const char *string, size_t string_len)
     int len = 0;
     const char *string_end = string + string_len;
     while (string < string_end) {
+        string = scan_ascii(string, string_end);
+        if (string == string_end) {
+            break;
+        }
         if (!verify_utf8_sequence((const unsigned char *)string, &len)) {
             return 0;
         }
@@ -270,20 +739,21 @@ static int is_valid_utf8(const char *string, size_t string_len)
     return 1;
 }
 
-static int is_decimal(const char *string, size_t length)
+static int is_number_char(char c)
 {
-    if (length > 1 && string[0] == '0' && string[1] != '.') {
-        return 0;
-    }
-    if (length > 2 && !strncmp(string, "-0", 2) && string[2] != '.') {
-        return 0;
-    }
-    while (length--) {
-        if (strchr("xX", string[length])) {
-            return 0;
-        }
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+/* FNV-1a */
+static unsigned long hash_string(const char *string, size_t n)
+{
+    unsigned long hash = 2166136261UL;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 16777619UL;
     }
-    return 1;
+    return hash;
 }
 
 static void remove_comments(char *string, const char *start_token, const char *end_token)
@@ -322,19 +792,208 @@ static void remove_comments(char *string, const char *start_token, const char *e
     }
 }
 
-/* JSON Object */
-static JSON_Object *json_object_init(JSON_Value *wrapping_value)
+/* Scanning
+   Each kernel returns the first byte in [string, end) that it stops at, or end. The vector
+   kernels test a block of SCAN_BLOCK_SIZE bytes at a time for bytes to stop at, building a mask
+   with SCAN_MASK_BITS bits per byte, and finish the last partial block a byte at a time. */
+#define IS_WHITESPACE(c) ((c) == ' ' || ((unsigned char)(c) - 0x09u) <= 0x04u) /* as isspace */
+#define IS_STRING_SPECIAL(c) ((c) == '\"' || (c) == '\\' || (unsigned char)(c) < 0x20)
+
+#if defined(PARSON_SCAN_AVX2)
+#define SCAN_BLOCK_SIZE 32
+#define SCAN_MASK_BITS 1
+typedef unsigned int scan_mask_t;
+
+static scan_mask_t whitespace_mask(const char *string) /* bits of the non-whitespace bytes */
 {
-    JSON_Object *new_obj = (JSON_Object *)parson_malloc(sizeof(JSON_Object));
-    if (new_obj == NULL) {
-        return NULL;
+    __m256i block = _mm256_loadu_si256((const __m256i *)string);
+    __m256i control = _mm256_sub_epi8(block, _mm256_set1_epi8(0x09));
+    __m256i is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8(0x04)),
+                                           control); /* 0x09 to 0x0d */
+    __m256i is_space = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(' '));
+    return ~(scan_mask_t)_mm256_movemask_epi8(_mm256_or_si256(is_control, is_space));
+}
+
+static scan_mask_t string_special_mask(const char *string)
+{
+    __m256i block = _mm256_loadu_si256((const __m256i *)string);
+    __m256i is_quote = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\"'));
+    __m256i is_backslash = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\'));
+    __m256i is_control =
+        _mm256_cmpeq_epi8(_mm256_min_epu8(block, _mm256_set1_epi8(0x1f)), block);
+    return (scan_mask_t)_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_or_si256(is_quote, is_backslash), is_control));
+}
+
+static scan_mask_t non_ascii_mask(const char *string)
+{
+    return (scan_mask_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)string));
+}
+#elif defined(PARSON_SCAN_SSE2)
+#define SCAN_BLOCK_SIZE 16
+#define SCAN_MASK_BITS 1
+typedef unsigned int scan_mask_t;
+
+static scan_mask_t whitespace_mask(const char *string) /* bits of the non-whitespace bytes */
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)string);
+    __m128i control = _mm_sub_epi8(block, _mm_set1_epi8(0x09));
+    __m128i is_control =
+        _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(0x04)), control); /* 0x09 to 0x0d */
+    __m128i is_space = _mm_cmpeq_epi8(block, _mm_set1_epi8(' '));
+    return ~(scan_mask_t)_mm_movemask_epi8(_mm_or_si128(is_control, is_space)) & 0xffffu;
+}
+
+static scan_mask_t string_special_mask(const char *string)
+{
+    __m128i block = _mm_loadu_si128((const __m128i *)string);
+    __m128i is_quote = _mm_cmpeq_epi8(block, _mm_set1_epi8('\"'));
+    __m128i is_backslash = _mm_cmpeq_epi8(block, _mm_set1_epi8('\\'));
+    __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(0x1f)), block);
+    return (scan_mask_t)_mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(is_quote, is_backslash), is_control));
+}
+
+static scan_mask_t non_ascii_mask(const char *string)
+{
+    return (scan_mask_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)string));
+}
+#elif defined(PARSON_SCAN_NEON)
+#define SCAN_BLOCK_SIZE 16
+#define SCAN_MASK_BITS 4
+typedef unsigned long long scan_mask_t;
+
+/* NEON has no movemask, so narrow each 0x00/0xff byte to a nibble */
+static scan_mask_t neon_mask(uint8x16_t matches)
+{
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return (scan_mask_t)vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+
+static scan_mask_t whitespace_mask(const char *string) /* bits of the non-whitespace bytes */
+{
+    uint8x16_t block = vld1q_u8((const uint8_t *)string);
+    uint8x16_t is_control = vcleq_u8(vsubq_u8(block, vdupq_n_u8(0x09)), vdupq_n_u8(0x04));
+    uint8x16_t is_space = vceqq_u8(block, vdupq_n_u8(' '));
+    return neon_mask(vmvnq_u8(vorrq_u8(is_control, is_space)));
+}
+
+static scan_mask_t string_special_mask(const char *string)
+{
+    uint8x16_t block = vld1q_u8((const uint8_t *)string);
+    uint8x16_t is_quote = vceqq_u8(block, vdupq_n_u8('\"'));
+    uint8x16_t is_backslash = vceqq_u8(block, vdupq_n_u8('\\'));
+    uint8x16_t is_control = vcleq_u8(block, vdupq_n_u8(0x1f));
+    return neon_mask(vorrq_u8(vorrq_u8(is_quote, is_backslash), is_control));
+}
+
+static scan_mask_t non_ascii_mask(const char *string)
+{
+    return neon_mask(vcgeq_u8(vld1q_u8((const uint8_t *)string), vdupq_n_u8(0x80)));
+}
+#else
+/* Portable kernels test a word at a time (SWAR). The masks only tell whether a word has a byte
+   to stop at, so SCAN_MASK_BITS is left undefined and the byte loop finds it. There is no
+   whitespace kernel, as runs of whitespace are short in the documents parson usually sees. */
+#define SCAN_BLOCK_SIZE sizeof(size_t)
+typedef size_t scan_mask_t;
+#define SWAR_ONES (~(size_t)0 / 0xff)      /* 0x0101... */
+#define SWAR_HIGH_BITS (SWAR_ONES * 0x80) /* 0x8080... */
+#define SWAR_HAS_ZERO(word) (((word)-SWAR_ONES) & ~(word)&SWAR_HIGH_BITS)
+
+static scan_mask_t string_special_mask(const char *string)
+{
+    size_t word;
+    memcpy(&word, string, sizeof(word));
+    return SWAR_HAS_ZERO(word ^ (SWAR_ONES * '\"')) | SWAR_HAS_ZERO(word ^ (SWAR_ONES * '\\')) |
+           ((word - SWAR_ONES * 0x20) & ~word & SWAR_HIGH_BITS); /* a byte below 0x20 */
+}
+
+static scan_mask_t non_ascii_mask(const char *string)
+{
+    size_t word;
+    memcpy(&word, string, sizeof(word));
+    return word & SWAR_HIGH_BITS;
+}
+#endif
+
+#if defined(SCAN_MASK_BITS) && defined(__GNUC__)
+/* Index of the first byte whose bits are set in a mask */
+#define SCAN_MASK_INDEX(mask)                                                             \
+    ((size_t)(sizeof(mask) > sizeof(unsigned int) ? __builtin_ctzll(mask)                 \
+                                                  : __builtin_ctz((unsigned int)(mask))) / \
+     SCAN_MASK_BITS)
+#endif
+
+/* Jumps to the first byte to stop at in a block, or leaves it to the byte loop */
+#ifdef SCAN_MASK_INDEX
+#define SCAN_STOP(string, mask) return (string) + SCAN_MASK_INDEX(mask)
+#else
+#define SCAN_STOP(string, mask) break
+#endif
+
+static const char *scan_whitespace(const char *string, const char *end)
+{
+#if defined(SCAN_MASK_BITS)
+    scan_mask_t mask;
+    if (string < end && !IS_WHITESPACE(*string)) { /* usually there is no whitespace at all */
+        return string;
+    }
+    while ((size_t)(end - string) >= SCAN_BLOCK_SIZE) {
+        mask = whitespace_mask(string);
+        if (mask != 0) {
+            SCAN_STOP(string, mask);
+        }
+        string += SCAN_BLOCK_SIZE;
+    }
+#endif
+    while (string < end && IS_WHITESPACE(*string)) {
+        string++;
+    }
+    return string;
+}
+
+static const char *scan_string(const char *string, const char *end)
+{
+    scan_mask_t mask;
+    while ((size_t)(end - string) >= SCAN_BLOCK_SIZE) {
+        mask = string_special_mask(string);
+        if (mask != 0) {
+            SCAN_STOP(string, mask);
+        }
+        string += SCAN_BLOCK_SIZE;
+    }
+    while (string < end && !IS_STRING_SPECIAL(*string)) {
+        string++;
+    }
+    return string;
+}
+
+static const char *scan_ascii(const char *string, const char *end)
+{
+    scan_mask_t mask;
+    while ((size_t)(end - string) >= SCAN_BLOCK_SIZE) {
+        mask = non_ascii_mask(string);
+        if (mask != 0) {
+            SCAN_STOP(string, mask);
+        }
+        string += SCAN_BLOCK_SIZE;
+    }
+    while (string < end && !((unsigned char)*string & 0x80)) {
+        string++;
     }
-    new_obj->wrapping_value = wrapping_value;
-    new_obj->names = (char **)NULL;
-    new_obj->values = (JSON_Value **)NULL;
-    new_obj->capacity = 0;
-    new_obj->count = 0;
-    return new_obj;
+    return string;
+}
+
+/* JSON Object */
+static void json_object_init(JSON_Object *object, JSON_Value *wrapping_value)
+{
+    object->wrapping_value = wrapping_value;
+    object->entries = NULL;
+    object->capacity = 0;
+    object->count = 0;
+    object->slots = NULL;
+    object->slot_count = 0;
 }
 
 static JSON_Status json_object_add(JSON_Object *object, const char *name, JSON_Value *value)
@@ -362,42 +1021,32 @@ static JSON_Status json_object_addn(JSON_Object *object, const char *name, size_
         }
     }
     index = object->count;
-    object->names[index] = parson_strndup(name, name_len);
-    if (object->names[index] == NULL) {
+    object->entries[index].name = node_strndup(name, name_len);
+    if (object->entries[index].name == NULL) {
         return JSONFailure;
     }
-    value->parent = json_object_get_wrapping_value(object);
-    object->values[index] = value;
+    json_value_set_parent(value, json_object_get_wrapping_value(object));
+    object->entries[index].value = value;
     object->count++;
+    json_object_update_index(object, NULL);
     return JSONSuccess;
 }
 
 static JSON_Status json_object_resize(JSON_Object *object, size_t new_capacity)
 {
-    char **temp_names = NULL;
-    JSON_Value **temp_values = NULL;
-
-    if ((object->names == NULL && object->values != NULL) ||
-        (object->names != NULL && object->values == NULL) || new_capacity == 0) {
+    JSON_Object_Entry *new_entries = NULL;
+    if (new_capacity == 0) {
         return JSONFailure; /* Shouldn't happen */
     }
-    temp_names = (char **)parson_malloc(new_capacity * sizeof(char *));
-    if (temp_names == NULL) {
+    new_entries = (JSON_Object_Entry *)node_malloc(new_capacity * sizeof(JSON_Object_Entry));
+    if (new_entries == NULL) {
         return JSONFailure;
     }
-    temp_values = (JSON_Value **)parson_malloc(new_capacity * sizeof(JSON_Value *));
-    if (temp_values == NULL) {
-        parson_free(temp_names);
-        return JSONFailure;
-    }
-    if (object->names != NULL && object->values != NULL && object->count > 0) {
-        memcpy(temp_names, object->names, object->count * sizeof(char *));
-        memcpy(temp_values, object->values, object->count * sizeof(JSON_Value *));
+    if (object->entries != NULL && object->count > 0) {
+        memcpy(new_entries, object->entries, object->count * sizeof(JSON_Object_Entry));
     }
-    parson_free(object->names);
-    parson_free(object->values);
-    object->names = temp_names;
-    object->values = temp_values;
+    node_free(object->entries, object->capacity * sizeof(JSON_Object_Entry));
+    object->entries = new_entries;
     object->capacity = new_capacity;
     return JSONSuccess;
 }
@@ -405,42 +1054,161 @@ static JSON_Status json_object_resize(JSON_Object *object, size_t new_capacity)
 static JSON_Value *json_object_getn_value(const JSON_Object *object, const char *name,
                                           size_t name_len)
 {
-    size_t i, name_length;
-    for (i = 0; i < json_object_get_count(object); i++) {
-        name_length = strlen(object->names[i]);
-        if (name_length != name_len) {
-            continue;
+    size_t i;
+    if (object == NULL) {
+        return NULL;
+    }
+    i = json_object_find(object, name, name_len);
+    return i < object->count ? object->entries[i].value : NULL;
+}
+
+/* Returns index of name, or count if object doesn't have it */
+static size_t json_object_find(const JSON_Object *object, const char *name, size_t name_len)
+{
+    if (object->slots == NULL) {
+        return json_object_find_hashed(object, name, name_len, 0);
+    }
+    return json_object_find_hashed(object, name, name_len, hash_string(name, name_len));
+}
+
+/* Like json_object_find, with the hash of name already computed. The hash is only used by objects
+   with an index. */
+static size_t json_object_find_hashed(const JSON_Object *object, const char *name, size_t name_len,
+                                      unsigned long hash)
+{
+    size_t i, mask;
+    const JSON_Object_Slot *slot = NULL;
+    if (object->slots == NULL) {
+        for (i = 0; i < object->count; i++) {
+            if (strlen(object->entries[i].name) == name_len &&
+                strncmp(object->entries[i].name, name, name_len) == 0) {
+                return i;
+            }
         }
-        if (strncmp(object->names[i], name, name_len) == 0) {
-            return object->values[i];
+        return object->count;
+    }
+    mask = object->slot_count - 1;
+    for (i = hash & mask;; i = (i + 1) & mask) {
+        slot = &object->slots[i];
+        if (slot->index == 0) {
+            return object->count;
+        }
+        if (slot->hash == hash && slot->name_len == name_len &&
+            memcmp(object->entries[slot->index - 1].name, name, name_len) == 0) {
+            return slot->index - 1;
         }
     }
-    return NULL;
+}
+
+/* Returns the slot holding the name at index */
+static size_t json_object_find_slot(const JSON_Object *object, size_t index)
+{
+    size_t mask = object->slot_count - 1;
+    const char *name = object->entries[index].name;
+    size_t i = hash_string(name, strlen(name)) & mask;
+    while (object->slots[i].index != index + 1) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void json_object_index_insert(JSON_Object *object, size_t index)
+{
+    size_t mask = object->slot_count - 1;
+    size_t name_len = strlen(object->entries[index].name);
+    unsigned long hash = hash_string(object->entries[index].name, name_len);
+    size_t i = hash & mask;
+    while (object->slots[i].index != 0) {
+        i = (i + 1) & mask;
+    }
+    object->slots[i].hash = hash;
+    object->slots[i].name_len = name_len;
+    object->slots[i].index = index + 1;
+}
+
+/* Empties the slot of the name at index, shifting back later slots of the same probe run so that
+   lookups don't stop early at the hole */
+static void json_object_index_remove(JSON_Object *object, size_t index)
+{
+    size_t mask = object->slot_count - 1;
+    size_t hole = json_object_find_slot(object, index);
+    size_t i = hole, home = 0;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (object->slots[i].index == 0) {
+            break;
+        }
+        home = object->slots[i].hash & mask;
+        /* the slot can move to the hole if its home isn't cyclically in (hole, i] */
+        if (hole < i ? (home <= hole || home > i) : (home <= hole && home > i)) {
+            object->slots[hole] = object->slots[i];
+            hole = i;
+        }
+    }
+    object->slots[hole].index = 0;
+}
+
+/* Adds the last name to the index, building or growing the index as needed. The index only
+   speeds up lookups, so if memory runs out it is dropped and lookups scan the names instead. */
+static void json_object_update_index(JSON_Object *object, JSON_Arena *arena)
+{
+    size_t i = 0, new_slot_count = 0;
+    if (object->slots == NULL && object->count < OBJECT_INDEX_THRESHOLD) {
+        return;
+    }
+    if (object->slots != NULL && object->count * 2 <= object->slot_count) {
+        json_object_index_insert(object, object->count - 1);
+        return;
+    }
+    new_slot_count = object->slots == NULL ? OBJECT_INDEX_MIN_SLOTS : object->slot_count * 2;
+    if (arena == NULL) {
+        node_free(object->slots, object->slot_count * sizeof(JSON_Object_Slot));
+        object->slots =
+            (JSON_Object_Slot *)node_malloc(new_slot_count * sizeof(JSON_Object_Slot));
+    } else {
+        object->slots = (JSON_Object_Slot *)json_arena_malloc(
+            arena, new_slot_count * sizeof(JSON_Object_Slot));
+    }
+    if (object->slots == NULL) {
+        object->slot_count = 0;
+        return;
+    }
+    object->slot_count = new_slot_count;
+    for (i = 0; i < new_slot_count; i++) {
+        object->slots[i].index = 0;
+    }
+    for (i = 0; i < object->count; i++) {
+        json_object_index_insert(object, i);
+    }
 }
 
 static JSON_Status json_object_remove_internal(JSON_Object *object, const char *name,
                                                int free_value)
 {
     size_t i = 0, last_item_index = 0;
-    if (object == NULL || json_object_get_value(object, name) == NULL) {
+    if (object == NULL || name == NULL) {
         return JSONFailure;
     }
-    last_item_index = json_object_get_count(object) - 1;
-    for (i = 0; i < json_object_get_count(object); i++) {
-        if (strcmp(object->names[i], name) == 0) {
-            parson_free(object->names[i]);
-            if (free_value) {
-                json_value_free(object->values[i]);
-            }
-            if (i != last_item_index) { /* Replace key value pair with one from the end */
-                object->names[i] = object->names[last_item_index];
-                object->values[i] = object->values[last_item_index];
-            }
-            object->count -= 1;
-            return JSONSuccess;
+    i = json_object_find(object, name, strlen(name));
+    if (i >= object->count) {
+        return JSONFailure;
+    }
+    last_item_index = object->count - 1;
+    if (object->slots != NULL) {
+        json_object_index_remove(object, i);
+        if (i != last_item_index) { /* the last pair moves to i */
+            object->slots[json_object_find_slot(object, last_item_index)].index = i + 1;
         }
     }
-    return JSONFailure; /* No execution path should end here */
+    node_free_string(object->entries[i].name);
+    if (free_value) {
+        json_value_free(object->entries[i].value);
+    }
+    if (i != last_item_index) { /* Replace key value pair with one from the end */
+        object->entries[i] = object->entries[last_item_index];
+    }
+    object->count -= 1;
+    return JSONSuccess;
 }
 
 static JSON_Status json_object_dotremove_internal(JSON_Object *object, const char *name,
@@ -464,26 +1232,21 @@ static void json_object_free(JSON_Object *object)
 {
     size_t i;
     for (i = 0; i < object->count; i++) {
-        parson_free(object->names[i]);
-        json_value_free(object->values[i]);
+        node_free_string(object->entries[i].name);
+        json_value_free(object->entries[i].value);
     }
-    parson_free(object->names);
-    parson_free(object->values);
-    parson_free(object);
+    node_free(object->entries, object->capacity * sizeof(JSON_Object_Entry));
+    /* the object itself is freed with its value */
+    node_free(object->slots, object->slot_count * sizeof(JSON_Object_Slot));
 }
 
 /* JSON Array */
-static JSON_Array *json_array_init(JSON_Value *wrapping_value)
+static void json_array_init(JSON_Array *array, JSON_Value *wrapping_value)
 {
-    JSON_Array *new_array = (JSON_Array *)parson_malloc(sizeof(JSON_Array));
-    if (new_array == NULL) {
-        return NULL;
-    }
-    new_array->wrapping_value = wrapping_value;
-    new_array->items = (JSON_Value **)NULL;
-    new_array->capacity = 0;
-    new_array->count = 0;
-    return new_array;
+    array->wrapping_value = wrapping_value;
+    array->items = (JSON_Value **)NULL;
+    array->capacity = 0;
+    array->count = 0;
 }
 
 static JSON_Status json_array_add(JSON_Array *array, JSON_Value *value)
@@ -494,7 +1257,7 @@ static JSON_Status json_array_add(JSON_Array *array, JSON_Value *value)
             return JSONFailure;
         }
     }
-    value->parent = json_array_get_wrapping_value(array);
+    json_value_set_parent(value, json_array_get_wrapping_value(array));
     array->items[array->count] = value;
     array->count++;
     return JSONSuccess;
@@ -506,14 +1269,14 @@ static JSON_Status json_array_resize(JSON_Array *array, size_t new_capacity)
     if (new_capacity == 0) {
         return JSONFailure;
     }
-    new_items = (JSON_Value **)parson_malloc(new_capacity * sizeof(JSON_Value *));
+    new_items = (JSON_Value **)node_malloc(new_capacity * sizeof(JSON_Value *));
     if (new_items == NULL) {
         return JSONFailure;
     }
     if (array->items != NULL && array->count > 0) {
         memcpy(new_items, array->items, array->count * sizeof(JSON_Value *));
     }
-    parson_free(array->items);
+    node_free(array->items, array->capacity * sizeof(JSON_Value *));
     array->items = new_items;
     array->capacity = new_capacity;
     return JSONSuccess;
@@ -525,108 +1288,341 @@ static void json_array_free(JSON_Array *array)
     for (i = 0; i < array->count; i++) {
         json_value_free(array->items[i]);
     }
-    parson_free(array->items);
-    parson_free(array);
+    /* the array itself is freed with its value */
+    node_free(array->items, array->capacity * sizeof(JSON_Value *));
 }
 
 /* JSON Value */
-static JSON_Value *json_value_init_string_no_copy(char *string)
+/* Copies the first len bytes of string, which needn't be NUL-terminated, into a new value */
+static JSON_Value *json_value_init_stringn(const char *string, size_t len)
 {
-    JSON_Value *new_value = (JSON_Value *)parson_malloc(sizeof(JSON_Value));
+    JSON_Value *new_value = (JSON_Value *)node_malloc(sizeof(JSON_Value) + len + 1);
     if (!new_value) {
         return NULL;
     }
     new_value->parent = NULL;
+    new_value->precision = 0;
     new_value->type = JSONString;
-    new_value->value.string = string;
+    new_value->value.string = VALUE_TAIL(new_value);
+    memcpy(new_value->value.string, string, len);
+    new_value->value.string[len] = '\0';
     return new_value;
 }
 
-/* Parser */
-static JSON_Status skip_quotes(const char **string)
+static void json_value_set_parent(JSON_Value *value, JSON_Value *parent)
 {
-    if (**string != '\"') {
-        return JSONFailure;
-    }
-    SKIP_CHAR(string);
-    while (**string != '\"') {
-        if (**string == '\0') {
-            return JSONFailure;
-        } else if (**string == '\\') {
-            SKIP_CHAR(string);
-            if (**string == '\0') {
-                return JSONFailure;
-            }
-        }
-        SKIP_CHAR(string);
+    if (!IS_SHARED_VALUE(value)) { /* a shared value is in many places at once */
+        value->parent = parent;
     }
-    SKIP_CHAR(string);
-    return JSONSuccess;
 }
 
-static int parse_utf16(const char **unprocessed, char **processed)
+/* Arena */
+static JSON_Arena_Block *json_arena_add_block(JSON_Arena *arena, size_t size)
 {
-    unsigned int cp, lead, trail;
-    int parse_succeeded = 0;
-    char *processed_ptr = *processed;
-    const char *unprocessed_ptr = *unprocessed;
-    unprocessed_ptr++; /* skips u */
-    parse_succeeded = parse_utf16_hex(unprocessed_ptr, &cp);
-    if (!parse_succeeded) {
-        return JSONFailure;
+    JSON_Arena_Block *block = (JSON_Arena_Block *)parson_malloc(ARENA_BLOCK_HEADER_SIZE + size);
+    if (block == NULL) {
+        return NULL;
     }
-    if (cp < 0x80) {
-        processed_ptr[0] = (char)cp; /* 0xxxxxxx */
-    } else if (cp < 0x800) {
-        processed_ptr[0] = (char)(((cp >> 6) & 0x1F) | 0xC0); /* 110xxxxx */
-        processed_ptr[1] = (char)(((cp)&0x3F) | 0x80);        /* 10xxxxxx */
-        processed_ptr += 1;
-    } else if (cp < 0xD800 || cp > 0xDFFF) {
-        processed_ptr[0] = (char)(((cp >> 12) & 0x0F) | 0xE0); /* 1110xxxx */
-        processed_ptr[1] = (char)(((cp >> 6) & 0x3F) | 0x80);  /* 10xxxxxx */
-        processed_ptr[2] = (char)(((cp)&0x3F) | 0x80);         /* 10xxxxxx */
-        processed_ptr += 2;
-    } else if (cp >= 0xD800 && cp <= 0xDBFF) { /* lead surrogate (0xD800..0xDBFF) */
-        lead = cp;
-        unprocessed_ptr +=
-            4; /* should always be within the buffer, otherwise previous sscanf would fail */
-        if (*unprocessed_ptr++ != '\\' || *unprocessed_ptr++ != 'u') {
-            return JSONFailure;
-        }
-        parse_succeeded = parse_utf16_hex(unprocessed_ptr, &trail);
-        if (!parse_succeeded || trail < 0xDC00 ||
-            trail > 0xDFFF) { /* valid trail surrogate? (0xDC00..0xDFFF) */
-            return JSONFailure;
+    block->next = arena->blocks;
+    block->size = size;
+    block->used = 0;
+    arena->blocks = block;
+    return block;
+}
+
+static void *json_arena_malloc(JSON_Arena *arena, size_t n)
+{
+    JSON_Arena_Block *block = arena->blocks;
+    char *allocation = NULL;
+    n = ARENA_ALIGN(n);
+    if (n > block->size - block->used) {
+        /* Chain a new block, doubling the size so long documents need few blocks */
+        block = json_arena_add_block(arena, MAX(block->size * 2, n));
+        if (block == NULL) {
+            return NULL;
         }
-        cp = ((((lead - 0xD800) & 0x3FF) << 10) | ((trail - 0xDC00) & 0x3FF)) + 0x010000;
-        processed_ptr[0] = (char)((((cp >> 18) & 0x07) | 0xF0)); /* 11110xxx */
-        processed_ptr[1] = (char)((((cp >> 12) & 0x3F) | 0x80)); /* 10xxxxxx */
-        processed_ptr[2] = (char)((((cp >> 6) & 0x3F) | 0x80));  /* 10xxxxxx */
-        processed_ptr[3] = (char)((((cp)&0x3F) | 0x80));         /* 10xxxxxx */
-        processed_ptr += 3;
-    } else { /* trail surrogate before lead surrogate */
-        return JSONFailure;
     }
-    unprocessed_ptr += 3;
-    *processed = processed_ptr;
-    *unprocessed = unprocessed_ptr;
-    return JSONSuccess;
+    allocation = ARENA_BLOCK_DATA(block) + block->used;
+    block->used += n;
+    arena->last_allocation = allocation;
+    return allocation;
 }
 
-/* Copies and processes passed string up to supplied length.
-Example: "\u006Corem ipsum" -> lorem ipsum */
-static char *process_string(const char *input, size_t len)
+static void *json_arena_resize(JSON_Arena *arena, void *ptr, size_t old_size, size_t new_size)
 {
-    const char *input_ptr = input;
-    size_t initial_size = (len + 1) * sizeof(char);
-    size_t final_size = 0;
-    char *output = NULL, *output_ptr = NULL, *resized_output = NULL;
-    output = (char *)parson_malloc(initial_size);
-    if (output == NULL) {
-        goto error;
+    JSON_Arena_Block *block = arena->blocks;
+    size_t offset = 0;
+    char *new_ptr = NULL;
+    if (ptr != NULL && ptr == arena->last_allocation) { /* grow or shrink in place */
+        offset = (size_t)((char *)ptr - ARENA_BLOCK_DATA(block));
+        if (ARENA_ALIGN(new_size) <= block->size - offset) {
+            block->used = offset + ARENA_ALIGN(new_size);
+            return ptr;
+        }
+    }
+    new_ptr = (char *)json_arena_malloc(arena, new_size);
+    if (new_ptr != NULL && ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return new_ptr;
+}
+
+/* Parser allocation */
+static void *parser_malloc(const JSON_Parser *parser, size_t n)
+{
+    if (parser->arena != NULL) {
+        return json_arena_malloc(parser->arena, n);
+    }
+    return node_malloc(n);
+}
+
+/* n is the size ptr was allocated with, or less */
+static void parser_free(const JSON_Parser *parser, void *ptr, size_t n)
+{
+    if (parser->arena == NULL) { /* arena memory is released by the caller of the parse */
+        node_free(ptr, n);
+    }
+}
+
+static void parser_free_string(const JSON_Parser *parser, char *string)
+{
+    if (parser->arena == NULL) {
+        node_free_string(string);
+    }
+}
+
+static void parser_free_value(const JSON_Parser *parser, JSON_Value *value)
+{
+    if (parser->arena == NULL) {
+        json_value_free(value);
+    }
+}
+
+/* Makes an object, an array, or a number to be set by the caller. Strings are made by
+   parser_init_string, and null and booleans are shared. */
+static JSON_Value *parser_init_value(const JSON_Parser *parser, JSON_Value_Type type)
+{
+    size_t tail_size = type == JSONObject  ? sizeof(JSON_Object)
+                       : type == JSONArray ? sizeof(JSON_Array)
+                                           : 0;
+    JSON_Value *new_value = (JSON_Value *)parser_malloc(parser, sizeof(JSON_Value) + tail_size);
+    if (new_value == NULL) {
+        return NULL;
+    }
+    new_value->parent = NULL;
+    new_value->precision = 0;
+    new_value->type = type;
+    if (type == JSONObject) {
+        new_value->value.object = (JSON_Object *)VALUE_TAIL(new_value);
+        json_object_init(new_value->value.object, new_value);
+    } else if (type == JSONArray) {
+        new_value->value.array = (JSON_Array *)VALUE_TAIL(new_value);
+        json_array_init(new_value->value.array, new_value);
+    }
+    return new_value;
+}
+
+/* Makes a string value of the len bytes between quotes at input, decoded into the value's tail,
+   or in place when parsing in situ */
+static JSON_Value *parser_init_string(const JSON_Parser *parser, const char *input, size_t len)
+{
+    size_t size = sizeof(JSON_Value) + (parser->is_in_situ ? 0 : len + 1), final_size = 0;
+    JSON_Value *value = (JSON_Value *)parser_malloc(parser, size), *resized_value = NULL;
+    char *output = NULL, *output_end = NULL;
+    if (value == NULL) {
+        return NULL;
+    }
+    value->parent = NULL;
+    value->precision = 0;
+    value->type = JSONString;
+    output = parser->is_in_situ ? (char *)input : VALUE_TAIL(value);
+    output_end = decode_string(input, input + len, output);
+    if (output_end == NULL) {
+        parser_free(parser, value, size);
+        return NULL;
+    }
+    *output_end = '\0';
+    value->value.string = output;
+    final_size = sizeof(JSON_Value) + (size_t)(output_end - output) + 1;
+    if (parser->is_in_situ || final_size == size) {
+        return value;
+    }
+    /* escapes made the string shorter */
+    if (parser->arena != NULL) { /* value is the newest allocation, so this shrinks in place */
+        json_arena_resize(parser->arena, value, size, final_size);
+        return value;
+    }
+    resized_value = (JSON_Value *)node_malloc(final_size);
+    if (resized_value == NULL) {
+        return value; /* keep the longer allocation */
+    }
+    memcpy(resized_value, value, final_size);
+    resized_value->value.string = VALUE_TAIL(resized_value);
+    node_free(value, size);
+    return resized_value;
+}
+
+/* Takes ownership of name on success */
+static JSON_Status parser_object_add(const JSON_Parser *parser, JSON_Object *object, char *name,
+                                     JSON_Value *value)
+{
+    size_t new_capacity = 0;
+    JSON_Object_Entry *new_entries = NULL;
+    if (json_object_getn_value(object, name, strlen(name)) != NULL) {
+        return JSONFailure;
+    }
+    if (object->count >= object->capacity) {
+        if (parser->arena == NULL) {
+            new_capacity = MAX(object->capacity * 2, STARTING_CAPACITY);
+            if (json_object_resize(object, new_capacity) == JSONFailure) {
+                return JSONFailure;
+            }
+        } else {
+            new_capacity = MAX(object->capacity * 2, ARENA_STARTING_CAPACITY);
+            new_entries = (JSON_Object_Entry *)json_arena_resize(
+                parser->arena, object->entries, object->count * sizeof(JSON_Object_Entry),
+                new_capacity * sizeof(JSON_Object_Entry));
+            if (new_entries == NULL) {
+                return JSONFailure;
+            }
+            object->entries = new_entries;
+            object->capacity = new_capacity;
+        }
+    }
+    json_value_set_parent(value, json_object_get_wrapping_value(object));
+    object->entries[object->count].name = name;
+    object->entries[object->count].value = value;
+    object->count++;
+    json_object_update_index(object, parser->arena);
+    return JSONSuccess;
+}
+
+static JSON_Status parser_array_add(const JSON_Parser *parser, JSON_Array *array,
+                                    JSON_Value *value)
+{
+    size_t new_capacity = 0;
+    JSON_Value **new_items = NULL;
+    if (parser->arena == NULL) {
+        return json_array_add(array, value);
+    }
+    if (array->count >= array->capacity) {
+        new_capacity = MAX(array->capacity * 2, ARENA_STARTING_CAPACITY);
+        new_items = (JSON_Value **)json_arena_resize(parser->arena, array->items,
+                                                     array->count * sizeof(JSON_Value *),
+                                                     new_capacity * sizeof(JSON_Value *));
+        if (new_items == NULL) {
+            return JSONFailure;
+        }
+        array->items = new_items;
+        array->capacity = new_capacity;
+    }
+    json_value_set_parent(value, json_array_get_wrapping_value(array));
+    array->items[array->count] = value;
+    array->count++;
+    return JSONSuccess;
+}
+
+/* Parser */
+static JSON_Status skip_quotes(const JSON_Parser *parser, const char **string)
+{
+    if (CURRENT_CHAR(parser, string) != '\"') {
+        return JSONFailure;
+    }
+    SKIP_CHAR(string);
+    for (;;) {
+        *string = scan_string(*string, parser->end);
+        switch (CURRENT_CHAR(parser, string)) {
+        case '\"':
+            SKIP_CHAR(string);
+            return JSONSuccess;
+        case '\0':
+            return JSONFailure;
+        case '\\':
+            SKIP_CHAR(string);
+            if (CURRENT_CHAR(parser, string) == '\0') {
+                return JSONFailure;
+            }
+            SKIP_CHAR(string);
+            break;
+        default: /* control characters are rejected by process_string */
+            SKIP_CHAR(string);
+            break;
+        }
+    }
+}
+
+static int parse_utf16(const char **unprocessed, const char *unprocessed_end, char **processed)
+{
+    unsigned int cp, lead, trail;
+    int parse_succeeded = 0;
+    char *processed_ptr = *processed;
+    const char *unprocessed_ptr = *unprocessed;
+    unprocessed_ptr++; /* skips u */
+    if (unprocessed_end - unprocessed_ptr < 4) {
+        return JSONFailure;
+    }
+    parse_succeeded = parse_utf16_hex(unprocessed_ptr, &cp);
+    if (!parse_succeeded) {
+        return JSONFailure;
+    }
+    if (cp < 0x80) {
+        processed_ptr[0] = (char)cp; /* 0xxxxxxx */
+    } else if (cp < 0x800) {
+        processed_ptr[0] = (char)(((cp >> 6) & 0x1F) | 0xC0); /* 110xxxxx */
+        processed_ptr[1] = (char)(((cp)&0x3F) | 0x80);        /* 10xxxxxx */
+        processed_ptr += 1;
+    } else if (cp < 0xD800 || cp > 0xDFFF) {
+        processed_ptr[0] = (char)(((cp >> 12) & 0x0F) | 0xE0); /* 1110xxxx */
+        processed_ptr[1] = (char)(((cp >> 6) & 0x3F) | 0x80);  /* 10xxxxxx */
+        processed_ptr[2] = (char)(((cp)&0x3F) | 0x80);         /* 10xxxxxx */
+        processed_ptr += 2;
+    } else if (cp >= 0xD800 && cp <= 0xDBFF) { /* lead surrogate (0xD800..0xDBFF) */
+        lead = cp;
+        unprocessed_ptr += 4;
+        if (unprocessed_end - unprocessed_ptr < 6) { /* \\u and four hex digits */
+            return JSONFailure;
+        }
+        if (*unprocessed_ptr++ != '\\' || *unprocessed_ptr++ != 'u') {
+            return JSONFailure;
+        }
+        parse_succeeded = parse_utf16_hex(unprocessed_ptr, &trail);
+        if (!parse_succeeded || trail < 0xDC00 ||
+            trail > 0xDFFF) { /* valid trail surrogate? (0xDC00..0xDFFF) */
+            return JSONFailure;
+        }
+        cp = ((((lead - 0xD800) & 0x3FF) << 10) | ((trail - 0xDC00) & 0x3FF)) + 0x010000;
+        processed_ptr[0] = (char)((((cp >> 18) & 0x07) | 0xF0)); /* 11110xxx */
+        processed_ptr[1] = (char)((((cp >> 12) & 0x3F) | 0x80)); /* 10xxxxxx */
+        processed_ptr[2] = (char)((((cp >> 6) & 0x3F) | 0x80));  /* 10xxxxxx */
+        processed_ptr[3] = (char)((((cp)&0x3F) | 0x80));         /* 10xxxxxx */
+        processed_ptr += 3;
+    } else { /* trail surrogate before lead surrogate */
+        return JSONFailure;
     }
-    output_ptr = output;
-    while ((*input_ptr != '\0') && (size_t)(input_ptr - input) < len) {
+    unprocessed_ptr += 3;
+    *processed = processed_ptr;
+    *unprocessed = unprocessed_ptr;
+    return JSONSuccess;
+}
+
+/* Decodes the escapes in a string between quotes into output, which may be input itself.
+Example: "\u006Corem ipsum" -> lorem ipsum
+The output is never longer than the input. Returns the end of the output, which isn't
+NUL-terminated, or NULL if the string is invalid. */
+static char *decode_string(const char *input, const char *input_end, char *output)
+{
+    const char *input_ptr = input, *run_end = NULL;
+    char *output_ptr = output;
+    while (input_ptr < input_end) {
+        run_end = scan_string(input_ptr, input_end); /* copy plain characters in bulk */
+        if (output_ptr != input_ptr) {
+            memmove(output_ptr, input_ptr, (size_t)(run_end - input_ptr));
+        }
+        output_ptr += run_end - input_ptr;
+        input_ptr = run_end;
+        if (input_ptr == input_end) {
+            break;
+        }
         if (*input_ptr == '\\') {
             input_ptr++;
             switch (*input_ptr) {
@@ -655,68 +1651,97 @@ static char *process_string(const char *input, size_t len)
                 *output_ptr = '\t';
                 break;
             case 'u':
-                if (parse_utf16(&input_ptr, &output_ptr) == JSONFailure) {
-                    goto error;
+                if (parse_utf16(&input_ptr, input_end, &output_ptr) == JSONFailure) {
+                    return NULL;
                 }
                 break;
             default:
-                goto error;
+                return NULL;
             }
         } else if ((unsigned char)*input_ptr < 0x20) {
-            goto error; /* 0x00-0x19 are invalid characters for json string
-                           (http://www.ietf.org/rfc/rfc4627.txt) */
+            return NULL; /* 0x00-0x19 are invalid characters for json string
+                            (http://www.ietf.org/rfc/rfc4627.txt) */
         } else {
             *output_ptr = *input_ptr;
         }
         output_ptr++;
         input_ptr++;
     }
+    return output_ptr;
+}
+
+/* Copies and processes passed string up to supplied length.
+When parsing in situ, the string is processed in place instead, and the terminating NUL replaces
+at most the closing quote. */
+static char *process_string(const JSON_Parser *parser, const char *input, size_t len)
+{
+    size_t initial_size = (len + 1) * sizeof(char);
+    size_t final_size = 0;
+    char *output = NULL, *output_ptr = NULL, *resized_output = NULL;
+    if (parser->is_in_situ) {
+        output = (char *)input;
+    } else {
+        output = (char *)parser_malloc(parser, initial_size);
+    }
+    if (output == NULL) {
+        goto error;
+    }
+    output_ptr = decode_string(input, input + len, output);
+    if (output_ptr == NULL) {
+        goto error;
+    }
     *output_ptr = '\0';
     /* resize to new length */
     final_size = (size_t)(output_ptr - output) + 1;
+    if (parser->is_in_situ) {
+        return output;
+    }
+    if (parser->arena != NULL) { /* output is the newest allocation, so this shrinks in place */
+        return (char *)json_arena_resize(parser->arena, output, initial_size, final_size);
+    }
     /* todo: don't resize if final_size == initial_size */
-    resized_output = (char *)parson_malloc(final_size);
+    resized_output = (char *)node_malloc(final_size);
     if (resized_output == NULL) {
         goto error;
     }
     memcpy(resized_output, output, final_size);
-    parson_free(output);
+    node_free(output, initial_size);
     return resized_output;
 error:
-    parson_free(output);
+    parser_free(parser, output, initial_size);
     return NULL;
 }
 
 /* Return processed contents of a string between quotes and
    skips passed argument to a matching quote. */
-static char *get_quoted_string(const char **string)
+static char *get_quoted_string(const JSON_Parser *parser, const char **string)
 {
     const char *string_start = *string;
     size_t string_len = 0;
-    JSON_Status status = skip_quotes(string);
+    JSON_Status status = skip_quotes(parser, string);
     if (status != JSONSuccess) {
         return NULL;
     }
     string_len = (size_t)(*string - string_start - 2); /* length without quotes */
-    return process_string(string_start + 1, string_len);
+    return process_string(parser, string_start + 1, string_len);
 }
 
-static JSON_Value *parse_value(const char **string, size_t nesting)
+static JSON_Value *parse_value(const JSON_Parser *parser, const char **string, size_t nesting)
 {
     if (nesting > MAX_NESTING) {
         return NULL;
     }
-    SKIP_WHITESPACES(string);
-    switch (**string) {
+    SKIP_WHITESPACES(parser, string);
+    switch (CURRENT_CHAR(parser, string)) {
     case '{':
-        return parse_object_value(string, nesting + 1);
+        return parse_object_value(parser, string, nesting + 1);
     case '[':
-        return parse_array_value(string, nesting + 1);
+        return parse_array_value(parser, string, nesting + 1);
     case '\"':
-        return parse_string_value(string);
+        return parse_string_value(parser, string);
     case 'f':
     case 't':
-        return parse_boolean_value(string);
+        return parse_boolean_value(parser, string);
     case '-':
     case '0':
     case '1':
@@ -728,233 +1753,1622 @@ static JSON_Value *parse_value(const char **string, size_t nesting)
     case '7':
     case '8':
     case '9':
-        return parse_number_value(string);
+        return parse_number_value(parser, string);
     case 'n':
-        return parse_null_value(string);
+        return parse_null_value(parser, string);
     default:
         return NULL;
     }
 }
 
-static JSON_Value *parse_object_value(const char **string, size_t nesting)
+static JSON_Value *parse_object_value(const JSON_Parser *parser, const char **string,
+                                      size_t nesting)
 {
     JSON_Value *output_value = NULL, *new_value = NULL;
     JSON_Object *output_object = NULL;
     char *new_key = NULL;
-    output_value = json_value_init_object();
+    output_value = parser_init_value(parser, JSONObject);
     if (output_value == NULL) {
         return NULL;
     }
-    if (**string != '{') {
-        json_value_free(output_value);
+    if (CURRENT_CHAR(parser, string) != '{') {
+        parser_free_value(parser, output_value);
         return NULL;
     }
     output_object = json_value_get_object(output_value);
     SKIP_CHAR(string);
-    SKIP_WHITESPACES(string);
-    if (**string == '}') { /* empty object */
+    SKIP_WHITESPACES(parser, string);
+    if (CURRENT_CHAR(parser, string) == '}') { /* empty object */
         SKIP_CHAR(string);
         return output_value;
     }
-    while (**string != '\0') {
-        new_key = get_quoted_string(string);
+    while (CURRENT_CHAR(parser, string) != '\0') {
+        new_key = get_quoted_string(parser, string);
         if (new_key == NULL) {
-            json_value_free(output_value);
+            parser_free_value(parser, output_value);
             return NULL;
         }
-        SKIP_WHITESPACES(string);
-        if (**string != ':') {
-            parson_free(new_key);
-            json_value_free(output_value);
+        SKIP_WHITESPACES(parser, string);
+        if (CURRENT_CHAR(parser, string) != ':') {
+            parser_free_string(parser, new_key);
+            parser_free_value(parser, output_value);
             return NULL;
         }
         SKIP_CHAR(string);
-        new_value = parse_value(string, nesting);
+        new_value = parse_value(parser, string, nesting);
         if (new_value == NULL) {
-            parson_free(new_key);
-            json_value_free(output_value);
+            parser_free_string(parser, new_key);
+            parser_free_value(parser, output_value);
             return NULL;
         }
-        if (json_object_add(output_object, new_key, new_value) == JSONFailure) {
-            parson_free(new_key);
-            json_value_free(new_value);
-            json_value_free(output_value);
+        if (parser_object_add(parser, output_object, new_key, new_value) == JSONFailure) {
+            parser_free_string(parser, new_key);
+            parser_free_value(parser, new_value);
+            parser_free_value(parser, output_value);
             return NULL;
         }
-        parson_free(new_key);
-        SKIP_WHITESPACES(string);
-        if (**string != ',') {
+        SKIP_WHITESPACES(parser, string);
+        if (CURRENT_CHAR(parser, string) != ',') {
             break;
         }
         SKIP_CHAR(string);
-        SKIP_WHITESPACES(string);
+        SKIP_WHITESPACES(parser, string);
+    }
+    SKIP_WHITESPACES(parser, string);
+    if (CURRENT_CHAR(parser, string) != '}') {
+        parser_free_value(parser, output_value);
+        return NULL;
     }
-    SKIP_WHITESPACES(string);
-    if (**string != '}' || /* Trim object after parsing is over */
+    if (parser->arena == NULL && /* Trim object after parsing is over */
         json_object_resize(output_object, json_object_get_count(output_object)) == JSONFailure) {
-        json_value_free(output_value);
+        parser_free_value(parser, output_value);
         return NULL;
     }
     SKIP_CHAR(string);
     return output_value;
 }
 
-static JSON_Value *parse_array_value(const char **string, size_t nesting)
+static JSON_Value *parse_array_value(const JSON_Parser *parser, const char **string,
+                                     size_t nesting)
 {
     JSON_Value *output_value = NULL, *new_array_value = NULL;
     JSON_Array *output_array = NULL;
-    output_value = json_value_init_array();
+    output_value = parser_init_value(parser, JSONArray);
     if (output_value == NULL) {
         return NULL;
     }
-    if (**string != '[') {
-        json_value_free(output_value);
+    if (CURRENT_CHAR(parser, string) != '[') {
+        parser_free_value(parser, output_value);
         return NULL;
     }
     output_array = json_value_get_array(output_value);
     SKIP_CHAR(string);
-    SKIP_WHITESPACES(string);
-    if (**string == ']') { /* empty array */
+    SKIP_WHITESPACES(parser, string);
+    if (CURRENT_CHAR(parser, string) == ']') { /* empty array */
         SKIP_CHAR(string);
         return output_value;
     }
-    while (**string != '\0') {
-        new_array_value = parse_value(string, nesting);
+    while (CURRENT_CHAR(parser, string) != '\0') {
+        new_array_value = parse_value(parser, string, nesting);
         if (new_array_value == NULL) {
-            json_value_free(output_value);
+            parser_free_value(parser, output_value);
             return NULL;
         }
-        if (json_array_add(output_array, new_array_value) == JSONFailure) {
-            json_value_free(new_array_value);
-            json_value_free(output_value);
+        if (parser_array_add(parser, output_array, new_array_value) == JSONFailure) {
+            parser_free_value(parser, new_array_value);
+            parser_free_value(parser, output_value);
             return NULL;
         }
-        SKIP_WHITESPACES(string);
-        if (**string != ',') {
+        SKIP_WHITESPACES(parser, string);
+        if (CURRENT_CHAR(parser, string) != ',') {
             break;
         }
         SKIP_CHAR(string);
-        SKIP_WHITESPACES(string);
+        SKIP_WHITESPACES(parser, string);
     }
-    SKIP_WHITESPACES(string);
-    if (**string != ']' || /* Trim array after parsing is over */
+    SKIP_WHITESPACES(parser, string);
+    if (CURRENT_CHAR(parser, string) != ']') {
+        parser_free_value(parser, output_value);
+        return NULL;
+    }
+    if (parser->arena == NULL && /* Trim array after parsing is over */
         json_array_resize(output_array, json_array_get_count(output_array)) == JSONFailure) {
-        json_value_free(output_value);
+        parser_free_value(parser, output_value);
         return NULL;
     }
     SKIP_CHAR(string);
     return output_value;
 }
 
-static JSON_Value *parse_string_value(const char **string)
+static JSON_Value *parse_string_value(const JSON_Parser *parser, const char **string)
+{
+    const char *string_start = *string;
+    if (skip_quotes(parser, string) != JSONSuccess) {
+        return NULL;
+    }
+    return parser_init_string(parser, string_start + 1, (size_t)(*string - string_start - 2));
+}
+
+/* Skips literal if the input continues with it */
+static int skip_literal(const JSON_Parser *parser, const char **string, const char *literal,
+                        size_t literal_len)
+{
+    if ((size_t)(parser->end - *string) >= literal_len &&
+        strncmp(literal, *string, literal_len) == 0) {
+        *string += literal_len;
+        return 1;
+    }
+    return 0;
+}
+
+static JSON_Value *parse_boolean_value(const JSON_Parser *parser, const char **string)
+{
+    if (skip_literal(parser, string, "true", SIZEOF_TOKEN("true"))) {
+        return json_value_init_boolean(1);
+    }
+    if (skip_literal(parser, string, "false", SIZEOF_TOKEN("false"))) {
+        return json_value_init_boolean(0);
+    }
+    return NULL;
+}
+
+static JSON_Value *parse_number_value(const JSON_Parser *parser, const char **string)
 {
     JSON_Value *value = NULL;
-    char *new_string = get_quoted_string(string);
-    if (new_string == NULL) {
+    double number = 0;
+    const char *number_end = parse_number(*string, parser->end, &number);
+    if (number_end == NULL) {
         return NULL;
     }
-    value = json_value_init_string_no_copy(new_string);
+    *string = number_end;
+    value = parser_init_value(parser, JSONNumber);
     if (value == NULL) {
-        parson_free(new_string);
         return NULL;
     }
+    value->value.number = number;
     return value;
 }
 
-static JSON_Value *parse_boolean_value(const char **string)
+/* Reads a number with the JSON grammar in one pass. Returns the end of the number, or NULL if it
+   is malformed or out of range. Mantissas of up to MAX_EXACT_DIGITS significant digits scaled by
+   an exact power of ten are rounded once, which is correct (Clinger's fast path); anything else
+   goes to strtod. */
+static const char *parse_number(const char *string, const char *end, double *result)
 {
-    size_t true_token_size = SIZEOF_TOKEN("true");
-    size_t false_token_size = SIZEOF_TOKEN("false");
-    if (strncmp("true", *string, true_token_size) == 0) {
-        *string += true_token_size;
-        return json_value_init_boolean(1);
-    } else if (strncmp("false", *string, false_token_size) == 0) {
-        *string += false_token_size;
-        return json_value_init_boolean(0);
+    const char *p = string;
+    double mantissa = 0;
+    int digit_count = 0; /* significant digits, not counting leading zeros */
+    long exponent = 0, explicit_exponent = 0;
+    int is_negative = 0, is_exponent_negative = 0;
+    if (p < end && *p == '-') {
+        is_negative = 1;
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return NULL;
     }
-    return NULL;
+    if (*p == '0') { /* no leading zeros */
+        p++;
+    } else {
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digit_count < MAX_EXACT_DIGITS) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digit_count++;
+            } else {
+                digit_count++;
+                exponent++;
+            }
+            p++;
+        }
+    }
+    if (p < end && *p == '.') {
+        p++;
+        if (p == end || *p < '0' || *p > '9') {
+            return NULL;
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digit_count < MAX_EXACT_DIGITS) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digit_count += mantissa != 0;
+                exponent--;
+            } else {
+                digit_count++;
+            }
+            p++;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) {
+            is_exponent_negative = *p == '-';
+            p++;
+        }
+        if (p == end || *p < '0' || *p > '9') {
+            return NULL;
+        }
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (explicit_exponent < MAX_EXPONENT_DIGITS_VALUE) {
+                explicit_exponent = explicit_exponent * 10 + (*p - '0');
+            }
+            p++;
+        }
+    }
+    if (p < end && is_number_char(*p)) { /* "01", "1-2", "1.5.3" */
+        return NULL;
+    }
+    exponent += is_exponent_negative ? -explicit_exponent : explicit_exponent;
+    if (digit_count > MAX_EXACT_DIGITS) {
+        return parse_number_slow(string, (size_t)(p - string), result) ? p : NULL;
+    }
+    if (mantissa == 0 || exponent == 0) {
+        /* exact as it is */
+#ifndef PARSON_NO_FAST_NUMBERS
+    } else if (exponent > 0 && exponent <= MAX_EXACT_POW10) {
+        mantissa *= exact_pow10[exponent];
+    } else if (exponent < 0 && exponent >= -MAX_EXACT_POW10) {
+        mantissa /= exact_pow10[-exponent];
+    } else if (exponent > MAX_EXACT_POW10 &&
+               exponent - MAX_EXACT_POW10 <= MAX_EXACT_DIGITS - digit_count) {
+        /* e.g. 12e25: 12e3 is still exact, so only the final multiplication rounds */
+        mantissa *= exact_pow10[exponent - MAX_EXACT_POW10];
+        mantissa *= exact_pow10[MAX_EXACT_POW10];
+#endif
+    } else {
+        return parse_number_slow(string, (size_t)(p - string), result) ? p : NULL;
+    }
+    *result = is_negative ? -mantissa : mantissa;
+    return p;
 }
 
-static JSON_Value *parse_number_value(const char **string)
+/* Converts a number that has already passed the grammar check with strtod */
+static int parse_number_slow(const char *string, size_t length, double *result)
 {
-    char *end;
+    char num_buf[NUM_BUF_SIZE]; /* strtod needs a NUL-terminated copy of the number */
+    char *number_string = num_buf, *end = NULL, *decimal_point = NULL;
+    const char *locale_decimal_point = localeconv()->decimal_point;
     double number = 0;
+    int is_valid = 0;
+    if (length >= NUM_BUF_SIZE) {
+        number_string = (char *)parson_malloc(length + 1);
+        if (number_string == NULL) {
+            return 0;
+        }
+    }
+    memcpy(number_string, string, length);
+    number_string[length] = '\0';
+    decimal_point = strchr(number_string, '.');
+    if (decimal_point != NULL && locale_decimal_point[0] != '\0' &&
+        locale_decimal_point[1] == '\0') { /* strtod expects the locale's decimal point */
+        *decimal_point = locale_decimal_point[0];
+    }
     errno = 0;
-    number = strtod(*string, &end);
-    if (errno || !is_decimal(*string, (size_t)(end - *string))) {
-        return NULL;
+    number = strtod(number_string, &end);
+    is_valid = !errno && end == number_string + length && (number * 0.0) == 0.0; /* not inf */
+    if (number_string != num_buf) {
+        parson_free(number_string);
     }
-    *string = end;
-    return json_value_init_number(number);
+    if (is_valid) {
+        *result = number;
+    }
+    return is_valid;
 }
 
-static JSON_Value *parse_null_value(const char **string)
+static JSON_Value *parse_null_value(const JSON_Parser *parser, const char **string)
 {
-    size_t token_size = SIZEOF_TOKEN("null");
-    if (strncmp("null", *string, token_size) == 0) {
-        *string += token_size;
+    if (skip_literal(parser, string, "null", SIZEOF_TOKEN("null"))) {
         return json_value_init_null();
     }
     return NULL;
 }
 
-/* Serialization */
-#define APPEND_STRING(str)                   \
-    do {                                     \
-        written = append_string(buf, (str)); \
-        if (written < 0) {                   \
-            return -1;                       \
-        }                                    \
-        if (buf != NULL) {                   \
-            buf += written;                  \
-        }                                    \
-        written_total += written;            \
-    } while (0)
-
-#define APPEND_INDENT(level)                   \
-    do {                                       \
-        written = append_indent(buf, (level)); \
-        if (written < 0) {                     \
-            return -1;                         \
-        }                                      \
-        if (buf != NULL) {                     \
-            buf += written;                    \
-        }                                      \
-        written_total += written;              \
-    } while (0)
-
-static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int level, int is_pretty,
-                                      char *num_buf)
+/* Projection parser
+   Builds only the values that paths lead to, and the objects on the way to them. */
+static JSON_Value *parse_projected_object(const JSON_Parser *parser, const char **string,
+                                          size_t level)
 {
-    const char *key = NULL, *string = NULL;
-    JSON_Value *temp_value = NULL;
-    JSON_Array *array = NULL;
-    JSON_Object *object = NULL;
-    size_t i = 0, count = 0;
-    double num = 0.0;
-    int written = -1, written_total = 0;
-
-    switch (json_value_get_type(value)) {
-    case JSONArray:
-        array = json_value_get_array(value);
-        count = json_array_get_count(array);
-        APPEND_STRING("[");
-        if (count > 0 && is_pretty) {
-            APPEND_STRING("\n");
+    JSON_Value *output_value = NULL, *new_value = NULL;
+    JSON_Object *output_object = NULL;
+    const char *name_start = NULL;
+    char *new_key = NULL;
+    size_t name_len = 0;
+    int projection = PROJECTION_SKIP;
+    output_value = parser_init_value(parser, JSONObject);
+    if (output_value == NULL) {
+        return NULL;
+    }
+    output_object = json_value_get_object(output_value);
+    SKIP_CHAR(string); /* '{', checked by the caller */
+    SKIP_WHITESPACES(parser, string);
+    if (CURRENT_CHAR(parser, string) == '}') { /* empty object */
+        SKIP_CHAR(string);
+        return output_value;
+    }
+    while (CURRENT_CHAR(parser, string) != '\0') {
+        name_start = *string + 1;
+        if (skip_quotes(parser, string) != JSONSuccess) {
+            goto error;
         }
-        for (i = 0; i < count; i++) {
-            if (is_pretty) {
-                APPEND_INDENT(level + 1);
+        name_len = (size_t)(*string - name_start - 1);
+        if (scan_string(name_start, name_start + name_len) != name_start + name_len) {
+            new_key = process_string(parser, name_start, name_len); /* match the decoded name */
+            if (new_key == NULL) {
+                goto error;
             }
-            temp_value = json_array_get_value(array, i);
-            written = json_serialize_to_buffer_r(temp_value, buf, level + 1, is_pretty, num_buf);
-            if (written < 0) {
-                return -1;
+            projection = project_name(parser, level, new_key, strlen(new_key));
+        } else {
+            projection = project_name(parser, level, name_start, name_len);
+        }
+        SKIP_WHITESPACES(parser, string);
+        if (CURRENT_CHAR(parser, string) != ':') {
+            goto error;
+        }
+        SKIP_CHAR(string);
+        SKIP_WHITESPACES(parser, string);
+        new_value = NULL;
+        if (projection == PROJECTION_DESCEND && CURRENT_CHAR(parser, string) == '{') {
+            new_value = parse_projected_object(parser, string, level + 1);
+        } else if (projection == PROJECTION_KEEP ||
+                   (projection == PROJECTION_DESCEND && CURRENT_CHAR(parser, string) == '[')) {
+            new_value = parse_value(parser, string, level + 1); /* arrays are kept whole */
+        } else {
+            projection = PROJECTION_SKIP;
+        }
+        unproject_name(parser, level);
+        if (projection == PROJECTION_SKIP) {
+            parser_free_string(parser, new_key);
+            new_key = NULL;
+            if (skip_value(parser, string) != JSONSuccess) {
+                goto error;
             }
-            if (buf != NULL) {
-                buf += written;
+        } else {
+            if (new_value == NULL) {
+                goto error;
+            }
+            if (new_key == NULL) {
+                new_key = process_string(parser, name_start, name_len);
+            }
+            if (new_key == NULL ||
+                parser_object_add(parser, output_object, new_key, new_value) == JSONFailure) {
+                parser_free_value(parser, new_value);
+                goto error;
+            }
+            new_key = NULL;
+        }
+        SKIP_WHITESPACES(parser, string);
+        if (CURRENT_CHAR(parser, string) != ',') {
+            break;
+        }
+        SKIP_CHAR(string);
+        SKIP_WHITESPACES(parser, string);
+    }
+    SKIP_WHITESPACES(parser, string);
+    if (CURRENT_CHAR(parser, string) != '}') {
+        goto error;
+    }
+    if (parser->arena == NULL && output_object->count < output_object->capacity &&
+        json_object_resize(output_object, output_object->count) == JSONFailure) {
+        goto error; /* Trim object after parsing is over */
+    }
+    SKIP_CHAR(string);
+    return output_value;
+error:
+    parser_free_string(parser, new_key);
+    parser_free_value(parser, output_value);
+    return NULL;
+}
+
+/* Tells what to do with the value of name in an object at level, and marks the paths that go on
+   inside it */
+static int project_name(const JSON_Parser *parser, size_t level, const char *name,
+                        size_t name_len)
+{
+    const JSON_Path_Segment *segment = NULL;
+    JSON_Path *path = NULL;
+    int projection = PROJECTION_SKIP;
+    size_t i;
+    for (i = 0; i < parser->path_count; i++) {
+        path = parser->paths[i];
+        if (path->matched != level) { /* left the path higher up */
+            continue;
+        }
+        segment = &path->segments[level];
+        if (segment->name_len != name_len || memcmp(segment->name, name, name_len) != 0) {
+            continue;
+        }
+        if (level + 1 == path->segment_count) {
+            return PROJECTION_KEEP;
+        }
+        path->matched = level + 1;
+        projection = PROJECTION_DESCEND;
+    }
+    return projection;
+}
+
+/* Unmarks the paths marked by project_name once the value of the name has been read */
+static void unproject_name(const JSON_Parser *parser, size_t level)
+{
+    size_t i;
+    for (i = 0; i < parser->path_count; i++) {
+        if (parser->paths[i]->matched > level) {
+            parser->paths[i]->matched = level;
+        }
+    }
+}
+
+/* Skips a value without building it or allocating. Only strings and the balance of brackets are
+   checked, not numbers, literals or the punctuation between values. */
+static JSON_Status skip_value(const JSON_Parser *parser, const char **string)
+{
+    const char *p = *string;
+    size_t depth = 0;
+    switch (CURRENT_CHAR(parser, string)) {
+    case '\"':
+        return skip_quotes(parser, string);
+    case '{':
+    case '[':
+        break;
+    default: /* number or literal */
+        while (p < parser->end && (is_number_char(*p) || (*p >= 'a' && *p <= 'z'))) {
+            p++;
+        }
+        if (p == *string) {
+            return JSONFailure;
+        }
+        *string = p;
+        return JSONSuccess;
+    }
+    do {
+        if (p == parser->end) {
+            return JSONFailure;
+        }
+        switch (*p) {
+        case '\"':
+            if (skip_quotes(parser, &p) != JSONSuccess) {
+                return JSONFailure;
+            }
+            continue;
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            depth--;
+            break;
+        default:
+            break;
+        }
+        p++;
+    } while (depth > 0);
+    *string = p;
+    return JSONSuccess;
+}
+
+/* SAX parser
+   Follows the same grammar as parse_value and friends, with the same token functions, but reports
+   events instead of building values. */
+static JSON_Status sax_parse_value(const JSON_SAX_Parser *sax, const char **string,
+                                   size_t nesting)
+{
+    const JSON_SAX_Handler *handler = sax->handler;
+    double number = 0;
+    if (nesting > MAX_NESTING) {
+        return JSONFailure;
+    }
+    SKIP_WHITESPACES(&sax->parser, string);
+    switch (CURRENT_CHAR(&sax->parser, string)) {
+    case '{':
+        return sax_parse_object(sax, string, nesting + 1);
+    case '[':
+        return sax_parse_array(sax, string, nesting + 1);
+    case '\"':
+        return sax_parse_string(sax, string, 0);
+    case 't':
+        if (!skip_literal(&sax->parser, string, "true", SIZEOF_TOKEN("true"))) {
+            return JSONFailure;
+        }
+        return handler->boolean != NULL ? handler->boolean(sax->context, 1) : JSONSuccess;
+    case 'f':
+        if (!skip_literal(&sax->parser, string, "false", SIZEOF_TOKEN("false"))) {
+            return JSONFailure;
+        }
+        return handler->boolean != NULL ? handler->boolean(sax->context, 0) : JSONSuccess;
+    case 'n':
+        if (!skip_literal(&sax->parser, string, "null", SIZEOF_TOKEN("null"))) {
+            return JSONFailure;
+        }
+        return handler->null != NULL ? handler->null(sax->context) : JSONSuccess;
+    case '-':
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+        *string = parse_number(*string, sax->parser.end, &number);
+        if (*string == NULL) {
+            return JSONFailure;
+        }
+        return handler->number != NULL ? handler->number(sax->context, number) : JSONSuccess;
+    default:
+        return JSONFailure;
+    }
+}
+
+static JSON_Status sax_parse_object(const JSON_SAX_Parser *sax, const char **string,
+                                    size_t nesting)
+{
+    const JSON_SAX_Handler *handler = sax->handler;
+    if (CURRENT_CHAR(&sax->parser, string) != '{') {
+        return JSONFailure;
+    }
+    if (handler->start_object != NULL && handler->start_object(sax->context) != JSONSuccess) {
+        return JSONFailure;
+    }
+    SKIP_CHAR(string);
+    SKIP_WHITESPACES(&sax->parser, string);
+    if (CURRENT_CHAR(&sax->parser, string) != '}') {
+        while (CURRENT_CHAR(&sax->parser, string) != '\0') {
+            if (sax_parse_string(sax, string, 1) != JSONSuccess) {
+                return JSONFailure;
+            }
+            SKIP_WHITESPACES(&sax->parser, string);
+            if (CURRENT_CHAR(&sax->parser, string) != ':') {
+                return JSONFailure;
+            }
+            SKIP_CHAR(string);
+            if (sax_parse_value(sax, string, nesting) != JSONSuccess) {
+                return JSONFailure;
+            }
+            SKIP_WHITESPACES(&sax->parser, string);
+            if (CURRENT_CHAR(&sax->parser, string) != ',') {
+                break;
+            }
+            SKIP_CHAR(string);
+            SKIP_WHITESPACES(&sax->parser, string);
+        }
+        SKIP_WHITESPACES(&sax->parser, string);
+        if (CURRENT_CHAR(&sax->parser, string) != '}') {
+            return JSONFailure;
+        }
+    }
+    SKIP_CHAR(string);
+    return handler->end_object != NULL ? handler->end_object(sax->context) : JSONSuccess;
+}
+
+static JSON_Status sax_parse_array(const JSON_SAX_Parser *sax, const char **string,
+                                   size_t nesting)
+{
+    const JSON_SAX_Handler *handler = sax->handler;
+    if (CURRENT_CHAR(&sax->parser, string) != '[') {
+        return JSONFailure;
+    }
+    if (handler->start_array != NULL && handler->start_array(sax->context) != JSONSuccess) {
+        return JSONFailure;
+    }
+    SKIP_CHAR(string);
+    SKIP_WHITESPACES(&sax->parser, string);
+    if (CURRENT_CHAR(&sax->parser, string) != ']') {
+        while (CURRENT_CHAR(&sax->parser, string) != '\0') {
+            if (sax_parse_value(sax, string, nesting) != JSONSuccess) {
+                return JSONFailure;
+            }
+            SKIP_WHITESPACES(&sax->parser, string);
+            if (CURRENT_CHAR(&sax->parser, string) != ',') {
+                break;
+            }
+            SKIP_CHAR(string);
+            SKIP_WHITESPACES(&sax->parser, string);
+        }
+        SKIP_WHITESPACES(&sax->parser, string);
+        if (CURRENT_CHAR(&sax->parser, string) != ']') {
+            return JSONFailure;
+        }
+    }
+    SKIP_CHAR(string);
+    return handler->end_array != NULL ? handler->end_array(sax->context) : JSONSuccess;
+}
+
+/* Reports a string or a name. Strings without escapes are passed from the input as they are;
+   others are decoded into the parser's string buffer. */
+static JSON_Status sax_parse_string(const JSON_SAX_Parser *sax, const char **string, int is_name)
+{
+    const JSON_SAX_Handler *handler = sax->handler;
+    JSON_Status (*callback)(void *, const char *, size_t) = is_name ? handler->name
+                                                                    : handler->string;
+    const char *start = *string + 1, *end = NULL;
+    char *decoded_end = NULL;
+    if (skip_quotes(&sax->parser, string) != JSONSuccess) {
+        return JSONFailure;
+    }
+    end = *string - 1; /* closing quote */
+    if (scan_string(start, end) == end) { /* no escapes or control characters */
+        return callback != NULL ? callback(sax->context, start, (size_t)(end - start))
+                                : JSONSuccess;
+    }
+    if ((size_t)(end - start) > sax->string_buffer_size) {
+        return JSONFailure; /* too long to decode without allocating */
+    }
+    decoded_end = decode_string(start, end, sax->string_buffer);
+    if (decoded_end == NULL) {
+        return JSONFailure;
+    }
+    return callback != NULL
+               ? callback(sax->context, sax->string_buffer,
+                          (size_t)(decoded_end - sax->string_buffer))
+               : JSONSuccess;
+}
+
+/* Push parser
+   Follows the same grammar as the SAX parser as a state machine that can stop at the end of any
+   chunk. Open objects and arrays are kept on a stack instead of in recursive calls, and a token
+   cut off by the end of a chunk is collected in the token buffer until it is complete. */
+static JSON_Push_Parser *push_parser_create(const JSON_SAX_Handler *handler, void *context)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)parson_malloc(sizeof(JSON_Push_Parser));
+    if (push == NULL) {
+        return NULL;
+    }
+    push->handler = handler;
+    push->context = context;
+    push->token = json_buffer_create(0);
+    push->containers = (char *)parson_malloc(STARTING_CAPACITY);
+    push->containers_capacity = STARTING_CAPACITY;
+    push->parser.end = NULL;
+    push->parser.arena = NULL;
+    push->parser.is_in_situ = 0;
+    push->parser.paths = NULL;
+    push->parser.path_count = 0;
+    push->root = NULL;
+    push->name = NULL;
+    if (push->token == NULL || push->containers == NULL) {
+        json_push_parser_free(push);
+        return NULL;
+    }
+    json_push_parser_reset(push);
+    return push;
+}
+
+static JSON_Status push_parse_chunk(JSON_Push_Parser *push, const char *p, const char *end)
+{
+    if (!push->is_started && p < end) {
+        push->is_started = 1;
+        if (*p == '\xEF') { /* Support for UTF-8 BOM, which may be split too */
+            push->token_kind = PUSH_TOKEN_LITERAL;
+            push->literal = "\xEF\xBB\xBF";
+            push->literal_len = 3;
+            push->literal_matched = 0;
+        }
+    }
+    while (p < end) {
+        if (push->token_kind != PUSH_TOKEN_NONE) {
+            p = push_continue_token(push, p, end);
+            if (p == NULL) {
+                return JSONFailure;
+            }
+            continue;
+        }
+        if (push->state == PUSH_DONE) {
+            return JSONSuccess;
+        }
+        p = scan_whitespace(p, end);
+        if (p == end) {
+            break;
+        }
+        switch (push->state) {
+        case PUSH_FIRST_VALUE:
+            p = *p == ']' ? push_close(push, p) : push_start_value(push, p, end);
+            break;
+        case PUSH_VALUE:
+            p = push_start_value(push, p, end);
+            break;
+        case PUSH_FIRST_NAME:
+            if (*p == '}') {
+                p = push_close(push, p);
+                break;
+            }
+            /* fall through */
+        case PUSH_NAME:
+            if (*p != '\"') {
+                return JSONFailure;
+            }
+            push->is_name = 1;
+            push->is_escaped = 0;
+            push->token_kind = PUSH_TOKEN_STRING;
+            json_buffer_clear(push->token);
+            p = push_continue_token(push, p + 1, end);
+            break;
+        case PUSH_COLON:
+            if (*p != ':') {
+                return JSONFailure;
+            }
+            push->state = PUSH_VALUE;
+            p++;
+            break;
+        case PUSH_NEXT:
+            if (*p != ',') {
+                p = push_close(push, p);
+                break;
+            }
+            push->state = push->containers[push->depth - 1] == '{' ? PUSH_NAME : PUSH_VALUE;
+            p++;
+            break;
+        default:
+            return JSONFailure;
+        }
+        if (p == NULL) {
+            return JSONFailure;
+        }
+    }
+    return JSONSuccess;
+}
+
+static const char *push_start_value(JSON_Push_Parser *push, const char *p, const char *end)
+{
+    if (push->depth > MAX_NESTING) {
+        return NULL;
+    }
+    switch (*p) {
+    case '{':
+    case '[':
+        return push_open(push, p);
+    case '\"':
+        push->is_name = 0;
+        push->is_escaped = 0;
+        push->token_kind = PUSH_TOKEN_STRING;
+        json_buffer_clear(push->token);
+        return push_continue_token(push, p + 1, end);
+    case 't':
+        push->literal = "true";
+        break;
+    case 'f':
+        push->literal = "false";
+        break;
+    case 'n':
+        push->literal = "null";
+        break;
+    case '-':
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+        push->token_kind = PUSH_TOKEN_NUMBER;
+        json_buffer_clear(push->token);
+        return push_continue_token(push, p, end);
+    default:
+        return NULL;
+    }
+    push->token_kind = PUSH_TOKEN_LITERAL;
+    push->literal_len = strlen(push->literal);
+    push->literal_matched = 0;
+    return push_continue_token(push, p, end);
+}
+
+static const char *push_open(JSON_Push_Parser *push, const char *p)
+{
+    const JSON_SAX_Handler *handler = push->handler;
+    char *new_containers = NULL;
+    JSON_Status status = JSONSuccess;
+    if (push->depth == push->containers_capacity) {
+        new_containers = (char *)parson_malloc(push->containers_capacity * 2);
+        if (new_containers == NULL) {
+            return NULL;
+        }
+        memcpy(new_containers, push->containers, push->depth);
+        parson_free(push->containers);
+        push->containers = new_containers;
+        push->containers_capacity *= 2;
+    }
+    push->containers[push->depth] = *p;
+    push->depth++;
+    if (*p == '{') {
+        push->state = PUSH_FIRST_NAME;
+        if (handler->start_object != NULL) {
+            status = handler->start_object(push->context);
+        }
+    } else {
+        push->state = PUSH_FIRST_VALUE;
+        if (handler->start_array != NULL) {
+            status = handler->start_array(push->context);
+        }
+    }
+    return status == JSONSuccess ? p + 1 : NULL;
+}
+
+/* Ends the innermost object or array if p closes it */
+static const char *push_close(JSON_Push_Parser *push, const char *p)
+{
+    const JSON_SAX_Handler *handler = push->handler;
+    JSON_Status status = JSONSuccess;
+    if (push->containers[push->depth - 1] == '{') {
+        if (*p != '}') {
+            return NULL;
+        }
+        if (handler->end_object != NULL) {
+            status = handler->end_object(push->context);
+        }
+    } else {
+        if (*p != ']') {
+            return NULL;
+        }
+        if (handler->end_array != NULL) {
+            status = handler->end_array(push->context);
+        }
+    }
+    push->depth--;
+    push_value_done(push);
+    return status == JSONSuccess ? p + 1 : NULL;
+}
+
+static void push_value_done(JSON_Push_Parser *push)
+{
+    push->state = push->depth == 0 ? PUSH_DONE : PUSH_NEXT;
+}
+
+/* Reads as much of the current token as the chunk holds. Returns the position after the token,
+   end if the token goes on in the next chunk, or NULL on failure. */
+static const char *push_continue_token(JSON_Push_Parser *push, const char *p, const char *end)
+{
+    JSON_Buffer *token = push->token;
+    const char *token_end = NULL;
+    JSON_Status status = JSONFailure;
+    switch (push->token_kind) {
+    case PUSH_TOKEN_STRING:
+        token_end = push_scan_string(push, p, end); /* closing quote */
+        if (token_end == NULL) {
+            return json_buffer_write(token, p, (size_t)(end - p)) == JSONSuccess ? end : NULL;
+        }
+        push->token_kind = PUSH_TOKEN_NONE;
+        if (token->length == 0) { /* all in this chunk */
+            status = push_string_done(push, p, token_end);
+        } else if (json_buffer_write(token, p, (size_t)(token_end - p)) == JSONSuccess) {
+            status = push_string_done(push, token->data, token->data + token->length);
+        }
+        return status == JSONSuccess ? token_end + 1 : NULL;
+    case PUSH_TOKEN_NUMBER:
+        token_end = p;
+        while (token_end < end && is_number_char(*token_end)) {
+            token_end++;
+        }
+        if (token_end == end) { /* more digits may follow */
+            return json_buffer_write(token, p, (size_t)(end - p)) == JSONSuccess ? end : NULL;
+        }
+        push->token_kind = PUSH_TOKEN_NONE;
+        if (token->length == 0) {
+            status = push_number_done(push, p, token_end);
+        } else if (json_buffer_write(token, p, (size_t)(token_end - p)) == JSONSuccess) {
+            status = push_number_done(push, token->data, token->data + token->length);
+        }
+        return status == JSONSuccess ? token_end : NULL;
+    case PUSH_TOKEN_LITERAL:
+        while (push->literal_matched < push->literal_len) {
+            if (p == end) {
+                return end;
+            }
+            if (*p != push->literal[push->literal_matched]) {
+                return NULL;
+            }
+            push->literal_matched++;
+            p++;
+        }
+        push->token_kind = PUSH_TOKEN_NONE;
+        return push_literal_done(push) == JSONSuccess ? p : NULL;
+    default:
+        return NULL;
+    }
+}
+
+/* Returns the closing quote of the string token, or NULL if it isn't in the chunk */
+static const char *push_scan_string(JSON_Push_Parser *push, const char *p, const char *end)
+{
+    for (;;) {
+        if (push->is_escaped) { /* the escaped character can't close the string */
+            if (p == end) {
+                return NULL;
+            }
+            push->is_escaped = 0;
+            p++;
+        }
+        p = scan_string(p, end);
+        if (p == end) {
+            return NULL;
+        }
+        if (*p == '\"') {
+            return p;
+        }
+        push->is_escaped = *p == '\\';
+        p++; /* control characters are rejected by decode_string */
+    }
+}
+
+/* Reports a complete string or name. Strings without escapes are passed as they are; others are
+   decoded in the token buffer. */
+static JSON_Status push_string_done(JSON_Push_Parser *push, const char *start, const char *end)
+{
+    const JSON_SAX_Handler *handler = push->handler;
+    JSON_Buffer *token = push->token;
+    char *decoded_end = NULL;
+    int is_name = push->is_name;
+    if (scan_string(start, end) != end) { /* escapes or control characters */
+        if (start != token->data) {
+            json_buffer_clear(token);
+            if (json_buffer_write(token, start, (size_t)(end - start)) != JSONSuccess) {
+                return JSONFailure;
+            }
+        }
+        decoded_end = decode_string(token->data, token->data + token->length, token->data);
+        if (decoded_end == NULL) {
+            return JSONFailure;
+        }
+        start = token->data;
+        end = decoded_end;
+    }
+    if (is_name) {
+        push->state = PUSH_COLON;
+        return handler->name != NULL ? handler->name(push->context, start, (size_t)(end - start))
+                                     : JSONSuccess;
+    }
+    push_value_done(push);
+    return handler->string != NULL ? handler->string(push->context, start, (size_t)(end - start))
+                                   : JSONSuccess;
+}
+
+static JSON_Status push_number_done(JSON_Push_Parser *push, const char *start, const char *end)
+{
+    double number = 0;
+    if (parse_number(start, end, &number) != end) {
+        return JSONFailure;
+    }
+    push_value_done(push);
+    return push->handler->number != NULL ? push->handler->number(push->context, number)
+                                         : JSONSuccess;
+}
+
+static JSON_Status push_literal_done(JSON_Push_Parser *push)
+{
+    const JSON_SAX_Handler *handler = push->handler;
+    switch (push->literal[0]) {
+    case 't':
+    case 'f':
+        push_value_done(push);
+        return handler->boolean != NULL ? handler->boolean(push->context, push->literal[0] == 't')
+                                        : JSONSuccess;
+    case 'n':
+        push_value_done(push);
+        return handler->null != NULL ? handler->null(push->context) : JSONSuccess;
+    default: /* BOM */
+        return JSONSuccess;
+    }
+}
+
+/* Without a handler of the caller, the push parser reports to these functions, which build a
+   value the way parse_value does. */
+static JSON_Status push_dom_add(JSON_Push_Parser *push, JSON_Value *value)
+{
+    JSON_Status status = JSONSuccess;
+    JSON_Value_Type type = JSONError;
+    if (value == NULL) {
+        return JSONFailure;
+    }
+    type = json_value_get_type(value);
+    if (push->current == NULL) {
+        push->root = value;
+    } else if (json_value_get_type(push->current) == JSONObject) {
+        status = parser_object_add(&push->parser, json_value_get_object(push->current),
+                                   push->name, value);
+        if (status == JSONSuccess) {
+            push->name = NULL;
+        }
+    } else {
+        status = parser_array_add(&push->parser, json_value_get_array(push->current), value);
+    }
+    if (status != JSONSuccess) {
+        json_value_free(value);
+        return JSONFailure;
+    }
+    if (type == JSONObject || type == JSONArray) {
+        push->current = value;
+    }
+    return JSONSuccess;
+}
+
+static JSON_Status push_dom_start_object(void *context)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    return push_dom_add(push, parser_init_value(&push->parser, JSONObject));
+}
+
+static JSON_Status push_dom_end_object(void *context)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    JSON_Object *object = json_value_get_object(push->current);
+    if (object->count < object->capacity && /* Trim object after parsing is over */
+        json_object_resize(object, object->count) == JSONFailure) {
+        return JSONFailure;
+    }
+    push->current = json_value_get_parent(push->current);
+    return JSONSuccess;
+}
+
+static JSON_Status push_dom_start_array(void *context)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    return push_dom_add(push, parser_init_value(&push->parser, JSONArray));
+}
+
+static JSON_Status push_dom_end_array(void *context)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    JSON_Array *array = json_value_get_array(push->current);
+    if (array->count < array->capacity && /* Trim array after parsing is over */
+        json_array_resize(array, array->count) == JSONFailure) {
+        return JSONFailure;
+    }
+    push->current = json_value_get_parent(push->current);
+    return JSONSuccess;
+}
+
+static JSON_Status push_dom_name(void *context, const char *name, size_t name_len)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    node_free_string(push->name);
+    push->name = node_strndup(name, name_len);
+    return push->name != NULL ? JSONSuccess : JSONFailure;
+}
+
+static JSON_Status push_dom_string(void *context, const char *string, size_t len)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    return push_dom_add(push, json_value_init_stringn(string, len));
+}
+
+static JSON_Status push_dom_number(void *context, double number)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    JSON_Value *value = parser_init_value(&push->parser, JSONNumber);
+    if (value == NULL) {
+        return JSONFailure;
+    }
+    value->value.number = number;
+    return push_dom_add(push, value);
+}
+
+static JSON_Status push_dom_boolean(void *context, int boolean)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    return push_dom_add(push, json_value_init_boolean(boolean));
+}
+
+static JSON_Status push_dom_null(void *context)
+{
+    JSON_Push_Parser *push = (JSON_Push_Parser *)context;
+    return push_dom_add(push, json_value_init_null());
+}
+
+static const JSON_SAX_Handler push_dom_handler = {
+    push_dom_start_object, push_dom_end_object, push_dom_start_array,
+    push_dom_end_array,    push_dom_name,       push_dom_string,
+    push_dom_number,       push_dom_boolean,    push_dom_null};
+
+/* Tape
+   A tape holds a document as a flat run of entries in the order of the input, built by a parse
+   that follows the grammar of parse_value and friends. An object or array links its first and
+   end entries, so that it can be stepped over in one move. */
+
+/* Counts what the tape of the value at string needs: an entry per value, name and end of an
+   object or array, a double per number, and room for each string as long as it is in the input.
+   Like skip_value, only strings and the balance of brackets are checked; the parse checks the
+   rest, and never writes past what was counted. */
+static JSON_Status tape_measure(const JSON_Parser *parser, const char *string,
+                                size_t *entry_count, size_t *number_count, size_t *strings_size)
+{
+    const char *p = string, *start = NULL;
+    size_t depth = 0, entries = 1, numbers = 0, strings = 0; /* the TAPE_ROOT entry */
+    size_t limit = (size_t)-1 / 4; /* keeps the sum of the three sizes from overflowing */
+    for (;;) {
+        if (p == parser->end) {
+            return JSONFailure;
+        }
+        switch (*p) {
+        case '\"':
+            start = p;
+            if (skip_quotes(parser, &p) != JSONSuccess) {
+                return JSONFailure;
+            }
+            entries++;
+            strings += (size_t)(p - start) - 2 + TAPE_STRING_OVERHEAD;
+            break;
+        case '{':
+        case '[':
+            entries += 2;
+            depth++;
+            p++;
+            break;
+        case '}':
+        case ']':
+            if (depth == 0) {
+                return JSONFailure;
+            }
+            depth--;
+            p++;
+            break;
+        default:
+            if (!is_number_char(*p) && !(*p >= 'a' && *p <= 'z')) {
+                p++; /* whitespace, ',' and ':', or anything the parse rejects */
+                continue;
+            }
+            if (*p == '-' || (*p >= '0' && *p <= '9')) {
+                numbers++;
+            }
+            entries++;
+            while (p < parser->end && (is_number_char(*p) || (*p >= 'a' && *p <= 'z'))) {
+                p++;
+            }
+            break;
+        }
+        if (depth == 0) {
+            break;
+        }
+    }
+    if (entries > TAPE_MAX_PAYLOAD || strings > TAPE_MAX_PAYLOAD ||
+        entries > limit / sizeof(JSON_Tape_Entry) || numbers > limit / sizeof(double) ||
+        strings > limit) {
+        return JSONFailure;
+    }
+    *entry_count = entries;
+    *number_count = numbers;
+    *strings_size = strings;
+    return JSONSuccess;
+}
+
+static JSON_Status tape_append(JSON_Tape_Parser *tape_parser, int tag, size_t payload)
+{
+    JSON_Tape *tape = tape_parser->tape;
+    if (tape->entry_count >= tape_parser->entry_capacity) {
+        return JSONFailure;
+    }
+    tape->entries[tape->entry_count].tag = (unsigned int)tag;
+    tape->entries[tape->entry_count].payload = (unsigned int)payload;
+    tape->entry_count++;
+    return JSONSuccess;
+}
+
+/* Appends the end of the object or array whose entry is at start, and links the two */
+static JSON_Status tape_close(JSON_Tape_Parser *tape_parser, size_t start, size_t count,
+                              int end_tag)
+{
+    JSON_Tape *tape = tape_parser->tape;
+    if (tape_append(tape_parser, end_tag, start) != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (count > TAPE_MAX_COUNT) {
+        count = TAPE_MAX_COUNT;
+    }
+    tape->entries[start].tag |= (unsigned int)count << TAPE_COUNT_SHIFT;
+    tape->entries[start].payload = (unsigned int)tape->entry_count;
+    return JSONSuccess;
+}
+
+static JSON_Status tape_parse_value(JSON_Tape_Parser *tape_parser, const char **string,
+                                    size_t nesting)
+{
+    JSON_Tape *tape = tape_parser->tape;
+    const char *number_end = NULL;
+    if (nesting > MAX_NESTING) {
+        return JSONFailure;
+    }
+    SKIP_WHITESPACES(&tape_parser->parser, string);
+    switch (CURRENT_CHAR(&tape_parser->parser, string)) {
+    case '{':
+        return tape_parse_object(tape_parser, string, nesting + 1);
+    case '[':
+        return tape_parse_array(tape_parser, string, nesting + 1);
+    case '\"':
+        return tape_parse_string(tape_parser, string, TAPE_STRING);
+    case 't':
+        if (!skip_literal(&tape_parser->parser, string, "true", SIZEOF_TOKEN("true"))) {
+            return JSONFailure;
+        }
+        return tape_append(tape_parser, TAPE_TRUE, 0);
+    case 'f':
+        if (!skip_literal(&tape_parser->parser, string, "false", SIZEOF_TOKEN("false"))) {
+            return JSONFailure;
+        }
+        return tape_append(tape_parser, TAPE_FALSE, 0);
+    case 'n':
+        if (!skip_literal(&tape_parser->parser, string, "null", SIZEOF_TOKEN("null"))) {
+            return JSONFailure;
+        }
+        return tape_append(tape_parser, TAPE_NULL, 0);
+    case '-':
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+        if (tape->number_count >= tape_parser->number_capacity) {
+            return JSONFailure;
+        }
+        number_end = parse_number(*string, tape_parser->parser.end,
+                                  &tape->numbers[tape->number_count]);
+        if (number_end == NULL) {
+            return JSONFailure;
+        }
+        *string = number_end;
+        tape->number_count++;
+        return tape_append(tape_parser, TAPE_NUMBER, tape->number_count - 1);
+    default:
+        return JSONFailure;
+    }
+}
+
+static JSON_Status tape_parse_object(JSON_Tape_Parser *tape_parser, const char **string,
+                                     size_t nesting)
+{
+    const JSON_Parser *parser = &tape_parser->parser;
+    size_t start = tape_parser->tape->entry_count, count = 0;
+    if (CURRENT_CHAR(parser, string) != '{' ||
+        tape_append(tape_parser, TAPE_OBJECT, 0) != JSONSuccess) {
+        return JSONFailure;
+    }
+    SKIP_CHAR(string);
+    SKIP_WHITESPACES(parser, string);
+    if (CURRENT_CHAR(parser, string) != '}') {
+        while (CURRENT_CHAR(parser, string) != '\0') {
+            if (tape_parse_string(tape_parser, string, TAPE_NAME) != JSONSuccess) {
+                return JSONFailure;
+            }
+            SKIP_WHITESPACES(parser, string);
+            if (CURRENT_CHAR(parser, string) != ':') {
+                return JSONFailure;
+            }
+            SKIP_CHAR(string);
+            if (tape_parse_value(tape_parser, string, nesting) != JSONSuccess) {
+                return JSONFailure;
+            }
+            count++;
+            SKIP_WHITESPACES(parser, string);
+            if (CURRENT_CHAR(parser, string) != ',') {
+                break;
+            }
+            SKIP_CHAR(string);
+            SKIP_WHITESPACES(parser, string);
+        }
+        SKIP_WHITESPACES(parser, string);
+        if (CURRENT_CHAR(parser, string) != '}') {
+            return JSONFailure;
+        }
+    }
+    SKIP_CHAR(string);
+    return tape_close(tape_parser, start, count, TAPE_OBJECT_END);
+}
+
+static JSON_Status tape_parse_array(JSON_Tape_Parser *tape_parser, const char **string,
+                                    size_t nesting)
+{
+    const JSON_Parser *parser = &tape_parser->parser;
+    size_t start = tape_parser->tape->entry_count, count = 0;
+    if (CURRENT_CHAR(parser, string) != '[' ||
+        tape_append(tape_parser, TAPE_ARRAY, 0) != JSONSuccess) {
+        return JSONFailure;
+    }
+    SKIP_CHAR(string);
+    SKIP_WHITESPACES(parser, string);
+    if (CURRENT_CHAR(parser, string) != ']') {
+        while (CURRENT_CHAR(parser, string) != '\0') {
+            if (tape_parse_value(tape_parser, string, nesting) != JSONSuccess) {
+                return JSONFailure;
+            }
+            count++;
+            SKIP_WHITESPACES(parser, string);
+            if (CURRENT_CHAR(parser, string) != ',') {
+                break;
+            }
+            SKIP_CHAR(string);
+            SKIP_WHITESPACES(parser, string);
+        }
+        SKIP_WHITESPACES(parser, string);
+        if (CURRENT_CHAR(parser, string) != ']') {
+            return JSONFailure;
+        }
+    }
+    SKIP_CHAR(string);
+    return tape_close(tape_parser, start, count, TAPE_ARRAY_END);
+}
+
+/* Decodes a string or a name into the strings of the tape, behind its length */
+static JSON_Status tape_parse_string(JSON_Tape_Parser *tape_parser, const char **string, int tag)
+{
+    JSON_Tape *tape = tape_parser->tape;
+    const char *start = *string;
+    char *output = NULL, *output_end = NULL;
+    unsigned int len = 0;
+    if (skip_quotes(&tape_parser->parser, string) != JSONSuccess ||
+        (size_t)(*string - start) - 2 + TAPE_STRING_OVERHEAD >
+            tape_parser->strings_capacity - tape->strings_size) {
+        return JSONFailure;
+    }
+    output = tape->strings + tape->strings_size + TAPE_STRING_HEADER_SIZE;
+    output_end = decode_string(start + 1, *string - 1, output);
+    if (output_end == NULL) {
+        return JSONFailure;
+    }
+    *output_end = '\0';
+    len = (unsigned int)(output_end - output);
+    memcpy(tape->strings + tape->strings_size, &len, sizeof(len));
+    if (tape_append(tape_parser, tag, tape->strings_size) != JSONSuccess) {
+        return JSONFailure;
+    }
+    tape->strings_size = (size_t)(output_end + 1 - tape->strings);
+    return JSONSuccess;
+}
+
+/* Returns the entry of value, or NULL if value isn't the index of a value in tape */
+static const JSON_Tape_Entry *tape_get_entry(const JSON_Tape *tape, size_t value)
+{
+    int tag = 0;
+    if (tape == NULL || value == 0 || value >= tape->entry_count) {
+        return NULL;
+    }
+    tag = TAPE_TAG(tape->entries[value]);
+    if (tag == TAPE_NAME || tag == TAPE_OBJECT_END || tag == TAPE_ARRAY_END) {
+        return NULL;
+    }
+    return &tape->entries[value];
+}
+
+/* Returns the index of the entry after value, and after everything in it */
+static size_t tape_skip(const JSON_Tape *tape, size_t value)
+{
+    switch (TAPE_TAG(tape->entries[value])) {
+    case TAPE_OBJECT:
+    case TAPE_ARRAY:
+        return tape->entries[value].payload;
+    default:
+        return value + 1;
+    }
+}
+
+static const char *tape_get_string(const JSON_Tape *tape, size_t offset, size_t *len)
+{
+    unsigned int string_len = 0;
+    memcpy(&string_len, tape->strings + offset, sizeof(string_len));
+    *len = string_len;
+    return tape->strings + offset + TAPE_STRING_HEADER_SIZE;
+}
+
+static JSON_Value *tape_to_value(const JSON_Tape *tape, size_t value)
+{
+    const JSON_Parser parser = {NULL, NULL, 0, NULL, 0}; /* allocates with parson_malloc */
+    JSON_Value *result = NULL, *member = NULL;
+    char *string = NULL;
+    const char *tape_string = NULL;
+    size_t i = 0, len = 0, count = json_tape_get_count(tape, value);
+    switch (TAPE_TAG(tape->entries[value])) {
+    case TAPE_OBJECT:
+        result = parser_init_value(&parser, JSONObject);
+        if (result == NULL ||
+            (count > 0 && json_object_resize(result->value.object, count) != JSONSuccess)) {
+            json_value_free(result);
+            return NULL;
+        }
+        for (i = value + 1; TAPE_TAG(tape->entries[i]) == TAPE_NAME; i = tape_skip(tape, i + 1)) {
+            tape_string = tape_get_string(tape, tape->entries[i].payload, &len);
+            string = node_strndup(tape_string, len);
+            member = string != NULL ? tape_to_value(tape, i + 1) : NULL;
+            if (member == NULL ||
+                parser_object_add(&parser, result->value.object, string, member) != JSONSuccess) {
+                node_free_string(string);
+                json_value_free(member);
+                json_value_free(result);
+                return NULL;
+            }
+        }
+        return result;
+    case TAPE_ARRAY:
+        result = parser_init_value(&parser, JSONArray);
+        if (result == NULL ||
+            (count > 0 && json_array_resize(result->value.array, count) != JSONSuccess)) {
+            json_value_free(result);
+            return NULL;
+        }
+        for (i = value + 1; TAPE_TAG(tape->entries[i]) != TAPE_ARRAY_END; i = tape_skip(tape, i)) {
+            member = tape_to_value(tape, i);
+            if (member == NULL || json_array_add(result->value.array, member) != JSONSuccess) {
+                json_value_free(member);
+                json_value_free(result);
+                return NULL;
+            }
+        }
+        return result;
+    case TAPE_STRING:
+        tape_string = tape_get_string(tape, tape->entries[value].payload, &len);
+        return json_value_init_stringn(tape_string, len);
+    case TAPE_NUMBER:
+        return json_value_init_number(tape->numbers[tape->entries[value].payload]);
+    case TAPE_TRUE:
+        return json_value_init_boolean(1);
+    case TAPE_FALSE:
+        return json_value_init_boolean(0);
+    case TAPE_NULL:
+        return json_value_init_null();
+    default:
+        return NULL;
+    }
+}
+
+/* Serialization */
+#define APPEND_STRING(str)                                                 \
+    do {                                                                   \
+        if (writer_append(writer, (str), SIZEOF_TOKEN(str)) != JSONSuccess) { \
+            return JSONFailure;                                            \
+        }                                                                  \
+    } while (0)
+
+#define APPEND_INDENT(level)                                     \
+    do {                                                         \
+        if (writer_append_indent(writer, (level)) != JSONSuccess) { \
+            return JSONFailure;                                  \
+        }                                                        \
+    } while (0)
+
+/* Writer */
+static void writer_init(JSON_Writer *writer, int kind, char *start, char *end)
+{
+    writer->pos = start;
+    writer->end = end;
+    writer->kind = kind;
+    writer->chunk = start;
+    writer->count = 0;
+    writer->buffer = NULL;
+    writer->write_fun = NULL;
+    writer->context = NULL;
+}
+
+/* Makes room for at least n bytes at pos. n may be at most WRITER_CHUNK_SIZE, except for a
+   growable buffer. */
+static JSON_Status writer_make_room(JSON_Writer *writer, size_t n)
+{
+    JSON_Buffer *buffer = writer->buffer;
+    switch (writer->kind) {
+    case WRITER_BUFFER:
+        buffer->length = (size_t)(writer->pos - buffer->data);
+        if (json_buffer_reserve(buffer, n) != JSONSuccess) {
+            return JSONFailure;
+        }
+        writer->pos = buffer->data + buffer->length;
+        writer->end = buffer->data + buffer->capacity - 1; /* room for the NUL */
+        return JSONSuccess;
+    case WRITER_FUNCTION:
+    case WRITER_COUNT:
+        return writer_flush(writer);
+    default: /* a fixed buffer can't grow */
+        return JSONFailure;
+    }
+}
+
+/* Passes the staged output on to the write function, or just counts it */
+static JSON_Status writer_flush(JSON_Writer *writer)
+{
+    size_t n = (size_t)(writer->pos - writer->chunk);
+    if (writer->kind == WRITER_FUNCTION && n > 0 &&
+        writer->write_fun(writer->context, writer->chunk, n) != JSONSuccess) {
+        return JSONFailure;
+    }
+    writer->count += n;
+    writer->pos = writer->chunk;
+    return JSONSuccess;
+}
+
+static JSON_Status writer_finish(JSON_Writer *writer)
+{
+    switch (writer->kind) {
+    case WRITER_BUFFER:
+        writer->buffer->length = (size_t)(writer->pos - writer->buffer->data);
+        *writer->pos = '\0';
+        return JSONSuccess;
+    case WRITER_FUNCTION:
+    case WRITER_COUNT:
+        return writer_flush(writer);
+    default:
+        *writer->pos = '\0';
+        return JSONSuccess;
+    }
+}
+
+static JSON_Status writer_append(JSON_Writer *writer, const char *data, size_t len)
+{
+    size_t available = (size_t)(writer->end - writer->pos);
+    while (len > available) {
+        memcpy(writer->pos, data, available);
+        writer->pos += available;
+        data += available;
+        len -= available;
+        if (writer_make_room(writer, len < WRITER_CHUNK_SIZE ? len : WRITER_CHUNK_SIZE) !=
+            JSONSuccess) {
+            return JSONFailure;
+        }
+        available = (size_t)(writer->end - writer->pos);
+    }
+    memcpy(writer->pos, data, len);
+    writer->pos += len;
+    return JSONSuccess;
+}
+
+static JSON_Status writer_append_indent(JSON_Writer *writer, int level)
+{
+    int i;
+    for (i = 0; i < level; i++) {
+        if (writer_append(writer, "    ", 4) != JSONSuccess) {
+            return JSONFailure;
+        }
+    }
+    return JSONSuccess;
+}
+
+static JSON_Status writer_append_number(JSON_Writer *writer, double number, int precision)
+{
+    char num_buf[NUM_BUF_SIZE];
+    int written = -1;
+    if ((size_t)(writer->end - writer->pos) >= NUM_BUF_SIZE) { /* format in place */
+        written = format_number(number, precision, writer->pos);
+        if (written < 0) {
+            return JSONFailure;
+        }
+        writer->pos += written;
+        return JSONSuccess;
+    }
+    written = format_number(number, precision, num_buf);
+    if (written < 0) {
+        return JSONFailure;
+    }
+    return writer_append(writer, num_buf, (size_t)written);
+}
+
+static JSON_Status json_serialize_to_writer_r(const JSON_Value *value, JSON_Writer *writer,
+                                              int level, int is_pretty, int precision)
+{
+    const char *key = NULL, *string = NULL;
+    JSON_Value *temp_value = NULL;
+    JSON_Array *array = NULL;
+    JSON_Object *object = NULL;
+    size_t i = 0, count = 0;
+
+    if (value != NULL && value->precision != 0) { /* applies to everything inside value */
+        precision = value->precision;
+    }
+    switch (json_value_get_type(value)) {
+    case JSONArray:
+        array = json_value_get_array(value);
+        count = json_array_get_count(array);
+        APPEND_STRING("[");
+        if (count > 0 && is_pretty) {
+            APPEND_STRING("\n");
+        }
+        for (i = 0; i < count; i++) {
+            if (is_pretty) {
+                APPEND_INDENT(level + 1);
+            }
+            temp_value = json_array_get_value(array, i);
+            if (json_serialize_to_writer_r(temp_value, writer, level + 1, is_pretty, precision) !=
+                JSONSuccess) {
+                return JSONFailure;
             }
-            written_total += written;
             if (i < (count - 1)) {
                 APPEND_STRING(",");
             }
@@ -966,7 +3380,7 @@ static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int le
             APPEND_INDENT(level);
         }
         APPEND_STRING("]");
-        return written_total;
+        return JSONSuccess;
     case JSONObject:
         object = json_value_get_object(value);
         count = json_object_get_count(object);
@@ -977,32 +3391,23 @@ static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int le
         for (i = 0; i < count; i++) {
             key = json_object_get_name(object, i);
             if (key == NULL) {
-                return -1;
+                return JSONFailure;
             }
             if (is_pretty) {
                 APPEND_INDENT(level + 1);
             }
-            written = json_serialize_string(key, buf);
-            if (written < 0) {
-                return -1;
-            }
-            if (buf != NULL) {
-                buf += written;
+            if (json_serialize_string(key, writer) != JSONSuccess) {
+                return JSONFailure;
             }
-            written_total += written;
             APPEND_STRING(":");
             if (is_pretty) {
                 APPEND_STRING(" ");
             }
-            temp_value = json_object_get_value(object, key);
-            written = json_serialize_to_buffer_r(temp_value, buf, level + 1, is_pretty, num_buf);
-            if (written < 0) {
-                return -1;
-            }
-            if (buf != NULL) {
-                buf += written;
+            temp_value = json_object_get_value_at(object, i);
+            if (json_serialize_to_writer_r(temp_value, writer, level + 1, is_pretty, precision) !=
+                JSONSuccess) {
+                return JSONFailure;
             }
-            written_total += written;
             if (i < (count - 1)) {
                 APPEND_STRING(",");
             }
@@ -1014,61 +3419,183 @@ static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int le
             APPEND_INDENT(level);
         }
         APPEND_STRING("}");
-        return written_total;
+        return JSONSuccess;
     case JSONString:
         string = json_value_get_string(value);
         if (string == NULL) {
-            return -1;
-        }
-        written = json_serialize_string(string, buf);
-        if (written < 0) {
-            return -1;
-        }
-        if (buf != NULL) {
-            buf += written;
+            return JSONFailure;
         }
-        written_total += written;
-        return written_total;
+        return json_serialize_string(string, writer);
     case JSONBoolean:
         if (json_value_get_boolean(value)) {
             APPEND_STRING("true");
         } else {
             APPEND_STRING("false");
         }
-        return written_total;
+        return JSONSuccess;
     case JSONNumber:
-        num = json_value_get_number(value);
-        if (buf != NULL) {
-            num_buf = buf;
-        }
-        written = sprintf(num_buf, FLOAT_FORMAT, num);
-        if (written < 0) {
-            return -1;
-        }
-        if (buf != NULL) {
-            buf += written;
-        }
-        written_total += written;
-        return written_total;
+        return writer_append_number(writer, json_value_get_number(value), precision);
     case JSONNull:
         APPEND_STRING("null");
-        return written_total;
+        return JSONSuccess;
     case JSONError:
-        return -1;
+        return JSONFailure;
     default:
-        return -1;
+        return JSONFailure;
+    }
+}
+
+/* Writes number in the shortest form that parses back to the same double, or rounded to precision
+   significant digits when precision isn't 0. Returns the length, like sprintf. */
+static int format_number(double number, int precision, char *buf)
+{
+    static const double negative_zero = -0.0;
+    double magnitude = fabs(number);
+    int is_negative = number < 0 || !memcmp(&number, &negative_zero, sizeof(double));
+    int first_precision = 1; /* for the shortest form with sprintf */
+#ifndef PARSON_NO_FAST_NUMBERS
+    double digits = 0;
+    int fraction_digits = 0, exponent = 0;
+#endif
+    if (magnitude < 1e15 && floor(magnitude) == magnitude &&
+        (precision == 0 || precision >= MAX_EXACT_DIGITS)) {
+        return format_fixed(magnitude, 0, is_negative, buf);
+    }
+#ifndef PARSON_NO_FAST_NUMBERS
+    if (magnitude >= MIN_FIXED_NOTATION && magnitude < 1e15) {
+        if (precision == 0) {
+            /* The first digits * 10^-fraction_digits that rounds back to magnitude is the
+               shortest; both operands are exact, so the division rounds like a parser would. */
+            for (fraction_digits = 1; fraction_digits <= MAX_EXACT_POW10; fraction_digits++) {
+                digits = floor(magnitude * exact_pow10[fraction_digits] + 0.5);
+                if (digits >= 1e15) {
+                    break;
+                }
+                if (digits / exact_pow10[fraction_digits] == magnitude) {
+                    return format_fixed(digits, fraction_digits, is_negative, buf);
+                }
+            }
+            first_precision = MAX_EXACT_DIGITS + 1;
+        } else {
+            if (magnitude >= 1) { /* magnitude is in [10^exponent, 10^(exponent + 1)) */
+                while (exponent < 14 && magnitude >= exact_pow10[exponent + 1]) {
+                    exponent++;
+                }
+            } else {
+                while (magnitude * exact_pow10[-exponent] < 1) {
+                    exponent--;
+                }
+            }
+            fraction_digits = precision - 1 - exponent;
+            if (fraction_digits < 0) { /* rounds in the integer part, e.g. 12345 to 12300 */
+                digits = floor(magnitude / exact_pow10[-fraction_digits] + 0.5);
+                return format_fixed(digits * exact_pow10[-fraction_digits], 0, is_negative, buf);
+            }
+            if (fraction_digits <= MAX_EXACT_POW10) {
+                digits = floor(magnitude * exact_pow10[fraction_digits] + 0.5);
+                if (digits < 1e15) {
+                    return format_fixed(digits, fraction_digits, is_negative, buf);
+                }
+            }
+        }
+    }
+#endif
+    if (precision == 0) {
+        return format_with_sprintf(number, first_precision, 1, buf);
+    }
+    return format_with_sprintf(number, precision, 0, buf);
+}
+
+/* Writes the integer digits (below 1e15) with a decimal point fraction_digits from the right,
+   dropping trailing zeros of the fraction */
+static int format_fixed(double digits, int fraction_digits, int is_negative, char *buf)
+{
+    char digit_chars[2 * 9]; /* least significant first */
+    unsigned long high = (unsigned long)floor(digits / 1e9);
+    unsigned long low = (unsigned long)(digits - (double)high * 1e9);
+    int count = 0, first = 0, length = 0, i = 0;
+    do {
+        digit_chars[count++] = (char)('0' + low % 10);
+        low /= 10;
+    } while (low != 0 || (high != 0 && count < 9));
+    while (high != 0) {
+        digit_chars[count++] = (char)('0' + high % 10);
+        high /= 10;
+    }
+    while (fraction_digits > 0 && first < count - 1 && digit_chars[first] == '0') {
+        first++;
+        fraction_digits--;
+    }
+    if (is_negative) {
+        buf[length++] = '-';
+    }
+    if (count - first <= fraction_digits) {
+        buf[length++] = '0';
+        buf[length++] = '.';
+        for (i = count - first; i < fraction_digits; i++) {
+            buf[length++] = '0';
+        }
+    }
+    for (i = count - 1; i >= first; i--) {
+        if (i == first + fraction_digits - 1 && i != count - 1) {
+            buf[length++] = '.';
+        }
+        buf[length++] = digit_chars[i];
+    }
+    buf[length] = '\0';
+    return length;
+}
+
+/* Fallback for numbers that don't fit fixed notation with at most 15 digits. With is_shortest,
+   adds digits from precision on until the result parses back to number. */
+static int format_with_sprintf(double number, int precision, int is_shortest, char *buf)
+{
+    char number_buf[NUM_BUF_SIZE]; /* a longer attempt may come before a shorter result */
+    const char *locale_decimal_point = localeconv()->decimal_point;
+    char *decimal_point = NULL;
+    int length = 0;
+    for (;;) {
+        length = sprintf(number_buf, "%1.*g", precision, number);
+        if (length < 0) {
+            return -1;
+        }
+        if (!is_shortest || precision >= MAX_NUMBER_PRECISION ||
+            strtod(number_buf, NULL) == number) {
+            break;
+        }
+        precision++;
+    }
+    if (locale_decimal_point[0] != '.' && locale_decimal_point[0] != '\0' &&
+        locale_decimal_point[1] == '\0') { /* JSON always uses '.' */
+        decimal_point = strchr(number_buf, locale_decimal_point[0]);
+        if (decimal_point != NULL) {
+            *decimal_point = '.';
+        }
     }
+    memcpy(buf, number_buf, (size_t)length + 1);
+    return length;
 }
 
-static int json_serialize_string(const char *string, char *buf)
+/* Copies runs that need no escaping in one piece */
+static JSON_Status json_serialize_string(const char *string, JSON_Writer *writer)
 {
-    size_t i = 0, len = strlen(string);
-    char c = '\0';
-    int written = -1, written_total = 0;
+    static const char hex_digits[] = "0123456789abcdef";
+    const char *end = string + strlen(string), *run_end = NULL, *slash = NULL;
+    char escape[6] = {'\\', 'u', '0', '0', '0', '0'};
     APPEND_STRING("\"");
-    for (i = 0; i < len; i++) {
-        c = string[i];
-        switch (c) {
+    for (;;) {
+        run_end = scan_string(string, end);
+        slash = (const char *)memchr(string, '/', (size_t)(run_end - string));
+        if (slash != NULL) {
+            run_end = slash;
+        }
+        if (writer_append(writer, string, (size_t)(run_end - string)) != JSONSuccess) {
+            return JSONFailure;
+        }
+        if (run_end == end) {
+            break;
+        }
+        switch (*run_end) {
         case '\"':
             APPEND_STRING("\\\"");
             break;
@@ -1093,140 +3620,447 @@ static int json_serialize_string(const char *string, char *buf)
         case '\t':
             APPEND_STRING("\\t");
             break;
-        case '\x00':
-            APPEND_STRING("\\u0000");
-            break;
-        case '\x01':
-            APPEND_STRING("\\u0001");
-            break;
-        case '\x02':
-            APPEND_STRING("\\u0002");
-            break;
-        case '\x03':
-            APPEND_STRING("\\u0003");
-            break;
-        case '\x04':
-            APPEND_STRING("\\u0004");
-            break;
-        case '\x05':
-            APPEND_STRING("\\u0005");
-            break;
-        case '\x06':
-            APPEND_STRING("\\u0006");
-            break;
-        case '\x07':
-            APPEND_STRING("\\u0007");
-            break;
-        /* '\x08' duplicate: '\b' */
-        /* '\x09' duplicate: '\t' */
-        /* '\x0a' duplicate: '\n' */
-        case '\x0b':
-            APPEND_STRING("\\u000b");
-            break;
-        /* '\x0c' duplicate: '\f' */
-        /* '\x0d' duplicate: '\r' */
-        case '\x0e':
-            APPEND_STRING("\\u000e");
-            break;
-        case '\x0f':
-            APPEND_STRING("\\u000f");
-            break;
-        case '\x10':
-            APPEND_STRING("\\u0010");
-            break;
-        case '\x11':
-            APPEND_STRING("\\u0011");
-            break;
-        case '\x12':
-            APPEND_STRING("\\u0012");
-            break;
-        case '\x13':
-            APPEND_STRING("\\u0013");
-            break;
-        case '\x14':
-            APPEND_STRING("\\u0014");
-            break;
-        case '\x15':
-            APPEND_STRING("\\u0015");
-            break;
-        case '\x16':
-            APPEND_STRING("\\u0016");
-            break;
-        case '\x17':
-            APPEND_STRING("\\u0017");
-            break;
-        case '\x18':
-            APPEND_STRING("\\u0018");
-            break;
-        case '\x19':
-            APPEND_STRING("\\u0019");
-            break;
-        case '\x1a':
-            APPEND_STRING("\\u001a");
-            break;
-        case '\x1b':
-            APPEND_STRING("\\u001b");
-            break;
-        case '\x1c':
-            APPEND_STRING("\\u001c");
-            break;
-        case '\x1d':
-            APPEND_STRING("\\u001d");
-            break;
-        case '\x1e':
-            APPEND_STRING("\\u001e");
-            break;
-        case '\x1f':
-            APPEND_STRING("\\u001f");
-            break;
-        default:
-            if (buf != NULL) {
-                buf[0] = c;
-                buf += 1;
+        default: /* other control characters */
+            escape[4] = hex_digits[(unsigned char)*run_end >> 4];
+            escape[5] = hex_digits[(unsigned char)*run_end & 0xF];
+            if (writer_append(writer, escape, sizeof(escape)) != JSONSuccess) {
+                return JSONFailure;
             }
-            written_total += 1;
             break;
         }
+        string = run_end + 1;
+    }
+    APPEND_STRING("\"");
+    return JSONSuccess;
+}
+
+#undef APPEND_STRING
+#undef APPEND_INDENT
+
+static JSON_Value *parse_buffer(JSON_Parser *parser, const char *data, size_t len)
+{
+    size_t i;
+    if (len >= 3 && data[0] == '\xEF' && data[1] == '\xBB' && data[2] == '\xBF') {
+        data = data + 3; /* Support for UTF-8 BOM */
+        len -= 3;
+    }
+    parser->end = data + len;
+    if (parser->paths != NULL) {
+        for (i = 0; i < parser->path_count; i++) {
+            if (parser->paths[i] == NULL) {
+                return NULL;
+            }
+            parser->paths[i]->matched = 0;
+        }
+        SKIP_WHITESPACES(parser, &data);
+        if (CURRENT_CHAR(parser, &data) == '{') {
+            return parse_projected_object(parser, &data, 0);
+        }
+    }
+    return parse_value(parser, &data, 0);
+}
+
+static JSON_Value *parse_buffer_in_arena(JSON_Parser *parser, const char *data, size_t len)
+{
+    JSON_Arena *arena = parser->arena;
+    JSON_Arena_Block *start_block = arena->blocks, *block = NULL;
+    size_t start_used = start_block->used;
+    JSON_Value *result = parse_buffer(parser, data, len);
+    if (result == NULL) { /* roll the arena back to where the parse started */
+        while (arena->blocks != start_block) {
+            block = arena->blocks;
+            arena->blocks = block->next;
+            parson_free(block);
+        }
+        start_block->used = start_used;
+        arena->last_allocation = NULL;
+    }
+    return result;
+}
+
+/* Parser API */
+JSON_Value *json_parse_string(const char *string)
+{
+    if (string == NULL) {
+        return NULL;
+    }
+    return json_parse_buffer(string, strlen(string));
+}
+
+JSON_Value *json_parse_buffer(const char *data, size_t len)
+{
+    JSON_Parser parser = {NULL, NULL, 0, NULL, 0};
+    if (data == NULL) {
+        return NULL;
+    }
+    return parse_buffer(&parser, data, len);
+}
+
+JSON_Status json_parse_buffer_sax(const char *data, size_t len, const JSON_SAX_Handler *handler,
+                                  void *context)
+{
+    char string_buffer[PARSON_SAX_STRING_SIZE];
+    JSON_SAX_Parser sax;
+    if (data == NULL || handler == NULL) {
+        return JSONFailure;
+    }
+    if (len >= 3 && data[0] == '\xEF' && data[1] == '\xBB' && data[2] == '\xBF') {
+        data = data + 3; /* Support for UTF-8 BOM */
+        len -= 3;
+    }
+    sax.parser.end = data + len;
+    sax.parser.arena = NULL;
+    sax.parser.is_in_situ = 0;
+    sax.parser.paths = NULL;
+    sax.parser.path_count = 0;
+    sax.handler = handler;
+    sax.context = context;
+    sax.string_buffer = string_buffer;
+    sax.string_buffer_size = sizeof(string_buffer);
+    return sax_parse_value(&sax, &data, 0);
+}
+
+JSON_Push_Parser *json_push_parser_create(void)
+{
+    JSON_Push_Parser *push = push_parser_create(&push_dom_handler, NULL);
+    if (push != NULL) {
+        push->context = push;
+    }
+    return push;
+}
+
+JSON_Push_Parser *json_push_parser_create_sax(const JSON_SAX_Handler *handler, void *context)
+{
+    if (handler == NULL) {
+        return NULL;
+    }
+    return push_parser_create(handler, context);
+}
+
+JSON_Status json_push_parser_feed(JSON_Push_Parser *parser, const char *data, size_t len)
+{
+    if (parser == NULL || (data == NULL && len > 0) || parser->is_failed) {
+        return JSONFailure;
+    }
+    if (push_parse_chunk(parser, data, data + len) != JSONSuccess) {
+        parser->is_failed = 1;
+        return JSONFailure;
+    }
+    return JSONSuccess;
+}
+
+JSON_Status json_push_parser_finish(JSON_Push_Parser *parser)
+{
+    JSON_Buffer *token = NULL;
+    if (parser == NULL || parser->is_failed) {
+        return JSONFailure;
+    }
+    token = parser->token;
+    if (parser->token_kind == PUSH_TOKEN_NUMBER) { /* ended by the end of the input */
+        parser->token_kind = PUSH_TOKEN_NONE;
+        if (push_number_done(parser, token->data, token->data + token->length) != JSONSuccess) {
+            parser->is_failed = 1;
+        }
+    }
+    if (parser->token_kind != PUSH_TOKEN_NONE || parser->state != PUSH_DONE) {
+        parser->is_failed = 1;
+    }
+    return parser->is_failed ? JSONFailure : JSONSuccess;
+}
+
+JSON_Value *json_push_parser_take_value(JSON_Push_Parser *parser)
+{
+    JSON_Value *value = NULL;
+    if (parser == NULL || parser->is_failed || parser->state != PUSH_DONE) {
+        return NULL;
+    }
+    value = parser->root;
+    parser->root = NULL;
+    return value;
+}
+
+void json_push_parser_reset(JSON_Push_Parser *parser)
+{
+    if (parser == NULL) {
+        return;
+    }
+    parser->state = PUSH_VALUE;
+    parser->token_kind = PUSH_TOKEN_NONE;
+    json_buffer_clear(parser->token);
+    parser->is_name = 0;
+    parser->is_escaped = 0;
+    parser->literal = NULL;
+    parser->literal_len = 0;
+    parser->literal_matched = 0;
+    parser->depth = 0;
+    parser->is_started = 0;
+    parser->is_failed = 0;
+    json_value_free(parser->root);
+    parser->root = NULL;
+    parser->current = NULL;
+    node_free_string(parser->name);
+    parser->name = NULL;
+}
+
+void json_push_parser_free(JSON_Push_Parser *parser)
+{
+    if (parser == NULL) {
+        return;
+    }
+    json_value_free(parser->root);
+    node_free_string(parser->name);
+    json_buffer_free(parser->token);
+    parson_free(parser->containers);
+    parson_free(parser);
+}
+
+JSON_Value *json_parse_buffer_projected(const char *data, size_t len, JSON_Path *const *paths,
+                                        size_t path_count)
+{
+    JSON_Parser parser = {NULL, NULL, 0, NULL, 0};
+    if (data == NULL || paths == NULL) {
+        return NULL;
+    }
+    parser.paths = paths;
+    parser.path_count = path_count;
+    return parse_buffer(&parser, data, len);
+}
+
+JSON_Value *json_parse_buffer_projected_in_arena(const char *data, size_t len,
+                                                 JSON_Path *const *paths, size_t path_count,
+                                                 JSON_Arena *arena)
+{
+    JSON_Parser parser = {NULL, NULL, 0, NULL, 0};
+    if (data == NULL || paths == NULL || arena == NULL) {
+        return NULL;
+    }
+    parser.arena = arena;
+    parser.paths = paths;
+    parser.path_count = path_count;
+    return parse_buffer_in_arena(&parser, data, len);
+}
+
+JSON_Tape *json_parse_buffer_to_tape(const char *data, size_t len)
+{
+    JSON_Tape_Parser tape_parser;
+    JSON_Tape *tape = NULL;
+    size_t entry_count = 0, number_count = 0, strings_size = 0;
+    if (data == NULL) {
+        return NULL;
+    }
+    if (len >= 3 && data[0] == '\xEF' && data[1] == '\xBB' && data[2] == '\xBF') {
+        data = data + 3; /* Support for UTF-8 BOM */
+        len -= 3;
+    }
+    tape_parser.parser.end = data + len;
+    tape_parser.parser.arena = NULL;
+    tape_parser.parser.is_in_situ = 0;
+    tape_parser.parser.paths = NULL;
+    tape_parser.parser.path_count = 0;
+    SKIP_WHITESPACES(&tape_parser.parser, &data);
+    if (tape_measure(&tape_parser.parser, data, &entry_count, &number_count, &strings_size) !=
+        JSONSuccess) {
+        return NULL;
+    }
+    tape = (JSON_Tape *)parson_malloc(TAPE_HEADER_SIZE + number_count * sizeof(double) +
+                                      entry_count * sizeof(JSON_Tape_Entry) + strings_size);
+    if (tape == NULL) {
+        return NULL;
+    }
+    tape->numbers = (double *)((char *)tape + TAPE_HEADER_SIZE);
+    tape->number_count = 0;
+    tape->entries = (JSON_Tape_Entry *)(tape->numbers + number_count);
+    tape->entry_count = 0;
+    tape->strings = (char *)(tape->entries + entry_count);
+    tape->strings_size = 0;
+    tape_parser.tape = tape;
+    tape_parser.entry_capacity = entry_count;
+    tape_parser.number_capacity = number_count;
+    tape_parser.strings_capacity = strings_size;
+    if (tape_append(&tape_parser, TAPE_ROOT, 0) != JSONSuccess ||
+        tape_parse_value(&tape_parser, &data, 0) != JSONSuccess) {
+        parson_free(tape);
+        return NULL;
+    }
+    tape->entries[0].payload = (unsigned int)tape->entry_count;
+    return tape;
+}
+
+void json_tape_free(JSON_Tape *tape)
+{
+    parson_free(tape);
+}
+
+size_t json_tape_get_root(const JSON_Tape *tape)
+{
+    return tape != NULL ? 1 : 0;
+}
+
+JSON_Value_Type json_tape_get_type(const JSON_Tape *tape, size_t value)
+{
+    if (tape == NULL || value >= tape->entry_count) {
+        return JSONError;
+    }
+    switch (TAPE_TAG(tape->entries[value])) { /* the root, names and ends aren't values */
+    case TAPE_OBJECT:
+        return JSONObject;
+    case TAPE_ARRAY:
+        return JSONArray;
+    case TAPE_STRING:
+        return JSONString;
+    case TAPE_NUMBER:
+        return JSONNumber;
+    case TAPE_TRUE:
+    case TAPE_FALSE:
+        return JSONBoolean;
+    case TAPE_NULL:
+        return JSONNull;
+    default:
+        return JSONError;
+    }
+}
+
+size_t json_tape_get_count(const JSON_Tape *tape, size_t value)
+{
+    size_t count = 0, i = 0;
+    JSON_Value_Type type = json_tape_get_type(tape, value);
+    if (type != JSONObject && type != JSONArray) {
+        return 0;
+    }
+    count = tape->entries[value].tag >> TAPE_COUNT_SHIFT;
+    if (count < TAPE_MAX_COUNT) {
+        return count;
+    }
+    count = 0;
+    for (i = json_tape_get_first(tape, value); i != 0; i = json_tape_get_next(tape, i)) {
+        count++;
+    }
+    return count;
+}
+
+size_t json_tape_get_first(const JSON_Tape *tape, size_t value)
+{
+    if (tape == NULL || value >= tape->entry_count) {
+        return 0;
+    }
+    switch (TAPE_TAG(tape->entries[value])) {
+    case TAPE_OBJECT:
+        return TAPE_TAG(tape->entries[value + 1]) == TAPE_NAME ? value + 2 : 0;
+    case TAPE_ARRAY:
+        return TAPE_TAG(tape->entries[value + 1]) != TAPE_ARRAY_END ? value + 1 : 0;
+    default:
+        return 0;
+    }
+}
+
+size_t json_tape_get_next(const JSON_Tape *tape, size_t value)
+{
+    size_t next = 0;
+    if (tape_get_entry(tape, value) == NULL) {
+        return 0;
+    }
+    next = tape_skip(tape, value);
+    if (next >= tape->entry_count) { /* the root has no next */
+        return 0;
+    }
+    switch (TAPE_TAG(tape->entries[next])) {
+    case TAPE_NAME:
+        return next + 1;
+    case TAPE_OBJECT_END:
+    case TAPE_ARRAY_END:
+        return 0;
+    default:
+        return next;
+    }
+}
+
+const char *json_tape_get_name(const JSON_Tape *tape, size_t value)
+{
+    size_t len = 0;
+    if (tape_get_entry(tape, value) == NULL || TAPE_TAG(tape->entries[value - 1]) != TAPE_NAME) {
+        return NULL;
+    }
+    return tape_get_string(tape, tape->entries[value - 1].payload, &len);
+}
+
+size_t json_tape_object_get_value(const JSON_Tape *tape, size_t object, const char *name)
+{
+    size_t i = 0, name_len = 0, member_len = 0;
+    const char *member_name = NULL;
+    if (json_tape_get_type(tape, object) != JSONObject || name == NULL) {
+        return 0;
+    }
+    name_len = strlen(name);
+    for (i = object + 1; TAPE_TAG(tape->entries[i]) == TAPE_NAME; i = tape_skip(tape, i + 1)) {
+        member_name = tape_get_string(tape, tape->entries[i].payload, &member_len);
+        if (member_len == name_len && memcmp(member_name, name, name_len) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+size_t json_tape_array_get_value(const JSON_Tape *tape, size_t array, size_t index)
+{
+    size_t i = 0;
+    if (json_tape_get_type(tape, array) != JSONArray) {
+        return 0;
+    }
+    for (i = array + 1; TAPE_TAG(tape->entries[i]) != TAPE_ARRAY_END; i = tape_skip(tape, i)) {
+        if (index == 0) {
+            return i;
+        }
+        index--;
     }
-    APPEND_STRING("\"");
-    return written_total;
+    return 0;
 }
 
-static int append_indent(char *buf, int level)
+const char *json_tape_get_string(const JSON_Tape *tape, size_t value)
 {
-    int i;
-    int written = -1, written_total = 0;
-    for (i = 0; i < level; i++) {
-        APPEND_STRING("    ");
+    size_t len = 0;
+    if (json_tape_get_type(tape, value) != JSONString) {
+        return NULL;
     }
-    return written_total;
+    return tape_get_string(tape, tape->entries[value].payload, &len);
 }
 
-static int append_string(char *buf, const char *string)
+size_t json_tape_get_string_len(const JSON_Tape *tape, size_t value)
 {
-    if (buf == NULL) {
-        return (int)strlen(string);
+    size_t len = 0;
+    if (json_tape_get_type(tape, value) != JSONString) {
+        return 0;
     }
-    return sprintf(buf, "%s", string);
+    tape_get_string(tape, tape->entries[value].payload, &len);
+    return len;
 }
 
-#undef APPEND_STRING
-#undef APPEND_INDENT
+double json_tape_get_number(const JSON_Tape *tape, size_t value)
+{
+    if (json_tape_get_type(tape, value) != JSONNumber) {
+        return 0;
+    }
+    return tape->numbers[tape->entries[value].payload];
+}
 
-/* Parser API */
-JSON_Value *json_parse_string(const char *string)
+int json_tape_get_boolean(const JSON_Tape *tape, size_t value)
 {
-    if (string == NULL) {
-        return NULL;
+    if (json_tape_get_type(tape, value) != JSONBoolean) {
+        return -1;
     }
-    if (string[0] == '\xEF' && string[1] == '\xBB' && string[2] == '\xBF') {
-        string = string + 3; /* Support for UTF-8 BOM */
+    return TAPE_TAG(tape->entries[value]) == TAPE_TRUE;
+}
+
+JSON_Value *json_tape_to_value(const JSON_Tape *tape, size_t value)
+{
+    if (tape_get_entry(tape, value) == NULL) {
+        return NULL;
     }
-    return parse_value((const char **)&string, 0);
+    return tape_to_value(tape, value);
 }
 
 JSON_Value *json_parse_string_with_comments(const char *string)
 {
+    JSON_Parser parser = {NULL, NULL, 0, NULL, 0};
     JSON_Value *result = NULL;
     char *string_mutable_copy = NULL, *string_mutable_copy_ptr = NULL;
     string_mutable_copy = parson_strdup(string);
@@ -1236,11 +4070,110 @@ JSON_Value *json_parse_string_with_comments(const char *string)
     remove_comments(string_mutable_copy, "/*", "*/");
     remove_comments(string_mutable_copy, "//", "\n");
     string_mutable_copy_ptr = string_mutable_copy;
-    result = parse_value((const char **)&string_mutable_copy_ptr, 0);
+    parser.end = string_mutable_copy + strlen(string_mutable_copy);
+    result = parse_value(&parser, (const char **)&string_mutable_copy_ptr, 0);
     parson_free(string_mutable_copy);
     return result;
 }
 
+JSON_Value *json_parse_string_in_arena(const char *string, JSON_Arena *arena)
+{
+    if (string == NULL) {
+        return NULL;
+    }
+    return json_parse_buffer_in_arena(string, strlen(string), arena);
+}
+
+JSON_Value *json_parse_buffer_in_arena(const char *data, size_t len, JSON_Arena *arena)
+{
+    JSON_Parser parser = {NULL, NULL, 0, NULL, 0};
+    if (data == NULL || arena == NULL) {
+        return NULL;
+    }
+    parser.arena = arena;
+    return parse_buffer_in_arena(&parser, data, len);
+}
+
+JSON_Value *json_parse_buffer_in_situ(char *data, size_t len, JSON_Arena *arena)
+{
+    JSON_Parser parser = {NULL, NULL, 1, NULL, 0};
+    if (data == NULL || arena == NULL) {
+        return NULL;
+    }
+    parser.arena = arena;
+    return parse_buffer_in_arena(&parser, data, len);
+}
+
+/* JSON Arena API */
+JSON_Arena *json_arena_create(size_t size)
+{
+    JSON_Arena *arena = (JSON_Arena *)parson_malloc(sizeof(JSON_Arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->blocks = NULL;
+    arena->last_allocation = NULL;
+    if (json_arena_add_block(arena, ARENA_ALIGN(size == 0 ? ARENA_DEFAULT_SIZE : size)) == NULL) {
+        parson_free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void json_arena_reset(JSON_Arena *arena)
+{
+    JSON_Arena_Block *first = NULL, *block = NULL, *next = NULL;
+    size_t total_size = 0;
+    if (arena == NULL) {
+        return;
+    }
+    first = arena->blocks;
+    if (first->next != NULL) { /* coalesce the chain into a single block */
+        for (block = arena->blocks; block != NULL; block = block->next) {
+            total_size += block->size;
+            first = block;
+        }
+        for (block = arena->blocks; block != first; block = next) {
+            next = block->next;
+            parson_free(block);
+        }
+        arena->blocks = NULL;
+        if (json_arena_add_block(arena, total_size) != NULL) {
+            parson_free(first);
+        } else { /* keep the original block */
+            arena->blocks = first;
+        }
+    }
+    arena->blocks->used = 0;
+    arena->last_allocation = NULL;
+}
+
+void json_arena_free(JSON_Arena *arena)
+{
+    JSON_Arena_Block *block = NULL, *next = NULL;
+    if (arena == NULL) {
+        return;
+    }
+    for (block = arena->blocks; block != NULL; block = next) {
+        next = block->next;
+        parson_free(block);
+    }
+    parson_free(arena);
+}
+
+size_t json_arena_get_used(const JSON_Arena *arena)
+{
+    const JSON_Arena_Block *block = NULL;
+    size_t used = 0;
+    if (arena == NULL) {
+        return 0;
+    }
+    for (block = arena->blocks; block != NULL; block = block->next) {
+        used += block->used;
+    }
+    return used;
+}
+
 /* JSON Object API */
 
 JSON_Value *json_object_get_value(const JSON_Object *object, const char *name)
@@ -1312,6 +4245,143 @@ int json_object_dotget_boolean(const JSON_Object *object, const char *name)
     return json_value_get_boolean(json_object_dotget_value(object, name));
 }
 
+/* Compiled paths */
+/* Returns the array index that a JSON Pointer segment spells, or PATH_NOT_AN_INDEX */
+static size_t path_parse_index(const char *name, size_t name_len)
+{
+    size_t i, index = 0;
+    if (name_len == 0 || (name[0] == '0' && name_len > 1)) {
+        return PATH_NOT_AN_INDEX;
+    }
+    for (i = 0; i < name_len; i++) {
+        if (name[i] < '0' || name[i] > '9' || index > (PATH_NOT_AN_INDEX - 9) / 10) {
+            return PATH_NOT_AN_INDEX;
+        }
+        index = index * 10 + (size_t)(name[i] - '0');
+    }
+    return index;
+}
+
+JSON_Path *json_path_compile(const char *path)
+{
+    JSON_Path *compiled = NULL;
+    JSON_Path_Segment *segment = NULL;
+    size_t segment_count = 1, path_len = 0, i = 0;
+    char separator = '.', *names = NULL, *name = NULL;
+    int is_pointer = 0;
+    if (path == NULL) {
+        return NULL;
+    }
+    if (path[0] == '/') { /* JSON Pointer (RFC 6901) */
+        is_pointer = 1;
+        separator = '/';
+        path++;
+    }
+    path_len = strlen(path);
+    for (i = 0; i < path_len; i++) {
+        segment_count += path[i] == separator;
+    }
+    /* One allocation holds the path, then the segments, then the names */
+    compiled = (JSON_Path *)parson_malloc(sizeof(JSON_Path) +
+                                          segment_count * sizeof(JSON_Path_Segment) + path_len + 1);
+    if (compiled == NULL) {
+        return NULL;
+    }
+    compiled->segments = (JSON_Path_Segment *)(compiled + 1);
+    compiled->segment_count = segment_count;
+    names = (char *)(compiled->segments + segment_count);
+    segment = compiled->segments;
+    segment->name = names;
+    name = names;
+    for (i = 0; i <= path_len; i++) {
+        if (i < path_len && path[i] != separator) {
+            if (is_pointer && path[i] == '~' && (path[i + 1] == '0' || path[i + 1] == '1')) {
+                *name++ = path[i + 1] == '0' ? '~' : '/';
+                i++;
+            } else {
+                *name++ = path[i];
+            }
+            continue;
+        }
+        segment->name_len = (size_t)(name - segment->name);
+        segment->hash = hash_string(segment->name, segment->name_len);
+        segment->index =
+            is_pointer ? path_parse_index(segment->name, segment->name_len) : PATH_NOT_AN_INDEX;
+        segment->hint = 0;
+        *name++ = '\0';
+        if (i < path_len) {
+            segment++;
+            segment->name = name;
+        }
+    }
+    return compiled;
+}
+
+void json_path_free(JSON_Path *path)
+{
+    parson_free(path);
+}
+
+JSON_Value *json_path_get_value(JSON_Path *path, const JSON_Value *value)
+{
+    JSON_Path_Segment *segment = NULL, *segments_end = NULL;
+    const JSON_Object *object = NULL;
+    size_t i = 0;
+    if (path == NULL) {
+        return NULL;
+    }
+    segments_end = path->segments + path->segment_count;
+    for (segment = path->segments; segment < segments_end && value != NULL; segment++) {
+        if (json_value_get_type(value) == JSONArray) {
+            value = segment->index != PATH_NOT_AN_INDEX
+                        ? json_array_get_value(json_value_get_array(value), segment->index)
+                        : NULL;
+            continue;
+        }
+        object = json_value_get_object(value);
+        if (object == NULL) {
+            return NULL;
+        }
+        i = segment->hint; /* documents of the same shape have the name at the same index */
+        if (i >= object->count ||
+            strncmp(object->entries[i].name, segment->name, segment->name_len) != 0 ||
+            object->entries[i].name[segment->name_len] != '\0') {
+            i = json_object_find_hashed(object, segment->name, segment->name_len, segment->hash);
+            if (i >= object->count) {
+                return NULL;
+            }
+            segment->hint = i;
+        }
+        value = object->entries[i].value;
+    }
+    return (JSON_Value *)value;
+}
+
+const char *json_path_get_string(JSON_Path *path, const JSON_Value *value)
+{
+    return json_value_get_string(json_path_get_value(path, value));
+}
+
+double json_path_get_number(JSON_Path *path, const JSON_Value *value)
+{
+    return json_value_get_number(json_path_get_value(path, value));
+}
+
+JSON_Object *json_path_get_object(JSON_Path *path, const JSON_Value *value)
+{
+    return json_value_get_object(json_path_get_value(path, value));
+}
+
+JSON_Array *json_path_get_array(JSON_Path *path, const JSON_Value *value)
+{
+    return json_value_get_array(json_path_get_value(path, value));
+}
+
+int json_path_get_boolean(JSON_Path *path, const JSON_Value *value)
+{
+    return json_value_get_boolean(json_path_get_value(path, value));
+}
+
 size_t json_object_get_count(const JSON_Object *object)
 {
     return object ? object->count : 0;
@@ -1322,7 +4392,7 @@ const char *json_object_get_name(const JSON_Object *object, size_t index)
     if (object == NULL || index >= json_object_get_count(object)) {
         return NULL;
     }
-    return object->names[index];
+    return object->entries[index].name;
 }
 
 JSON_Value *json_object_get_value_at(const JSON_Object *object, size_t index)
@@ -1330,12 +4400,12 @@ JSON_Value *json_object_get_value_at(const JSON_Object *object, size_t index)
     if (object == NULL || index >= json_object_get_count(object)) {
         return NULL;
     }
-    return object->values[index];
+    return object->entries[index].value;
 }
 
 JSON_Value *json_object_get_wrapping_value(const JSON_Object *object)
 {
-    return object->wrapping_value;
+    return object ? object->wrapping_value : NULL;
 }
 
 int json_object_has_value(const JSON_Object *object, const char *name)
@@ -1402,7 +4472,7 @@ size_t json_array_get_count(const JSON_Array *array)
 
 JSON_Value *json_array_get_wrapping_value(const JSON_Array *array)
 {
-    return array->wrapping_value;
+    return array ? array->wrapping_value : NULL;
 }
 
 /* JSON Value API */
@@ -1441,60 +4511,76 @@ JSON_Value *json_value_get_parent(const JSON_Value *value)
     return value ? value->parent : NULL;
 }
 
+JSON_Status json_value_set_number_precision(JSON_Value *value, int significant_digits)
+{
+    JSON_Value_Type type = json_value_get_type(value);
+    if ((type != JSONNumber && type != JSONObject && type != JSONArray) ||
+        significant_digits < 0 || significant_digits > MAX_NUMBER_PRECISION) {
+        return JSONFailure;
+    }
+    value->precision = (unsigned char)significant_digits;
+    return JSONSuccess;
+}
+
+int json_value_get_number_precision(const JSON_Value *value)
+{
+    return value ? value->precision : 0;
+}
+
 void json_value_free(JSON_Value *value)
 {
+    size_t size = sizeof(JSON_Value);
+    if (IS_SHARED_VALUE(value)) {
+        return;
+    }
     switch (json_value_get_type(value)) {
     case JSONObject:
         json_object_free(value->value.object);
-        break;
-    case JSONString:
-        parson_free(value->value.string);
+        size += sizeof(JSON_Object);
         break;
     case JSONArray:
         json_array_free(value->value.array);
+        size += sizeof(JSON_Array);
+        break;
+    case JSONString:
+        size += strlen(value->value.string) + 1;
         break;
     default:
         break;
     }
-    parson_free(value);
+    node_free(value, size);
 }
 
 JSON_Value *json_value_init_object(void)
 {
-    JSON_Value *new_value = (JSON_Value *)parson_malloc(sizeof(JSON_Value));
+    JSON_Value *new_value = (JSON_Value *)node_malloc(sizeof(JSON_Value) + sizeof(JSON_Object));
     if (!new_value) {
         return NULL;
     }
     new_value->parent = NULL;
+    new_value->precision = 0;
     new_value->type = JSONObject;
-    new_value->value.object = json_object_init(new_value);
-    if (!new_value->value.object) {
-        parson_free(new_value);
-        return NULL;
-    }
+    new_value->value.object = (JSON_Object *)VALUE_TAIL(new_value);
+    json_object_init(new_value->value.object, new_value);
     return new_value;
 }
 
 JSON_Value *json_value_init_array(void)
 {
-    JSON_Value *new_value = (JSON_Value *)parson_malloc(sizeof(JSON_Value));
+    JSON_Value *new_value = (JSON_Value *)node_malloc(sizeof(JSON_Value) + sizeof(JSON_Array));
     if (!new_value) {
         return NULL;
     }
     new_value->parent = NULL;
+    new_value->precision = 0;
     new_value->type = JSONArray;
-    new_value->value.array = json_array_init(new_value);
-    if (!new_value->value.array) {
-        parson_free(new_value);
-        return NULL;
-    }
+    new_value->value.array = (JSON_Array *)VALUE_TAIL(new_value);
+    json_array_init(new_value->value.array, new_value);
     return new_value;
 }
 
 JSON_Value *json_value_init_string(const char *string)
 {
-    char *copy = NULL;
-    JSON_Value *value;
     size_t string_len = 0;
     if (string == NULL) {
         return NULL;
@@ -1503,15 +4589,7 @@ JSON_Value *json_value_init_string(const char *string)
     if (!is_valid_utf8(string, string_len)) {
         return NULL;
     }
-    copy = parson_strndup(string, string_len);
-    if (copy == NULL) {
-        return NULL;
-    }
-    value = json_value_init_string_no_copy(copy);
-    if (value == NULL) {
-        parson_free(copy);
-    }
-    return value;
+    return json_value_init_stringn(string, string_len);
 }
 
 JSON_Value *json_value_init_number(double number)
@@ -1520,11 +4598,12 @@ JSON_Value *json_value_init_number(double number)
     if ((number * 0.0) != 0.0) { /* nan and inf test */
         return NULL;
     }
-    new_value = (JSON_Value *)parson_malloc(sizeof(JSON_Value));
+    new_value = (JSON_Value *)node_malloc(sizeof(JSON_Value));
     if (new_value == NULL) {
         return NULL;
     }
     new_value->parent = NULL;
+    new_value->precision = 0;
     new_value->type = JSONNumber;
     new_value->value.number = number;
     return new_value;
@@ -1532,25 +4611,12 @@ JSON_Value *json_value_init_number(double number)
 
 JSON_Value *json_value_init_boolean(int boolean)
 {
-    JSON_Value *new_value = (JSON_Value *)parson_malloc(sizeof(JSON_Value));
-    if (!new_value) {
-        return NULL;
-    }
-    new_value->parent = NULL;
-    new_value->type = JSONBoolean;
-    new_value->value.boolean = boolean ? 1 : 0;
-    return new_value;
+    return boolean ? &json_true_value : &json_false_value;
 }
 
 JSON_Value *json_value_init_null(void)
 {
-    JSON_Value *new_value = (JSON_Value *)parson_malloc(sizeof(JSON_Value));
-    if (!new_value) {
-        return NULL;
-    }
-    new_value->parent = NULL;
-    new_value->type = JSONNull;
-    return new_value;
+    return &json_null_value;
 }
 
 JSON_Value *json_value_deep_copy(const JSON_Value *value)
@@ -1558,7 +4624,6 @@ JSON_Value *json_value_deep_copy(const JSON_Value *value)
     size_t i = 0;
     JSON_Value *return_value = NULL, *temp_value_copy = NULL, *temp_value = NULL;
     const char *temp_string = NULL, *temp_key = NULL;
-    char *temp_string_copy = NULL;
     JSON_Array *temp_array = NULL, *temp_array_copy = NULL;
     JSON_Object *temp_object = NULL, *temp_object_copy = NULL;
 
@@ -1569,6 +4634,7 @@ JSON_Value *json_value_deep_copy(const JSON_Value *value)
         if (return_value == NULL) {
             return NULL;
         }
+        return_value->precision = value->precision;
         temp_array_copy = json_value_get_array(return_value);
         for (i = 0; i < json_array_get_count(temp_array); i++) {
             temp_value = json_array_get_value(temp_array, i);
@@ -1590,6 +4656,7 @@ JSON_Value *json_value_deep_copy(const JSON_Value *value)
         if (return_value == NULL) {
             return NULL;
         }
+        return_value->precision = value->precision;
         temp_object_copy = json_value_get_object(return_value);
         for (i = 0; i < json_object_get_count(temp_object); i++) {
             temp_key = json_object_get_name(temp_object, i);
@@ -1609,21 +4676,17 @@ JSON_Value *json_value_deep_copy(const JSON_Value *value)
     case JSONBoolean:
         return json_value_init_boolean(json_value_get_boolean(value));
     case JSONNumber:
-        return json_value_init_number(json_value_get_number(value));
+        return_value = json_value_init_number(json_value_get_number(value));
+        if (return_value != NULL) {
+            return_value->precision = value->precision;
+        }
+        return return_value;
     case JSONString:
         temp_string = json_value_get_string(value);
         if (temp_string == NULL) {
             return NULL;
         }
-        temp_string_copy = parson_strdup(temp_string);
-        if (temp_string_copy == NULL) {
-            return NULL;
-        }
-        return_value = json_value_init_string_no_copy(temp_string_copy);
-        if (return_value == NULL) {
-            parson_free(temp_string_copy);
-        }
-        return return_value;
+        return json_value_init_stringn(temp_string, strlen(temp_string));
     case JSONNull:
         return json_value_init_null();
     case JSONError:
@@ -1633,89 +4696,212 @@ JSON_Value *json_value_deep_copy(const JSON_Value *value)
     }
 }
 
-size_t json_serialization_size(const JSON_Value *value)
+static size_t serialization_size(const JSON_Value *value, int is_pretty)
 {
-    char num_buf[NUM_BUF_SIZE]; /* recursively allocating buffer on stack is a bad idea, so let's do
-                                   it only once */
-    int res = json_serialize_to_buffer_r(value, NULL, 0, 0, num_buf);
-    return res < 0 ? 0 : (size_t)(res + 1);
+    char chunk[WRITER_CHUNK_SIZE];
+    JSON_Writer writer;
+    writer_init(&writer, WRITER_COUNT, chunk, chunk + sizeof(chunk));
+    if (json_serialize_to_writer_r(value, &writer, 0, is_pretty, 0) != JSONSuccess ||
+        writer_finish(&writer) != JSONSuccess) {
+        return 0;
+    }
+    return writer.count + 1;
 }
 
-JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes)
+static JSON_Status serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes,
+                                       int is_pretty)
 {
-    int written = -1;
-    size_t needed_size_in_bytes = json_serialization_size(value);
-    if (needed_size_in_bytes == 0 || buf_size_in_bytes < needed_size_in_bytes) {
+    JSON_Writer writer;
+    if (buf == NULL || buf_size_in_bytes == 0) {
         return JSONFailure;
     }
-    written = json_serialize_to_buffer_r(value, buf, 0, 0, NULL);
-    if (written < 0) {
+    writer_init(&writer, WRITER_FIXED, buf, buf + buf_size_in_bytes - 1); /* room for the NUL */
+    if (json_serialize_to_writer_r(value, &writer, 0, is_pretty, 0) != JSONSuccess) {
         return JSONFailure;
     }
-    return JSONSuccess;
+    return writer_finish(&writer);
 }
 
-char *json_serialize_to_string(const JSON_Value *value)
+static char *serialize_to_string(const JSON_Value *value, int is_pretty)
 {
-    JSON_Status serialization_result = JSONFailure;
-    size_t buf_size_bytes = json_serialization_size(value);
-    char *buf = NULL;
-    if (buf_size_bytes == 0) {
-        return NULL;
-    }
-    buf = (char *)parson_malloc(buf_size_bytes);
-    if (buf == NULL) {
+    JSON_Buffer buffer;
+    buffer.data = (char *)parson_malloc(BUFFER_DEFAULT_CAPACITY);
+    if (buffer.data == NULL) {
         return NULL;
     }
-    serialization_result = json_serialize_to_buffer(value, buf, buf_size_bytes);
-    if (serialization_result == JSONFailure) {
-        json_free_serialized_string(buf);
+    buffer.data[0] = '\0';
+    buffer.length = 0;
+    buffer.capacity = BUFFER_DEFAULT_CAPACITY;
+    if (serialize_to_writer(value, json_buffer_write, &buffer, is_pretty) != JSONSuccess) {
+        parson_free(buffer.data);
         return NULL;
     }
-    return buf;
+    return buffer.data;
 }
 
-size_t json_serialization_size_pretty(const JSON_Value *value)
+static JSON_Status serialize_to_writer(const JSON_Value *value, JSON_Write_Function write_fun,
+                                       void *context, int is_pretty)
 {
-    char num_buf[NUM_BUF_SIZE]; /* recursively allocating buffer on stack is a bad idea, so let's do
-                                   it only once */
-    int res = json_serialize_to_buffer_r(value, NULL, 0, 1, num_buf);
-    return res < 0 ? 0 : (size_t)(res + 1);
+    char chunk[WRITER_CHUNK_SIZE];
+    JSON_Writer writer;
+    JSON_Buffer *buffer = (JSON_Buffer *)context;
+    size_t start_length = 0;
+    if (write_fun == NULL) {
+        return JSONFailure;
+    }
+    if (write_fun == json_buffer_write) { /* write into the buffer directly */
+        if (buffer == NULL) {
+            return JSONFailure;
+        }
+        start_length = buffer->length;
+        writer_init(&writer, WRITER_BUFFER, buffer->data + buffer->length,
+                    buffer->data + buffer->capacity - 1);
+        writer.buffer = buffer;
+    } else {
+        writer_init(&writer, WRITER_FUNCTION, chunk, chunk + sizeof(chunk));
+        writer.write_fun = write_fun;
+        writer.context = context;
+    }
+    if (json_serialize_to_writer_r(value, &writer, 0, is_pretty, 0) != JSONSuccess ||
+        writer_finish(&writer) != JSONSuccess) {
+        if (writer.kind == WRITER_BUFFER) { /* leave the buffer as it was */
+            buffer->length = start_length;
+            buffer->data[start_length] = '\0';
+        }
+        return JSONFailure;
+    }
+    return JSONSuccess;
 }
 
-JSON_Status json_serialize_to_buffer_pretty(const JSON_Value *value, char *buf,
-                                            size_t buf_size_in_bytes)
+static JSON_Status json_buffer_reserve(JSON_Buffer *buffer, size_t n)
 {
-    int written = -1;
-    size_t needed_size_in_bytes = json_serialization_size_pretty(value);
-    if (needed_size_in_bytes == 0 || buf_size_in_bytes < needed_size_in_bytes) {
+    size_t new_capacity = buffer->capacity * 2;
+    char *new_data = NULL;
+    if (buffer->capacity - buffer->length > n) {
+        return JSONSuccess;
+    }
+    if (n >= (size_t)-1 / 2 - buffer->length) {
         return JSONFailure;
     }
-    written = json_serialize_to_buffer_r(value, buf, 0, 1, NULL);
-    if (written < 0) {
+    if (new_capacity < buffer->length + n + 1) {
+        new_capacity = buffer->length + n + 1;
+    }
+    new_data = (char *)parson_malloc(new_capacity);
+    if (new_data == NULL) {
         return JSONFailure;
     }
+    memcpy(new_data, buffer->data, buffer->length + 1);
+    parson_free(buffer->data);
+    buffer->data = new_data;
+    buffer->capacity = new_capacity;
     return JSONSuccess;
 }
 
+size_t json_serialization_size(const JSON_Value *value)
+{
+    return serialization_size(value, 0);
+}
+
+JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes)
+{
+    return serialize_to_buffer(value, buf, buf_size_in_bytes, 0);
+}
+
+char *json_serialize_to_string(const JSON_Value *value)
+{
+    return serialize_to_string(value, 0);
+}
+
+size_t json_serialization_size_pretty(const JSON_Value *value)
+{
+    return serialization_size(value, 1);
+}
+
+JSON_Status json_serialize_to_buffer_pretty(const JSON_Value *value, char *buf,
+                                            size_t buf_size_in_bytes)
+{
+    return serialize_to_buffer(value, buf, buf_size_in_bytes, 1);
+}
+
 char *json_serialize_to_string_pretty(const JSON_Value *value)
 {
-    JSON_Status serialization_result = JSONFailure;
-    size_t buf_size_bytes = json_serialization_size_pretty(value);
-    char *buf = NULL;
-    if (buf_size_bytes == 0) {
-        return NULL;
+    return serialize_to_string(value, 1);
+}
+
+JSON_Status json_serialize_to_writer(const JSON_Value *value, JSON_Write_Function write_fun,
+                                     void *context)
+{
+    return serialize_to_writer(value, write_fun, context, 0);
+}
+
+JSON_Status json_serialize_to_writer_pretty(const JSON_Value *value, JSON_Write_Function write_fun,
+                                            void *context)
+{
+    return serialize_to_writer(value, write_fun, context, 1);
+}
+
+JSON_Buffer *json_buffer_create(size_t capacity)
+{
+    JSON_Buffer *buffer = NULL;
+    if (capacity == 0) {
+        capacity = BUFFER_DEFAULT_CAPACITY;
     }
-    buf = (char *)parson_malloc(buf_size_bytes);
-    if (buf == NULL) {
+    buffer = (JSON_Buffer *)parson_malloc(sizeof(JSON_Buffer));
+    if (buffer == NULL) {
         return NULL;
     }
-    serialization_result = json_serialize_to_buffer_pretty(value, buf, buf_size_bytes);
-    if (serialization_result == JSONFailure) {
-        json_free_serialized_string(buf);
+    buffer->data = (char *)parson_malloc(capacity);
+    if (buffer->data == NULL) {
+        parson_free(buffer);
         return NULL;
     }
-    return buf;
+    buffer->data[0] = '\0';
+    buffer->length = 0;
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+JSON_Status json_buffer_write(void *buffer, const char *data, size_t len)
+{
+    JSON_Buffer *json_buffer = (JSON_Buffer *)buffer;
+    if (json_buffer == NULL || (data == NULL && len > 0) ||
+        json_buffer_reserve(json_buffer, len) != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (len > 0) {
+        memcpy(json_buffer->data + json_buffer->length, data, len);
+    }
+    json_buffer->length += len;
+    json_buffer->data[json_buffer->length] = '\0';
+    return JSONSuccess;
+}
+
+const char *json_buffer_get_data(const JSON_Buffer *buffer)
+{
+    return buffer ? buffer->data : NULL;
+}
+
+size_t json_buffer_get_length(const JSON_Buffer *buffer)
+{
+    return buffer ? buffer->length : 0;
+}
+
+void json_buffer_clear(JSON_Buffer *buffer)
+{
+    if (buffer == NULL) {
+        return;
+    }
+    buffer->length = 0;
+    buffer->data[0] = '\0';
+}
+
+void json_buffer_free(JSON_Buffer *buffer)
+{
+    if (buffer == NULL) {
+        return;
+    }
+    parson_free(buffer->data);
+    parson_free(buffer);
 }
 
 void json_free_serialized_string(char *string)
@@ -1743,7 +4929,7 @@ JSON_Status json_array_replace_value(JSON_Array *array, size_t ix, JSON_Value *v
         return JSONFailure;
     }
     json_value_free(json_array_get_value(array, ix));
-    value->parent = json_array_get_wrapping_value(array);
+    json_value_set_parent(value, json_array_get_wrapping_value(array));
     array->items[ix] = value;
     return JSONSuccess;
 }
@@ -1876,20 +5062,15 @@ JSON_Status json_array_append_null(JSON_Array *array)
 JSON_Status json_object_set_value(JSON_Object *object, const char *name, JSON_Value *value)
 {
     size_t i = 0;
-    JSON_Value *old_value;
     if (object == NULL || name == NULL || value == NULL || value->parent != NULL) {
         return JSONFailure;
     }
-    old_value = json_object_get_value(object, name);
-    if (old_value != NULL) { /* free and overwrite old value */
-        json_value_free(old_value);
-        for (i = 0; i < json_object_get_count(object); i++) {
-            if (strcmp(object->names[i], name) == 0) {
-                value->parent = json_object_get_wrapping_value(object);
-                object->values[i] = value;
-                return JSONSuccess;
-            }
-        }
+    i = json_object_find(object, name, strlen(name));
+    if (i < object->count) { /* free and overwrite old value */
+        json_value_free(object->entries[i].value);
+        json_value_set_parent(value, json_object_get_wrapping_value(object));
+        object->entries[i].value = value;
+        return JSONSuccess;
     }
     /* add new key value pair */
     return json_object_add(object, name, value);
@@ -2028,10 +5209,13 @@ JSON_Status json_object_clear(JSON_Object *object)
         return JSONFailure;
     }
     for (i = 0; i < json_object_get_count(object); i++) {
-        parson_free(object->names[i]);
-        json_value_free(object->values[i]);
+        node_free_string(object->entries[i].name);
+        json_value_free(object->entries[i].value);
     }
     object->count = 0;
+    for (i = 0; i < object->slot_count; i++) {
+        object->slots[i].index = 0;
+    }
     return JSONSuccess;
 }
 
@@ -2197,6 +5381,23 @@ int json_boolean(const JSON_Value *value)
 
 void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Function free_fun)
 {
+    node_cache_trim(0); /* cached blocks came from the previous malloc_fun */
     parson_malloc = malloc_fun;
     parson_free = free_fun;
 }
+
+void json_set_node_cache_limit(size_t max_bytes)
+{
+    node_cache_limit = max_bytes;
+    node_cache_trim(max_bytes);
+}
+
+void json_node_cache_trim(void)
+{
+    node_cache_trim(0);
+}
+
+size_t json_node_cache_get_size(void)
+{
+    return node_cache_size;
+}
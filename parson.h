@@ -41,6 +41,11 @@ extern "C" {
 typedef struct json_object_t JSON_Object;
 typedef struct json_array_t JSON_Array;
 typedef struct json_value_t JSON_Value;
+typedef struct json_arena_t JSON_Arena;
+typedef struct json_buffer_t JSON_Buffer;
+typedef struct json_push_parser_t JSON_Push_Parser;
+typedef struct json_path_t JSON_Path;
+typedef struct json_tape_t JSON_Tape;
 
 enum json_value_type {
     JSONError = -1,
@@ -58,19 +63,151 @@ typedef int JSON_Status;
 
 typedef void *(*JSON_Malloc_Function)(size_t);
 typedef void (*JSON_Free_Function)(void *);
+/* Receives len bytes of serialized output; returns JSONFailure to stop serialization */
+typedef JSON_Status (*JSON_Write_Function)(void *context, const char *data, size_t len);
 
 /* Call only once, before calling any other function from parson API. If not called, malloc and free
    from stdlib will be used for all allocations */
 void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Function free_fun);
 
+/* Node cache
+   Values, names, and the small arrays behind objects and arrays that json_value_free and the
+   other functions release can be kept on per-size free lists, so that documents parsed and freed
+   over and over reuse the same memory and, once the lists are warm, don't call the allocation
+   functions. The cache is shared by the whole library and isn't thread-safe, so it is disabled
+   (a limit of 0) by default. */
+/* Sets the most bytes the cache may hold, freeing cached memory beyond it */
+void json_set_node_cache_limit(size_t max_bytes);
+/* Frees all cached memory; the limit stays */
+void json_node_cache_trim(void);
+size_t json_node_cache_get_size(void);
+
 /*  Parses first JSON value in a string, returns NULL in case of error */
 JSON_Value *json_parse_string(const char *string);
 
+/*  Parses first JSON value in the first len bytes of data, which needn't be NUL-terminated,
+    returns NULL in case of error */
+JSON_Value *json_parse_buffer(const char *data, size_t len);
+
 /*  Parses first JSON value in a string and ignores comments (/ * * / and //),
     returns NULL in case of error */
 JSON_Value *json_parse_string_with_comments(const char *string);
 
-/* Serialization */
+/* Arena parsing
+   An arena is a chain of memory blocks from which all values, names and strings of a parsed
+   document are bump-allocated, so parsing calls the allocation functions only when a block runs
+   out, and all documents parsed into the arena are released at once by json_arena_reset or
+   json_arena_free. When a reset finds more than one block, the blocks are replaced by a single
+   block of their combined size, so an arena reused for similar documents settles on one block.
+   Values parsed into an arena stay valid until the arena is reset or freed. They are read-only:
+   neither they nor values inside them may be passed to json_value_free or to functions that add,
+   replace or remove values. Use json_value_deep_copy to get a value that can be changed.
+   An arena must not be used from more than one thread at a time. */
+JSON_Arena *json_arena_create(size_t size); /* size of the first block in bytes, 0 for default,
+                                               returns NULL on fail */
+void json_arena_reset(JSON_Arena *arena);
+void json_arena_free(JSON_Arena *arena);
+size_t json_arena_get_used(const JSON_Arena *arena); /* bytes allocated since the last reset */
+
+/*  Parses first JSON value in a string into an arena, returns NULL in case of error. Nothing is
+    left allocated in the arena after an error. */
+JSON_Value *json_parse_string_in_arena(const char *string, JSON_Arena *arena);
+JSON_Value *json_parse_buffer_in_arena(const char *data, size_t len, JSON_Arena *arena);
+
+/*  In situ parsing: like json_parse_buffer_in_arena, but strings and names are decoded in place
+    inside data, which the returned value points into instead of copying them to the arena.
+    data is modified whether or not the parse succeeds. The value is valid only as long as both
+    the arena isn't reset or freed and data is neither freed nor modified. */
+JSON_Value *json_parse_buffer_in_situ(char *data, size_t len, JSON_Arena *arena);
+
+/*  Projection parsing
+    Builds only the parts of the first JSON value in data that compiled paths (see
+    json_path_compile) lead to: the value at the end of each path whole, and the objects on the
+    way to it. The paths then find the same values in the result as in a full parse, while
+    everything else is skipped without being built. An array on a path is built whole, so that
+    its indices stay the same. Skipped values are only checked for terminated strings and
+    balanced brackets. Like lookups, a projection parse updates the paths it uses, so a path must
+    not be used from two threads at once. */
+JSON_Value *json_parse_buffer_projected(const char *data, size_t len, JSON_Path *const *paths,
+                                        size_t path_count);
+JSON_Value *json_parse_buffer_projected_in_arena(const char *data, size_t len,
+                                                 JSON_Path *const *paths, size_t path_count,
+                                                 JSON_Arena *arena);
+
+/*  Event-driven (SAX) parsing
+    Reports the first JSON value in data as a series of callbacks instead of building values, in
+    one pass and without allocating memory (only a number longer than 63 characters is copied to
+    the heap for strtod). Any callback may be NULL. A callback that returns JSONFailure stops the
+    parse, which then fails; events already reported stay reported.
+    Names and strings are passed with their length and aren't NUL-terminated. Those without
+    escapes point into data; others are decoded into a buffer of PARSON_SAX_STRING_SIZE bytes (512
+    by default) on the stack, and a longer escaped string fails the parse. Either way the pointer
+    is valid only during the callback. */
+typedef struct json_sax_handler_t {
+    JSON_Status (*start_object)(void *context);
+    JSON_Status (*end_object)(void *context);
+    JSON_Status (*start_array)(void *context);
+    JSON_Status (*end_array)(void *context);
+    JSON_Status (*name)(void *context, const char *name, size_t name_len);
+    JSON_Status (*string)(void *context, const char *string, size_t len);
+    JSON_Status (*number)(void *context, double number);
+    JSON_Status (*boolean)(void *context, int boolean);
+    JSON_Status (*null)(void *context);
+} JSON_SAX_Handler;
+
+JSON_Status json_parse_buffer_sax(const char *data, size_t len, const JSON_SAX_Handler *handler,
+                                  void *context);
+
+/*  Push parsing
+    Parses the first JSON value in input that arrives in chunks of any size, e.g. as it is read
+    from a file or a socket. Tokens may be split between chunks. A push parser either builds a
+    value or reports SAX events, which then come as soon as each token is complete; names and
+    strings are always decoded, so their length isn't limited. Besides a built value, the parser
+    only holds a byte per level of nesting and the longest token that was split or had escapes.
+    json_push_parser_feed fails as soon as the input can't be valid or a callback fails, and
+    then keeps failing until the parser is reset. Input after the first value is ignored.
+    json_push_parser_finish tells the parser the input has ended (a number at the top level
+    can't be complete before that) and fails if the value is incomplete. */
+JSON_Push_Parser *json_push_parser_create(void); /* builds a value, returns NULL on fail */
+JSON_Push_Parser *json_push_parser_create_sax(const JSON_SAX_Handler *handler, void *context);
+JSON_Status json_push_parser_feed(JSON_Push_Parser *parser, const char *data, size_t len);
+JSON_Status json_push_parser_finish(JSON_Push_Parser *parser);
+/* Returns the built value after a successful finish, and hands it over to the caller, who frees
+   it with json_value_free. Returns NULL if there is no value (anymore). */
+JSON_Value *json_push_parser_take_value(JSON_Push_Parser *parser);
+void json_push_parser_reset(JSON_Push_Parser *parser); /* to parse another document */
+void json_push_parser_free(JSON_Push_Parser *parser);
+
+/*  Tape parsing
+    Parses the first JSON value in data into a read-only tape: a single allocation holding an
+    entry per value, name and end of an object or array in document order, with the numbers and
+    decoded strings beside them. A tape is quicker to build and to walk than values and keeps
+    them close together, but can't be modified; json_tape_to_value copies a part of it into
+    values that can. Values in a tape are referred to by index, where 0 means no value.
+    Lookups by name or index walk the members or items before the one they find, since a tape
+    has no hash index. Names aren't checked for duplicates: a lookup finds the first, and
+    json_tape_to_value fails for an object with duplicate names, as json_parse_buffer does. */
+JSON_Tape *json_parse_buffer_to_tape(const char *data, size_t len); /* returns NULL on fail */
+void json_tape_free(JSON_Tape *tape);
+size_t json_tape_get_root(const JSON_Tape *tape);
+JSON_Value_Type json_tape_get_type(const JSON_Tape *tape, size_t value);
+size_t json_tape_get_count(const JSON_Tape *tape, size_t value); /* members or items */
+/* Walk an object or array: json_tape_get_first returns its first member or item, and
+   json_tape_get_next the one after value, or 0 after the last. */
+size_t json_tape_get_first(const JSON_Tape *tape, size_t value);
+size_t json_tape_get_next(const JSON_Tape *tape, size_t value);
+const char *json_tape_get_name(const JSON_Tape *tape, size_t value); /* NULL if not a member */
+size_t json_tape_object_get_value(const JSON_Tape *tape, size_t object, const char *name);
+size_t json_tape_array_get_value(const JSON_Tape *tape, size_t array, size_t index);
+const char *json_tape_get_string(const JSON_Tape *tape, size_t value); /* NUL-terminated */
+size_t json_tape_get_string_len(const JSON_Tape *tape, size_t value);
+double json_tape_get_number(const JSON_Tape *tape, size_t value); /* returns 0 on fail */
+int json_tape_get_boolean(const JSON_Tape *tape, size_t value);   /* returns -1 on fail */
+JSON_Value *json_tape_to_value(const JSON_Tape *tape, size_t value); /* returns NULL on fail */
+
+/* Serialization
+   All serialization renders the document in a single pass. json_serialize_to_buffer fails, after
+   writing part of the output, when buf is too small. */
 size_t json_serialization_size(const JSON_Value *value); /* returns 0 on fail */
 JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes);
 char *json_serialize_to_string(const JSON_Value *value);
@@ -84,6 +221,26 @@ char *json_serialize_to_string_pretty(const JSON_Value *value);
 void json_free_serialized_string(char *string); /* frees string from json_serialize_to_string and
                                                    json_serialize_to_string_pretty */
 
+/* Streaming serialization
+   Hands the output to write_fun in pieces of up to a few hundred bytes as it is rendered, e.g. to
+   write it to a file descriptor. The output isn't NUL-terminated. */
+JSON_Status json_serialize_to_writer(const JSON_Value *value, JSON_Write_Function write_fun,
+                                     void *context);
+JSON_Status json_serialize_to_writer_pretty(const JSON_Value *value, JSON_Write_Function write_fun,
+                                            void *context);
+
+/* Growable output buffer
+   Serializing with json_buffer_write as the write function and a buffer as the context appends
+   the output to the buffer, written in place. A buffer that is cleared and reused, e.g. for each
+   message, allocates only while it grows. On failure the buffer keeps its previous contents. */
+JSON_Buffer *json_buffer_create(size_t capacity); /* bytes to start with, 0 for default,
+                                                     returns NULL on fail */
+JSON_Status json_buffer_write(void *buffer, const char *data, size_t len);
+const char *json_buffer_get_data(const JSON_Buffer *buffer); /* NUL-terminated */
+size_t json_buffer_get_length(const JSON_Buffer *buffer);
+void json_buffer_clear(JSON_Buffer *buffer);
+void json_buffer_free(JSON_Buffer *buffer);
+
 /* Comparing */
 int json_value_equals(const JSON_Value *a, const JSON_Value *b);
 
@@ -122,6 +279,22 @@ double json_object_dotget_number(const JSON_Object *object,
 int json_object_dotget_boolean(const JSON_Object *object,
                                const char *name); /* returns -1 on fail */
 
+/* Compiled paths split a path once, so that looking it up in many documents doesn't have to.
+ A path is either in dot notation, like dotget names, or a JSON Pointer (RFC 6901) when it starts
+ with '/', e.g. "/desired/sensors/0/name", whose segments may also select array items. Each
+ segment remembers where it last found its name, so documents of the same shape are looked up
+ with one comparison per level. That makes a path unsafe to use from two threads at once, but it
+ may be used with any number of documents. */
+JSON_Path *json_path_compile(const char *path); /* returns NULL on fail */
+void json_path_free(JSON_Path *path);
+
+JSON_Value *json_path_get_value(JSON_Path *path, const JSON_Value *value);
+const char *json_path_get_string(JSON_Path *path, const JSON_Value *value);
+JSON_Object *json_path_get_object(JSON_Path *path, const JSON_Value *value);
+JSON_Array *json_path_get_array(JSON_Path *path, const JSON_Value *value);
+double json_path_get_number(JSON_Path *path, const JSON_Value *value); /* returns 0 on fail */
+int json_path_get_boolean(JSON_Path *path, const JSON_Value *value);   /* returns -1 on fail */
+
 /* Functions to get available names */
 size_t json_object_get_count(const JSON_Object *object);
 const char *json_object_get_name(const JSON_Object *object, size_t index);
@@ -206,6 +379,8 @@ JSON_Value *json_value_init_object(void);
 JSON_Value *json_value_init_array(void);
 JSON_Value *json_value_init_string(const char *string); /* copies passed string */
 JSON_Value *json_value_init_number(double number);
+/* Values of null, true and false are shared and immutable: they never have a parent, and
+   json_value_free does nothing to them */
 JSON_Value *json_value_init_boolean(int boolean);
 JSON_Value *json_value_init_null(void);
 JSON_Value *json_value_deep_copy(const JSON_Value *value);
@@ -219,6 +394,13 @@ double json_value_get_number(const JSON_Value *value);
 int json_value_get_boolean(const JSON_Value *value);
 JSON_Value *json_value_get_parent(const JSON_Value *value);
 
+/* Numbers are serialized in the shortest form that parses back to the same double. Setting a
+   precision of 1 to 17 significant digits on a number, object or array rounds the numbers in it
+   to that many digits instead, e.g. to the resolution of a sensor; a precision set on a nested
+   value takes priority. 0 restores the default. */
+JSON_Status json_value_set_number_precision(JSON_Value *value, int significant_digits);
+int json_value_get_number_precision(const JSON_Value *value);
+
 /* Same as above, but shorter */
 JSON_Value_Type json_type(const JSON_Value *value);
 JSON_Object *json_object(const JSON_Value *value);
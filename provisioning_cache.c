@@ -0,0 +1,123 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdint.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "provisioning_cache.h"
+
+// The cache is a single record:
+//   magic (4), scope ID length (1), hostname length (1), reserved (2), CRC-32 (4),
+//   scope ID, hostname
+// The CRC covers the lengths and both strings. Neither string is NUL-terminated.
+#define CACHE_MAGIC 0x31435044u // "DPC1"
+#define CACHE_HEADER_SIZE 12
+#define MAX_STRING_LENGTH 255
+
+static uint32_t GetUint32(const uint8_t *in)
+{
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) |
+           ((uint32_t)in[3] << 24);
+}
+
+static void PutUint32(uint8_t *out, uint32_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)(value >> 16);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t ComputeCacheCrc(const uint8_t *record)
+{
+    size_t stringsLength = (size_t)record[4] + record[5];
+    uint32_t crc = UpdateCrc32(CRC32_INITIAL_VALUE, record + 4, 4);
+    return ~UpdateCrc32(crc, record + CACHE_HEADER_SIZE, stringsLength);
+}
+
+static int WriteRecord(int fd, off_t offset, const uint8_t *record, size_t length)
+{
+    ssize_t result = pwrite(fd, record, length, offset);
+    if (result < 0) {
+        return -1;
+    }
+    if ((size_t)result != length) {
+        errno = EIO;
+        return -1;
+    }
+    return fsync(fd);
+}
+
+int ReadProvisioningCache(int fd, off_t offset, const char *scopeId, char *hostName,
+                          size_t hostNameSize)
+{
+    uint8_t record[PROVISIONING_CACHE_SIZE];
+    ssize_t result = pread(fd, record, sizeof(record), offset);
+    if (result < 0) {
+        return -1;
+    }
+
+    if ((size_t)result < CACHE_HEADER_SIZE || GetUint32(record) != CACHE_MAGIC) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    size_t scopeIdLength = record[4];
+    size_t hostNameLength = record[5];
+    if ((size_t)result < CACHE_HEADER_SIZE + scopeIdLength + hostNameLength ||
+        GetUint32(record + 8) != ComputeCacheCrc(record)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    const char *cachedScopeId = (const char *)record + CACHE_HEADER_SIZE;
+    const char *cachedHostName = cachedScopeId + scopeIdLength;
+    if (strlen(scopeId) != scopeIdLength || memcmp(scopeId, cachedScopeId, scopeIdLength) != 0 ||
+        hostNameLength == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (hostNameLength >= hostNameSize) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    memcpy(hostName, cachedHostName, hostNameLength);
+    hostName[hostNameLength] = '\0';
+    return 0;
+}
+
+int WriteProvisioningCache(int fd, off_t offset, const char *scopeId, const char *hostName)
+{
+    uint8_t record[PROVISIONING_CACHE_SIZE];
+    size_t scopeIdLength = strlen(scopeId);
+    size_t hostNameLength = strlen(hostName);
+    size_t recordLength = CACHE_HEADER_SIZE + scopeIdLength + hostNameLength;
+    if (scopeIdLength > MAX_STRING_LENGTH || hostNameLength > MAX_STRING_LENGTH ||
+        recordLength > sizeof(record)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PutUint32(record, CACHE_MAGIC);
+    record[4] = (uint8_t)scopeIdLength;
+    record[5] = (uint8_t)hostNameLength;
+    record[6] = 0;
+    record[7] = 0;
+    memcpy(record + CACHE_HEADER_SIZE, scopeId, scopeIdLength);
+    memcpy(record + CACHE_HEADER_SIZE + scopeIdLength, hostName, hostNameLength);
+    PutUint32(record + 8, ComputeCacheCrc(record));
+
+    return WriteRecord(fd, offset, record, recordLength);
+}
+
+int ClearProvisioningCache(int fd, off_t offset)
+{
+    uint8_t header[CACHE_HEADER_SIZE] = {0};
+    return WriteRecord(fd, offset, header, sizeof(header));
+}
@@ -0,0 +1,45 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+#include <stddef.h>
+
+#include <sys/types.h>
+
+/// <summary>
+/// Number of bytes of the file used by the provisioning cache.
+/// </summary>
+#define PROVISIONING_CACHE_SIZE 512
+
+/// <summary>
+/// Read the IoT Hub hostname which the Device Provisioning Service assigned to this device,
+/// as saved by <see cref="WriteProvisioningCache" />.
+/// </summary>
+/// <param name="fd">File descriptor opened for reading, such as the one returned by
+/// Storage_OpenMutableFile.</param>
+/// <param name="offset">Offset of the cache within the file.</param>
+/// <param name="scopeId">DPS ID scope. A hostname cached for a different scope is ignored.</param>
+/// <param name="hostName">Receives the NUL-terminated hostname.</param>
+/// <param name="hostNameSize">Size of hostName in bytes.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.
+/// ENOENT indicates that no valid hostname is cached for scopeId.</returns>
+int ReadProvisioningCache(int fd, off_t offset, const char *scopeId, char *hostName,
+                          size_t hostNameSize);
+
+/// <summary>
+/// Save the IoT Hub hostname assigned by the Device Provisioning Service.
+/// </summary>
+/// <param name="fd">File descriptor opened for writing.</param>
+/// <param name="offset">Offset of the cache within the file.</param>
+/// <param name="scopeId">DPS ID scope used for provisioning.</param>
+/// <param name="hostName">Assigned IoT Hub hostname.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.</returns>
+int WriteProvisioningCache(int fd, off_t offset, const char *scopeId, const char *hostName);
+
+/// <summary>
+/// Invalidate the cached hostname, so that the device is provisioned again.
+/// </summary>
+/// <param name="fd">File descriptor opened for writing.</param>
+/// <param name="offset">Offset of the cache within the file.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.</returns>
+int ClearProvisioningCache(int fd, off_t offset);
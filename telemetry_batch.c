@@ -0,0 +1,153 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "telemetry_batch.h"
+
+// Longest "{"timestamp":<uint64>" prefix, including the NUL terminator.
+#define TIMESTAMP_PREFIX_SIZE 40
+
+struct TelemetryBatch {
+    TelemetryBatchFlushHandler handler;
+    char *buffer;
+    size_t capacity; // usable bytes in buffer, excluding the NUL terminator
+    size_t maxBytes;
+    size_t maxSamples;
+    size_t length;
+    size_t count;
+};
+
+TelemetryBatch *CreateTelemetryBatch(size_t capacityBytes, TelemetryBatchFlushHandler handler)
+{
+    // Room for at least "[]" is required.
+    if (handler == NULL || capacityBytes < 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    TelemetryBatch *batch = malloc(sizeof(TelemetryBatch));
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    batch->buffer = malloc(capacityBytes + 1);
+    if (batch->buffer == NULL) {
+        free(batch);
+        return NULL;
+    }
+
+    batch->handler = handler;
+    batch->capacity = capacityBytes;
+    batch->maxBytes = capacityBytes;
+    batch->maxSamples = 1;
+    batch->length = 0;
+    batch->count = 0;
+
+    return batch;
+}
+
+void DisposeTelemetryBatch(TelemetryBatch *batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+
+    free(batch->buffer);
+    free(batch);
+}
+
+int SetTelemetryBatchLimits(TelemetryBatch *batch, size_t maxSamples, size_t maxBytes)
+{
+    if (maxSamples == 0 || maxBytes < 2) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    batch->maxSamples = maxSamples;
+    batch->maxBytes = maxBytes < batch->capacity ? maxBytes : batch->capacity;
+
+    // Account for the closing ']' when checking the current contents against the budget.
+    if (batch->count >= batch->maxSamples || batch->length + 1 > batch->maxBytes) {
+        FlushTelemetryBatch(batch);
+    }
+
+    return 0;
+}
+
+int AddTelemetryBatchSample(TelemetryBatch *batch, const char *sampleJson, uint64_t timestampMs)
+{
+    size_t sampleLength = strlen(sampleJson);
+    if (sampleLength < 2 || sampleJson[0] != '{' || sampleJson[sampleLength - 1] != '}') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char prefix[TIMESTAMP_PREFIX_SIZE];
+    int prefixLength = snprintf(prefix, sizeof(prefix), "{\"timestamp\":%" PRIu64, timestampMs);
+    if (prefixLength < 0 || (size_t)prefixLength >= sizeof(prefix)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The sample's own opening brace is replaced by the prefix. An empty object contributes
+    // only its closing brace; otherwise a separating comma is needed.
+    bool isEmptySample = sampleLength == 2;
+    const char *members = sampleJson + 1;
+    size_t membersLength = sampleLength - 1;
+    size_t elementLength = (size_t)prefixLength + (isEmptySample ? 0 : 1) + membersLength;
+
+    // '[' or ',' before the element, and ']' reserved for the flush.
+    if (batch->length + 1 + elementLength + 1 > batch->maxBytes) {
+        FlushTelemetryBatch(batch);
+        if (1 + elementLength + 1 > batch->maxBytes) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+
+    char *out = batch->buffer + batch->length;
+    *out++ = batch->count == 0 ? '[' : ',';
+    memcpy(out, prefix, (size_t)prefixLength);
+    out += prefixLength;
+    if (!isEmptySample) {
+        *out++ = ',';
+    }
+    memcpy(out, members, membersLength);
+    out += membersLength;
+
+    batch->length = (size_t)(out - batch->buffer);
+    batch->count++;
+
+    if (batch->count >= batch->maxSamples) {
+        FlushTelemetryBatch(batch);
+    }
+
+    return 0;
+}
+
+void FlushTelemetryBatch(TelemetryBatch *batch)
+{
+    if (batch->count == 0) {
+        return;
+    }
+
+    batch->buffer[batch->length++] = ']';
+    batch->buffer[batch->length] = '\0';
+
+    batch->handler(batch->buffer, batch->length, batch->count);
+
+    batch->length = 0;
+    batch->count = 0;
+}
+
+size_t GetTelemetryBatchSampleCount(const TelemetryBatch *batch)
+{
+    return batch->count;
+}
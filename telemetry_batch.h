@@ -0,0 +1,80 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+/// Opaque handle. Obtain via <see cref="CreateTelemetryBatch" /> and dispose of via
+/// <see cref="DisposeTelemetryBatch" />.
+/// </summary>
+typedef struct TelemetryBatch TelemetryBatch;
+
+/// <summary>
+/// Applications implement a function with this signature to receive a completed batch.
+/// The batch is a NUL-terminated JSON array of samples, each of which carries a
+/// "timestamp" member (milliseconds since the Unix epoch). The buffer is only valid for
+/// the duration of the call, and the handler must not add samples to the batch.
+/// </summary>
+/// <param name="json">The serialized batch.</param>
+/// <param name="length">Length of the batch in bytes, excluding the NUL terminator.</param>
+/// <param name="sampleCount">Number of samples in the batch.</param>
+typedef void (*TelemetryBatchFlushHandler)(const char *json, size_t length, size_t sampleCount);
+
+/// <summary>
+/// Create a telemetry batch which packs individual JSON object samples into a single
+/// JSON array message.
+/// </summary>
+/// <param name="capacityBytes">Size of the batch buffer. This is the upper bound for
+/// the byte budget passed to <see cref="SetTelemetryBatchLimits" />.</param>
+/// <param name="handler">Callback to invoke when the batch is flushed.</param>
+/// <returns>On success, pointer to new TelemetryBatch, which should be disposed of
+/// with <see cref="DisposeTelemetryBatch" />. On failure, returns NULL, with more
+/// information available in errno.</returns>
+TelemetryBatch *CreateTelemetryBatch(size_t capacityBytes, TelemetryBatchFlushHandler handler);
+
+/// <summary>
+/// Dispose of a batch which was allocated with <see cref="CreateTelemetryBatch" />.
+/// Samples which have not been flushed are discarded.
+/// It is safe to call this function with a NULL pointer.
+/// </summary>
+/// <param name="batch">Successfully allocated batch, or NULL.</param>
+void DisposeTelemetryBatch(TelemetryBatch *batch);
+
+/// <summary>
+/// Change the flush thresholds. The batch is flushed when it holds maxSamples samples or
+/// when the next sample would take the serialized batch over maxBytes. If the batch
+/// currently exceeds the new limits it is flushed immediately.
+/// </summary>
+/// <param name="batch">Successfully allocated batch.</param>
+/// <param name="maxSamples">Maximum number of samples per batch, at least 1.</param>
+/// <param name="maxBytes">Byte budget per batch; clamped to the batch capacity.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.</returns>
+int SetTelemetryBatchLimits(TelemetryBatch *batch, size_t maxSamples, size_t maxBytes);
+
+/// <summary>
+/// Append a sample to the batch. The sample must be a JSON object such as
+/// {"Temperature":21.50}; a "timestamp" member is added in front of its members.
+/// The batch is flushed first if the sample does not fit in the remaining byte budget,
+/// and afterwards if it has reached the sample limit.
+/// </summary>
+/// <param name="batch">Successfully allocated batch.</param>
+/// <param name="sampleJson">The sample, as a NUL-terminated JSON object.</param>
+/// <param name="timestampMs">Sample time in milliseconds since the Unix epoch.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.
+/// EMSGSIZE indicates the sample is too large to ever fit in a batch.</returns>
+int AddTelemetryBatchSample(TelemetryBatch *batch, const char *sampleJson, uint64_t timestampMs);
+
+/// <summary>
+/// Flush the batch, invoking the flush handler if at least one sample is pending.
+/// </summary>
+/// <param name="batch">Successfully allocated batch.</param>
+void FlushTelemetryBatch(TelemetryBatch *batch);
+
+/// <summary>
+/// Get the number of samples waiting in the batch.
+/// </summary>
+/// <param name="batch">Successfully allocated batch.</param>
+/// <returns>The number of pending samples.</returns>
+size_t GetTelemetryBatchSampleCount(const TelemetryBatch *batch);
@@ -0,0 +1,227 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <errno.h>
+#include <string.h>
+
+#include "telemetry_ring_buffer.h"
+
+// Each message is stored as a 16-bit little-endian length followed by the message bytes.
+// A message never straddles the end of the storage: if it does not fit, a wrap marker is
+// written in place of a length (when there is room for one) and the message starts at 0.
+#define RECORD_HEADER_SIZE 2
+#define WRAP_MARKER 0xFFFF
+#define MAX_MESSAGE_LENGTH (WRAP_MARKER - 1)
+#define MAX_DOWNSAMPLE_STRIDE (1u << 15)
+
+static size_t ReadRecordLength(const TelemetryRingBuffer *ring, size_t position)
+{
+    return (size_t)ring->storage[position] | ((size_t)ring->storage[position + 1] << 8);
+}
+
+static void WriteRecordLength(TelemetryRingBuffer *ring, size_t position, size_t length)
+{
+    ring->storage[position] = (uint8_t)(length & 0xFF);
+    ring->storage[position + 1] = (uint8_t)(length >> 8);
+}
+
+// Returns the position of the record at or after the given read position, following a wrap.
+// The head is kept normalized whenever the ring buffer is not empty.
+static size_t NormalizeReadPosition(const TelemetryRingBuffer *ring, size_t position)
+{
+    if (ring->capacity - position < RECORD_HEADER_SIZE ||
+        ReadRecordLength(ring, position) == WRAP_MARKER) {
+        return 0;
+    }
+    return position;
+}
+
+// Returns the position at which a record of recordSize bytes can be written at the
+// given write position, wrapping if necessary, or -1 if it would overwrite unread data.
+static long FindWritePosition(TelemetryRingBuffer *ring, size_t position, size_t readPosition,
+                              size_t recordSize, bool isEmpty)
+{
+    if (isEmpty) {
+        return recordSize <= ring->capacity ? 0 : -1;
+    }
+
+    if (position > readPosition) {
+        if (ring->capacity - position >= recordSize) {
+            return (long)position;
+        }
+        if (readPosition < recordSize) {
+            return -1;
+        }
+        if (ring->capacity - position >= RECORD_HEADER_SIZE) {
+            WriteRecordLength(ring, position, WRAP_MARKER);
+        }
+        return 0;
+    }
+
+    if (position < readPosition && readPosition - position >= recordSize) {
+        return (long)position;
+    }
+
+    return -1;
+}
+
+static void ResetIfEmpty(TelemetryRingBuffer *ring)
+{
+    if (ring->count == 0) {
+        ring->head = 0;
+        ring->tail = 0;
+        ring->usedBytes = 0;
+        ring->downsampleStride = 1;
+        ring->downsampleSkipped = 0;
+    }
+}
+
+// Discards every other message, oldest first, moving the survivors towards the head.
+static void DownsampleRecords(TelemetryRingBuffer *ring)
+{
+    size_t readPosition = ring->head;
+    size_t writePosition = readPosition;
+    size_t originalCount = ring->count;
+
+    ring->count = 0;
+    ring->usedBytes = 0;
+
+    for (size_t i = 0; i < originalCount; i++) {
+        readPosition = NormalizeReadPosition(ring, readPosition);
+        size_t recordSize = RECORD_HEADER_SIZE + ReadRecordLength(ring, readPosition);
+
+        if (i % 2 == 1) {
+            // The write position never passes the read position, so this never overwrites
+            // a record which has not been visited yet.
+            if (ring->capacity - writePosition < recordSize) {
+                if (ring->capacity - writePosition >= RECORD_HEADER_SIZE) {
+                    WriteRecordLength(ring, writePosition, WRAP_MARKER);
+                }
+                writePosition = 0;
+            }
+            memmove(ring->storage + writePosition, ring->storage + readPosition, recordSize);
+            writePosition += recordSize;
+            ring->count++;
+            ring->usedBytes += recordSize;
+        } else {
+            ring->droppedCount++;
+        }
+
+        readPosition += recordSize;
+    }
+
+    ring->tail = writePosition;
+    ring->head = NormalizeReadPosition(ring, ring->head);
+
+    if (ring->downsampleStride < MAX_DOWNSAMPLE_STRIDE) {
+        ring->downsampleStride *= 2;
+    }
+    ring->downsampleSkipped = 0;
+}
+
+void InitTelemetryRingBuffer(TelemetryRingBuffer *ring, void *storage, size_t storageSize,
+                             TelemetryRingBufferOverflowPolicy policy)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->storage = storage;
+    ring->capacity = storageSize;
+    ring->policy = policy;
+    ring->downsampleStride = 1;
+}
+
+void SetTelemetryRingBufferOverflowPolicy(TelemetryRingBuffer *ring,
+                                          TelemetryRingBufferOverflowPolicy policy)
+{
+    ring->policy = policy;
+    if (policy != TelemetryRingBufferOverflow_Downsample) {
+        ring->downsampleStride = 1;
+        ring->downsampleSkipped = 0;
+    }
+}
+
+int PushTelemetryRingBuffer(TelemetryRingBuffer *ring, const void *data, size_t length)
+{
+    size_t recordSize = RECORD_HEADER_SIZE + length;
+    if (length > MAX_MESSAGE_LENGTH || recordSize > ring->capacity) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // While downsampling, only every downsampleStride-th message is kept.
+    if (ring->downsampleStride > 1) {
+        unsigned int sequence = ring->downsampleSkipped++;
+        if (sequence % ring->downsampleStride != 0) {
+            ring->droppedCount++;
+            return 0;
+        }
+    }
+
+    long position;
+    while ((position = FindWritePosition(ring, ring->tail, ring->head, recordSize,
+                                         ring->count == 0)) < 0) {
+        if (ring->policy == TelemetryRingBufferOverflow_Downsample && ring->count > 1) {
+            DownsampleRecords(ring);
+        } else {
+            PopTelemetryRingBuffer(ring);
+            ring->droppedCount++;
+        }
+    }
+
+    WriteRecordLength(ring, (size_t)position, length);
+    memcpy(ring->storage + position + RECORD_HEADER_SIZE, data, length);
+    ring->tail = (size_t)position + recordSize;
+    ring->count++;
+    ring->usedBytes += recordSize;
+
+    if (ring->usedBytes > ring->highWaterMarkBytes) {
+        ring->highWaterMarkBytes = ring->usedBytes;
+    }
+    if (ring->count > ring->highWaterMarkCount) {
+        ring->highWaterMarkCount = ring->count;
+    }
+
+    return 0;
+}
+
+const void *PeekTelemetryRingBuffer(const TelemetryRingBuffer *ring, size_t *length)
+{
+    if (ring->count == 0) {
+        return NULL;
+    }
+
+    *length = ReadRecordLength(ring, ring->head);
+    return ring->storage + ring->head + RECORD_HEADER_SIZE;
+}
+
+void PopTelemetryRingBuffer(TelemetryRingBuffer *ring)
+{
+    if (ring->count == 0) {
+        return;
+    }
+
+    size_t recordSize = RECORD_HEADER_SIZE + ReadRecordLength(ring, ring->head);
+    ring->head += recordSize;
+    ring->count--;
+    ring->usedBytes -= recordSize;
+
+    if (ring->count == 0) {
+        ResetIfEmpty(ring);
+    } else {
+        ring->head = NormalizeReadPosition(ring, ring->head);
+    }
+}
+
+bool IsTelemetryRingBufferEmpty(const TelemetryRingBuffer *ring)
+{
+    return ring->count == 0;
+}
+
+void GetTelemetryRingBufferStats(const TelemetryRingBuffer *ring, TelemetryRingBufferStats *stats)
+{
+    stats->count = ring->count;
+    stats->usedBytes = ring->usedBytes;
+    stats->capacityBytes = ring->capacity;
+    stats->highWaterMarkBytes = ring->highWaterMarkBytes;
+    stats->highWaterMarkCount = ring->highWaterMarkCount;
+    stats->droppedCount = ring->droppedCount;
+}
@@ -0,0 +1,114 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// <summary>
+/// What to do when a message is pushed into a full ring buffer.
+/// </summary>
+typedef enum {
+    /// <summary>Discard the oldest messages until the new one fits.</summary>
+    TelemetryRingBufferOverflow_DropOldest = 0,
+    /// <summary>Discard every other buffered message and from then on keep only every
+    /// n-th pushed message, so the buffer spans the whole outage at a lower rate.</summary>
+    TelemetryRingBufferOverflow_Downsample = 1
+} TelemetryRingBufferOverflowPolicy;
+
+/// <summary>
+/// Fixed-capacity FIFO of variable-length messages stored in caller-provided memory.
+/// The ring buffer never allocates. Treat the members as private; the type is only
+/// declared here so that it can be statically allocated.
+/// </summary>
+typedef struct {
+    uint8_t *storage;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+    size_t count;
+    size_t usedBytes;
+    TelemetryRingBufferOverflowPolicy policy;
+    unsigned int downsampleStride;
+    unsigned int downsampleSkipped;
+    size_t highWaterMarkBytes;
+    size_t highWaterMarkCount;
+    uint32_t droppedCount;
+} TelemetryRingBuffer;
+
+/// <summary>
+/// Occupancy statistics for a ring buffer.
+/// </summary>
+typedef struct {
+    /// <summary>Number of buffered messages.</summary>
+    size_t count;
+    /// <summary>Bytes used by buffered messages, including per-message overhead.</summary>
+    size_t usedBytes;
+    /// <summary>Capacity of the ring buffer storage in bytes.</summary>
+    size_t capacityBytes;
+    /// <summary>Largest value of usedBytes since initialization.</summary>
+    size_t highWaterMarkBytes;
+    /// <summary>Largest value of count since initialization.</summary>
+    size_t highWaterMarkCount;
+    /// <summary>Messages discarded by the overflow policy since initialization.</summary>
+    uint32_t droppedCount;
+} TelemetryRingBufferStats;
+
+/// <summary>
+/// Initialize a ring buffer over the given storage, which must outlive the ring buffer.
+/// </summary>
+/// <param name="ring">Ring buffer to initialize.</param>
+/// <param name="storage">Memory which holds the buffered messages.</param>
+/// <param name="storageSize">Size of storage in bytes.</param>
+/// <param name="policy">Overflow policy.</param>
+void InitTelemetryRingBuffer(TelemetryRingBuffer *ring, void *storage, size_t storageSize,
+                             TelemetryRingBufferOverflowPolicy policy);
+
+/// <summary>
+/// Change the overflow policy. Messages which are already buffered are kept.
+/// </summary>
+/// <param name="ring">Initialized ring buffer.</param>
+/// <param name="policy">New overflow policy.</param>
+void SetTelemetryRingBufferOverflowPolicy(TelemetryRingBuffer *ring,
+                                          TelemetryRingBufferOverflowPolicy policy);
+
+/// <summary>
+/// Copy a message into the ring buffer, applying the overflow policy if it is full.
+/// Under the downsample policy a message may be accepted but intentionally skipped.
+/// </summary>
+/// <param name="ring">Initialized ring buffer.</param>
+/// <param name="data">Message bytes.</param>
+/// <param name="length">Message length in bytes.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.
+/// EMSGSIZE indicates the message can never fit in the ring buffer.</returns>
+int PushTelemetryRingBuffer(TelemetryRingBuffer *ring, const void *data, size_t length);
+
+/// <summary>
+/// Get the oldest buffered message without removing it.
+/// </summary>
+/// <param name="ring">Initialized ring buffer.</param>
+/// <param name="length">Receives the message length in bytes.</param>
+/// <returns>Pointer to the message, valid until the ring buffer is next modified, or NULL
+/// if the ring buffer is empty.</returns>
+const void *PeekTelemetryRingBuffer(const TelemetryRingBuffer *ring, size_t *length);
+
+/// <summary>
+/// Remove the oldest buffered message. Does nothing if the ring buffer is empty.
+/// </summary>
+/// <param name="ring">Initialized ring buffer.</param>
+void PopTelemetryRingBuffer(TelemetryRingBuffer *ring);
+
+/// <summary>
+/// Check whether the ring buffer holds no messages.
+/// </summary>
+/// <param name="ring">Initialized ring buffer.</param>
+/// <returns>true if the ring buffer is empty, false otherwise.</returns>
+bool IsTelemetryRingBufferEmpty(const TelemetryRingBuffer *ring);
+
+/// <summary>
+/// Get occupancy statistics, including the high-water mark.
+/// </summary>
+/// <param name="ring">Initialized ring buffer.</param>
+/// <param name="stats">Receives the statistics.</param>
+void GetTelemetryRingBufferStats(const TelemetryRingBuffer *ring, TelemetryRingBufferStats *stats);
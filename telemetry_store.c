@@ -0,0 +1,654 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "telemetry_store.h"
+
+// The region is split into two segments. Each segment starts with a header:
+//   magic (4), generation (4), first sequence number (4), CRC-32 of the preceding bytes (4)
+// followed by records:
+//   payload length (2), type (1), reserved (1), sequence number (4), CRC-32 (4), payload
+// All integers are little-endian. The record CRC covers the segment generation and first
+// sequence number, the first eight header bytes and the payload, so records left over from
+// an older use of the same segment never validate; a compaction which was interrupted and
+// then retried with the same generation and first sequence number writes identical records.
+// The log ends at the first record which does not validate.
+// The segment with the highest valid generation is the active one. A segment's header is
+// written only after all of its records, so an interrupted compaction leaves the previous
+// segment active.
+#define SEGMENT_MAGIC 0x31514C54u // "TLQ1"
+#define SEGMENT_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 12
+#define RECORD_TYPE_DATA 1
+#define RECORD_TYPE_ACK 2
+#define MAX_RECORD_LENGTH 0xFFFF
+#define WRITE_BUFFER_SIZE 1024
+#define COPY_CHUNK_SIZE 256
+
+struct TelemetryStore {
+    int fd;
+    bool ownsFd;
+    off_t offset;
+    size_t segmentSize;
+    unsigned int activeSegment;
+    uint32_t generation;
+    uint32_t firstSequence;
+    // Offset within the active segment up to which records have been written to the file.
+    size_t flushedOffset;
+    uint8_t writeBuffer[WRITE_BUFFER_SIZE];
+    size_t writeBufferLength;
+    uint32_t lastSequence;
+    uint32_t acknowledgedSequence;
+    // Offset of the replay cursor within the active segment, and the sequence number of the
+    // newest record returned by ReadNextTelemetryStoreRecord.
+    size_t replayOffset;
+    uint32_t replayedSequence;
+    uint32_t compactionCount;
+    uint32_t flushCount;
+    uint64_t bytesWritten;
+    uint64_t payloadBytesAppended;
+};
+
+static void PutUint16(uint8_t *out, uint16_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static void PutUint32(uint8_t *out, uint32_t value)
+{
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)(value >> 16);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+static uint16_t GetUint16(const uint8_t *in)
+{
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static uint32_t GetUint32(const uint8_t *in)
+{
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) |
+           ((uint32_t)in[3] << 24);
+}
+
+static off_t SegmentBase(const TelemetryStore *store, unsigned int segment)
+{
+    return store->offset + (off_t)(segment * store->segmentSize);
+}
+
+// Reads from the file. Bytes beyond the end of the file read as zero.
+static int ReadFromFile(const TelemetryStore *store, off_t position, void *buffer, size_t length)
+{
+    uint8_t *out = buffer;
+    while (length > 0) {
+        ssize_t result = pread(store->fd, out, length, position);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (result == 0) {
+            memset(out, 0, length);
+            return 0;
+        }
+        out += result;
+        position += result;
+        length -= (size_t)result;
+    }
+    return 0;
+}
+
+static int WriteToFile(TelemetryStore *store, off_t position, const void *data, size_t length)
+{
+    const uint8_t *in = data;
+    while (length > 0) {
+        ssize_t result = pwrite(store->fd, in, length, position);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        in += result;
+        position += result;
+        length -= (size_t)result;
+        store->bytesWritten += (uint64_t)result;
+    }
+    return 0;
+}
+
+// Reads bytes of the active segment's log, including those still in the write buffer.
+static int ReadLog(const TelemetryStore *store, size_t position, void *buffer, size_t length)
+{
+    uint8_t *out = buffer;
+    if (position < store->flushedOffset) {
+        size_t fromFile = store->flushedOffset - position;
+        if (fromFile > length) {
+            fromFile = length;
+        }
+        if (ReadFromFile(store, SegmentBase(store, store->activeSegment) + (off_t)position, out,
+                         fromFile) != 0) {
+            return -1;
+        }
+        out += fromFile;
+        position += fromFile;
+        length -= fromFile;
+    }
+    if (length > 0) {
+        memcpy(out, store->writeBuffer + (position - store->flushedOffset), length);
+    }
+    return 0;
+}
+
+static size_t GetLogEnd(const TelemetryStore *store)
+{
+    return store->flushedOffset + store->writeBufferLength;
+}
+
+static int WriteBufferToFile(TelemetryStore *store)
+{
+    if (store->writeBufferLength == 0) {
+        return 0;
+    }
+
+    if (WriteToFile(store,
+                    SegmentBase(store, store->activeSegment) + (off_t)store->flushedOffset,
+                    store->writeBuffer, store->writeBufferLength) != 0) {
+        return -1;
+    }
+
+    store->flushedOffset += store->writeBufferLength;
+    store->writeBufferLength = 0;
+    store->flushCount++;
+    return 0;
+}
+
+// Appends bytes to the log through the write buffer. The caller has checked they fit.
+static int AppendToLog(TelemetryStore *store, const void *data, size_t length)
+{
+    const uint8_t *in = data;
+    while (length > 0) {
+        if (store->writeBufferLength == WRITE_BUFFER_SIZE && WriteBufferToFile(store) != 0) {
+            return -1;
+        }
+        size_t chunk = WRITE_BUFFER_SIZE - store->writeBufferLength;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(store->writeBuffer + store->writeBufferLength, in, chunk);
+        store->writeBufferLength += chunk;
+        in += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+static void EncodeRecordHeader(uint8_t *header, size_t length, uint8_t type, uint32_t sequence)
+{
+    PutUint16(header, (uint16_t)length);
+    header[2] = type;
+    header[3] = 0;
+    PutUint32(header + 4, sequence);
+}
+
+static uint32_t StartRecordCrc(uint32_t generation, uint32_t firstSequence,
+                               const uint8_t *header)
+{
+    uint8_t segmentBytes[8];
+    PutUint32(segmentBytes, generation);
+    PutUint32(segmentBytes + 4, firstSequence);
+    uint32_t crc = UpdateCrc32(CRC32_INITIAL_VALUE, segmentBytes, sizeof(segmentBytes));
+    return UpdateCrc32(crc, header, 8);
+}
+
+static int ReadSegmentHeader(const TelemetryStore *store, unsigned int segment,
+                             uint32_t *generation, uint32_t *firstSequence)
+{
+    uint8_t header[SEGMENT_HEADER_SIZE];
+    if (ReadFromFile(store, SegmentBase(store, segment), header, sizeof(header)) != 0) {
+        return -1;
+    }
+
+    if (GetUint32(header) != SEGMENT_MAGIC ||
+        GetUint32(header + 12) != ~UpdateCrc32(CRC32_INITIAL_VALUE, header, 12)) {
+        return 0;
+    }
+
+    *generation = GetUint32(header + 4);
+    *firstSequence = GetUint32(header + 8);
+    return 1;
+}
+
+static int WriteSegmentHeader(TelemetryStore *store, unsigned int segment, uint32_t generation,
+                              uint32_t firstSequence)
+{
+    uint8_t header[SEGMENT_HEADER_SIZE];
+    PutUint32(header, SEGMENT_MAGIC);
+    PutUint32(header + 4, generation);
+    PutUint32(header + 8, firstSequence);
+    PutUint32(header + 12, ~UpdateCrc32(CRC32_INITIAL_VALUE, header, 12));
+
+    if (WriteToFile(store, SegmentBase(store, segment), header, sizeof(header)) != 0) {
+        return -1;
+    }
+    return fsync(store->fd);
+}
+
+// Reads and validates the record at the given position of the active segment's log.
+// Returns 1 if it is valid, 0 if the log ends there, or -1 on failure.
+static int ReadRecordHeader(const TelemetryStore *store, size_t position, uint8_t *header)
+{
+    size_t end = GetLogEnd(store);
+    if (position + RECORD_HEADER_SIZE > end) {
+        return 0;
+    }
+    if (ReadLog(store, position, header, RECORD_HEADER_SIZE) != 0) {
+        return -1;
+    }
+
+    size_t length = GetUint16(header);
+    if ((header[2] != RECORD_TYPE_DATA && header[2] != RECORD_TYPE_ACK) || header[3] != 0 ||
+        position + RECORD_HEADER_SIZE + length > end) {
+        return 0;
+    }
+    return 1;
+}
+
+// Computes the CRC of a record's payload as stored in the active segment's log.
+static int ComputeStoredRecordCrc(const TelemetryStore *store, size_t position,
+                                  const uint8_t *header, uint32_t *crc)
+{
+    uint8_t chunk[COPY_CHUNK_SIZE];
+    size_t remaining = GetUint16(header);
+    size_t payloadPosition = position + RECORD_HEADER_SIZE;
+
+    *crc = StartRecordCrc(store->generation, store->firstSequence, header);
+    while (remaining > 0) {
+        size_t chunkLength = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+        if (ReadLog(store, payloadPosition, chunk, chunkLength) != 0) {
+            return -1;
+        }
+        *crc = UpdateCrc32(*crc, chunk, chunkLength);
+        payloadPosition += chunkLength;
+        remaining -= chunkLength;
+    }
+    *crc = ~*crc;
+    return 0;
+}
+
+// Scans the active segment from its start, recovering the sequence numbers and the end of
+// the log. Everything from the first record which does not validate onwards is ignored and
+// will be overwritten by subsequent appends.
+static int RecoverActiveSegment(TelemetryStore *store)
+{
+    size_t position = SEGMENT_HEADER_SIZE;
+    uint8_t header[RECORD_HEADER_SIZE];
+
+    store->lastSequence = store->firstSequence - 1;
+    store->acknowledgedSequence = store->firstSequence - 1;
+
+    // Treat the whole segment as flushed while scanning.
+    store->flushedOffset = store->segmentSize;
+    store->writeBufferLength = 0;
+
+    for (;;) {
+        int result = ReadRecordHeader(store, position, header);
+        if (result < 0) {
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+
+        uint32_t crc;
+        if (ComputeStoredRecordCrc(store, position, header, &crc) != 0) {
+            return -1;
+        }
+        if (crc != GetUint32(header + 8)) {
+            break;
+        }
+
+        uint32_t sequence = GetUint32(header + 4);
+        if (header[2] == RECORD_TYPE_DATA) {
+            if (sequence != store->lastSequence + 1) {
+                break;
+            }
+            store->lastSequence = sequence;
+        } else {
+            if (sequence > store->lastSequence) {
+                break;
+            }
+            if (sequence > store->acknowledgedSequence) {
+                store->acknowledgedSequence = sequence;
+            }
+        }
+
+        position += RECORD_HEADER_SIZE + GetUint16(header);
+    }
+
+    store->flushedOffset = position;
+    return 0;
+}
+
+// Copies the unacknowledged records to the other segment and makes it the active one.
+static int CompactTelemetryStore(TelemetryStore *store)
+{
+    if (FlushTelemetryStore(store) != 0) {
+        return -1;
+    }
+
+    unsigned int oldSegment = store->activeSegment;
+    uint32_t oldGeneration = store->generation;
+    uint32_t oldFirstSequence = store->firstSequence;
+    size_t oldEnd = store->flushedOffset;
+    off_t oldBase = SegmentBase(store, oldSegment);
+    uint32_t newGeneration = oldGeneration + 1;
+    uint8_t header[RECORD_HEADER_SIZE];
+    uint8_t chunk[COPY_CHUNK_SIZE];
+
+    store->activeSegment = 1 - oldSegment;
+    store->generation = newGeneration;
+    store->firstSequence = store->acknowledgedSequence + 1;
+    store->flushedOffset = SEGMENT_HEADER_SIZE;
+
+    for (size_t position = SEGMENT_HEADER_SIZE; position < oldEnd;) {
+        if (ReadFromFile(store, oldBase + (off_t)position, header, sizeof(header)) != 0) {
+            goto fail;
+        }
+
+        size_t length = GetUint16(header);
+        uint32_t sequence = GetUint32(header + 4);
+        off_t payloadBase = oldBase + (off_t)(position + RECORD_HEADER_SIZE);
+        position += RECORD_HEADER_SIZE + length;
+
+        if (header[2] != RECORD_TYPE_DATA || sequence <= store->acknowledgedSequence) {
+            continue;
+        }
+
+        // The payload is read twice, first to compute the CRC for the new generation and then
+        // to copy it, so that no record-sized buffer is needed.
+        uint32_t crc = StartRecordCrc(newGeneration, store->firstSequence, header);
+        for (size_t done = 0; done < length;) {
+            size_t chunkLength = length - done < sizeof(chunk) ? length - done : sizeof(chunk);
+            if (ReadFromFile(store, payloadBase + (off_t)done, chunk, chunkLength) != 0) {
+                goto fail;
+            }
+            crc = UpdateCrc32(crc, chunk, chunkLength);
+            done += chunkLength;
+        }
+        PutUint32(header + 8, ~crc);
+
+        if (AppendToLog(store, header, sizeof(header)) != 0) {
+            goto fail;
+        }
+        for (size_t done = 0; done < length;) {
+            size_t chunkLength = length - done < sizeof(chunk) ? length - done : sizeof(chunk);
+            if (ReadFromFile(store, payloadBase + (off_t)done, chunk, chunkLength) != 0 ||
+                AppendToLog(store, chunk, chunkLength) != 0) {
+                goto fail;
+            }
+            done += chunkLength;
+        }
+    }
+
+    if (FlushTelemetryStore(store) != 0 ||
+        WriteSegmentHeader(store, store->activeSegment, newGeneration,
+                           store->firstSequence) != 0) {
+        goto fail;
+    }
+
+    store->compactionCount++;
+    store->replayOffset = SEGMENT_HEADER_SIZE;
+    return 0;
+
+fail:
+    // The old segment is untouched, so carry on using it.
+    store->activeSegment = oldSegment;
+    store->generation = oldGeneration;
+    store->firstSequence = oldFirstSequence;
+    store->flushedOffset = oldEnd;
+    store->writeBufferLength = 0;
+    return -1;
+}
+
+TelemetryStore *OpenTelemetryStore(int fd, off_t offset, size_t size)
+{
+    size_t segmentSize = size / 2;
+    if (fd < 0 || offset < 0 || segmentSize < SEGMENT_HEADER_SIZE + RECORD_HEADER_SIZE + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    TelemetryStore *store = calloc(1, sizeof(TelemetryStore));
+    if (store == NULL) {
+        return NULL;
+    }
+
+    store->fd = fd;
+    store->offset = offset;
+    store->segmentSize = segmentSize;
+
+    uint32_t generation[2];
+    uint32_t firstSequence[2];
+    int valid[2];
+    for (unsigned int segment = 0; segment < 2; segment++) {
+        valid[segment] =
+            ReadSegmentHeader(store, segment, &generation[segment], &firstSequence[segment]);
+        if (valid[segment] < 0) {
+            goto fail;
+        }
+    }
+
+    if (!valid[0] && !valid[1]) {
+        store->activeSegment = 0;
+        store->generation = 1;
+        store->firstSequence = 1;
+        if (WriteSegmentHeader(store, 0, store->generation, store->firstSequence) != 0) {
+            goto fail;
+        }
+        store->flushedOffset = SEGMENT_HEADER_SIZE;
+        store->lastSequence = 0;
+        store->acknowledgedSequence = 0;
+    } else {
+        store->activeSegment = (valid[1] && (!valid[0] || generation[1] > generation[0])) ? 1 : 0;
+        store->generation = generation[store->activeSegment];
+        store->firstSequence = firstSequence[store->activeSegment];
+        if (RecoverActiveSegment(store) != 0) {
+            goto fail;
+        }
+    }
+
+    RewindTelemetryStore(store);
+    return store;
+
+fail:
+    free(store);
+    return NULL;
+}
+
+TelemetryStore *OpenTelemetryStoreFile(const char *path, size_t size)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    TelemetryStore *store = OpenTelemetryStore(fd, 0, size);
+    if (store == NULL) {
+        int openErrno = errno;
+        close(fd);
+        errno = openErrno;
+        return NULL;
+    }
+
+    store->ownsFd = true;
+    return store;
+}
+
+void CloseTelemetryStore(TelemetryStore *store)
+{
+    if (store == NULL) {
+        return;
+    }
+
+    FlushTelemetryStore(store);
+    if (store->ownsFd) {
+        close(store->fd);
+    }
+    free(store);
+}
+
+int AppendTelemetryStoreRecord(TelemetryStore *store, const void *data, size_t length,
+                               uint32_t *sequence)
+{
+    size_t recordSize = RECORD_HEADER_SIZE + length;
+    if (length > MAX_RECORD_LENGTH || SEGMENT_HEADER_SIZE + recordSize > store->segmentSize) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (GetLogEnd(store) + recordSize > store->segmentSize) {
+        // Compaction only frees space if some of the records in the segment were acknowledged.
+        bool isReclaimable = store->acknowledgedSequence >= store->firstSequence;
+        if (isReclaimable && CompactTelemetryStore(store) != 0) {
+            return -1;
+        }
+        if (GetLogEnd(store) + recordSize > store->segmentSize) {
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+
+    uint32_t newSequence = store->lastSequence + 1;
+    uint8_t header[RECORD_HEADER_SIZE];
+    EncodeRecordHeader(header, length, RECORD_TYPE_DATA, newSequence);
+    uint32_t crc = UpdateCrc32(
+        StartRecordCrc(store->generation, store->firstSequence, header), data, length);
+    PutUint32(header + 8, ~crc);
+
+    if (AppendToLog(store, header, sizeof(header)) != 0 || AppendToLog(store, data, length) != 0) {
+        return -1;
+    }
+
+    store->lastSequence = newSequence;
+    store->payloadBytesAppended += length;
+    if (sequence != NULL) {
+        *sequence = newSequence;
+    }
+    return 0;
+}
+
+int FlushTelemetryStore(TelemetryStore *store)
+{
+    if (store->writeBufferLength == 0) {
+        return 0;
+    }
+
+    if (WriteBufferToFile(store) != 0) {
+        return -1;
+    }
+    return fsync(store->fd);
+}
+
+int ReadNextTelemetryStoreRecord(TelemetryStore *store, void *buffer, size_t bufferSize,
+                                 size_t *length, uint32_t *sequence)
+{
+    uint8_t header[RECORD_HEADER_SIZE];
+
+    while (IsTelemetryStoreReplayPending(store)) {
+        int result = ReadRecordHeader(store, store->replayOffset, header);
+        if (result <= 0) {
+            if (result == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+
+        size_t recordLength = GetUint16(header);
+        uint32_t recordSequence = GetUint32(header + 4);
+        size_t position = store->replayOffset;
+        store->replayOffset += RECORD_HEADER_SIZE + recordLength;
+
+        if (header[2] != RECORD_TYPE_DATA || recordSequence <= store->replayedSequence) {
+            continue;
+        }
+
+        store->replayedSequence = recordSequence;
+        *sequence = recordSequence;
+        if (recordLength > bufferSize) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (ReadLog(store, position + RECORD_HEADER_SIZE, buffer, recordLength) != 0) {
+            return -1;
+        }
+
+        *length = recordLength;
+        return 1;
+    }
+
+    return 0;
+}
+
+bool IsTelemetryStoreReplayPending(const TelemetryStore *store)
+{
+    return store->lastSequence > store->replayedSequence;
+}
+
+int AcknowledgeTelemetryStoreRecords(TelemetryStore *store, uint32_t sequence)
+{
+    if (sequence > store->lastSequence) {
+        sequence = store->lastSequence;
+    }
+    if (sequence <= store->acknowledgedSequence) {
+        return 0;
+    }
+
+    store->acknowledgedSequence = sequence;
+    if (store->replayedSequence < sequence) {
+        store->replayedSequence = sequence;
+    }
+
+    // Once everything has been delivered, compaction only needs to write a segment header,
+    // so do it early rather than waiting for the segment to fill up.
+    bool isDrained = sequence == store->lastSequence;
+    if ((isDrained && GetLogEnd(store) > store->segmentSize / 2) ||
+        GetLogEnd(store) + RECORD_HEADER_SIZE > store->segmentSize) {
+        // The new segment header records the acknowledgement.
+        return CompactTelemetryStore(store);
+    }
+
+    uint8_t header[RECORD_HEADER_SIZE];
+    EncodeRecordHeader(header, 0, RECORD_TYPE_ACK, sequence);
+    PutUint32(header + 8, ~StartRecordCrc(store->generation, store->firstSequence, header));
+    return AppendToLog(store, header, sizeof(header));
+}
+
+void RewindTelemetryStore(TelemetryStore *store)
+{
+    store->replayOffset = SEGMENT_HEADER_SIZE;
+    store->replayedSequence = store->acknowledgedSequence;
+}
+
+void GetTelemetryStoreStats(const TelemetryStore *store, TelemetryStoreStats *stats)
+{
+    stats->pendingCount = store->lastSequence - store->acknowledgedSequence;
+    stats->usedBytes = GetLogEnd(store);
+    stats->segmentBytes = store->segmentSize;
+    stats->compactionCount = store->compactionCount;
+    stats->flushCount = store->flushCount;
+    stats->bytesWritten = store->bytesWritten;
+    stats->payloadBytesAppended = store->payloadBytesAppended;
+}
@@ -0,0 +1,142 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved.
+   Licensed under the MIT License. */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/// <summary>
+/// Opaque handle. Obtain via <see cref="OpenTelemetryStore" /> or
+/// <see cref="OpenTelemetryStoreFile" /> and dispose of via <see cref="CloseTelemetryStore" />.
+/// </summary>
+/// <remarks>
+/// The store is an append-only, log-structured queue of CRC-framed records kept in a region
+/// of a file. The region is split into two segments; records are appended to the active
+/// segment and acknowledgements are appended as small marker records. When the active
+/// segment fills up, or once everything in it has been acknowledged, the records which are
+/// still unacknowledged are copied to the other segment, which then becomes active.
+/// Appends are collected in a RAM write buffer and written in batches.
+/// Delivery is at-least-once: records acknowledged after the last flush are replayed again
+/// after a restart.
+/// </remarks>
+typedef struct TelemetryStore TelemetryStore;
+
+/// <summary>
+/// Store statistics.
+/// </summary>
+typedef struct {
+    /// <summary>Records which have not been acknowledged.</summary>
+    size_t pendingCount;
+    /// <summary>Bytes used in the active segment, including buffered writes.</summary>
+    size_t usedBytes;
+    /// <summary>Size of each of the two segments.</summary>
+    size_t segmentBytes;
+    /// <summary>Number of times records were moved to the other segment.</summary>
+    uint32_t compactionCount;
+    /// <summary>Number of batched writes to the file.</summary>
+    uint32_t flushCount;
+    /// <summary>Total bytes written to the file, including compaction copies.</summary>
+    uint64_t bytesWritten;
+    /// <summary>Total payload bytes appended by the application.</summary>
+    uint64_t payloadBytesAppended;
+} TelemetryStoreStats;
+
+/// <summary>
+/// Open a store in a region of an already-open file, recovering any records written by a
+/// previous instance. The file descriptor is not closed by <see cref="CloseTelemetryStore" />.
+/// </summary>
+/// <param name="fd">File descriptor opened for reading and writing, such as the one
+/// returned by Storage_OpenMutableFile.</param>
+/// <param name="offset">Offset of the region within the file.</param>
+/// <param name="size">Size of the region in bytes.</param>
+/// <returns>On success, pointer to new TelemetryStore, which should be disposed of
+/// with <see cref="CloseTelemetryStore" />. On failure, returns NULL, with more
+/// information available in errno.</returns>
+TelemetryStore *OpenTelemetryStore(int fd, off_t offset, size_t size);
+
+/// <summary>
+/// Open a store which occupies the start of a regular file, creating the file if needed.
+/// This is intended for running the store on a development host; the file is closed by
+/// <see cref="CloseTelemetryStore" />.
+/// </summary>
+/// <param name="path">Path of the file.</param>
+/// <param name="size">Size of the store in bytes.</param>
+/// <returns>On success, pointer to new TelemetryStore. On failure, returns NULL, with more
+/// information available in errno.</returns>
+TelemetryStore *OpenTelemetryStoreFile(const char *path, size_t size);
+
+/// <summary>
+/// Flush buffered writes and dispose of a store.
+/// It is safe to call this function with a NULL pointer.
+/// </summary>
+/// <param name="store">Successfully opened store, or NULL.</param>
+void CloseTelemetryStore(TelemetryStore *store);
+
+/// <summary>
+/// Append a record. The record is buffered in RAM until the write buffer fills up or
+/// <see cref="FlushTelemetryStore" /> is called.
+/// </summary>
+/// <param name="store">Successfully opened store.</param>
+/// <param name="data">Record payload.</param>
+/// <param name="length">Payload length in bytes.</param>
+/// <param name="sequence">Receives the sequence number of the record, which is never 0.
+/// May be NULL.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.
+/// ENOSPC indicates the store is full of unacknowledged records.</returns>
+int AppendTelemetryStoreRecord(TelemetryStore *store, const void *data, size_t length,
+                               uint32_t *sequence);
+
+/// <summary>
+/// Write buffered records and acknowledgements to the file.
+/// </summary>
+/// <param name="store">Successfully opened store.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.</returns>
+int FlushTelemetryStore(TelemetryStore *store);
+
+/// <summary>
+/// Read the next unacknowledged record after the replay cursor, in append order, and advance
+/// the cursor past it. The record stays in the store until it is acknowledged.
+/// </summary>
+/// <param name="store">Successfully opened store.</param>
+/// <param name="buffer">Receives the payload.</param>
+/// <param name="bufferSize">Size of buffer in bytes.</param>
+/// <param name="length">Receives the payload length.</param>
+/// <param name="sequence">Receives the record's sequence number.</param>
+/// <returns>1 if a record was read, 0 if there are no more records to replay, or -1 on
+/// failure, in which case errno contains more information. EMSGSIZE indicates the record
+/// did not fit in buffer; the cursor is advanced past it.</returns>
+int ReadNextTelemetryStoreRecord(TelemetryStore *store, void *buffer, size_t bufferSize,
+                                 size_t *length, uint32_t *sequence);
+
+/// <summary>
+/// Check whether there are records after the replay cursor.
+/// </summary>
+/// <param name="store">Successfully opened store.</param>
+/// <returns>true if <see cref="ReadNextTelemetryStoreRecord" /> has records to return.</returns>
+bool IsTelemetryStoreReplayPending(const TelemetryStore *store);
+
+/// <summary>
+/// Acknowledge all records up to and including the given sequence number. Acknowledged
+/// records are dropped the next time the store is compacted.
+/// </summary>
+/// <param name="store">Successfully opened store.</param>
+/// <param name="sequence">Sequence number of the newest delivered record.</param>
+/// <returns>0 on success, -1 on failure, in which case errno contains more information.</returns>
+int AcknowledgeTelemetryStoreRecords(TelemetryStore *store, uint32_t sequence);
+
+/// <summary>
+/// Move the replay cursor back to the oldest unacknowledged record, for example after a
+/// replayed record failed to be delivered.
+/// </summary>
+/// <param name="store">Successfully opened store.</param>
+void RewindTelemetryStore(TelemetryStore *store);
+
+/// <summary>
+/// Get store statistics.
+/// </summary>
+/// <param name="store">Successfully opened store.</param>
+/// <param name="stats">Receives the statistics.</param>
+void GetTelemetryStoreStats(const TelemetryStore *store, TelemetryStoreStats *stats);